@@ -0,0 +1,93 @@
+#ifndef OCTOMAP_PATH_PLANNER_INCREMENTAL_OCTOMAP_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_INCREMENTAL_OCTOMAP_H_INCLUDED
+
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+
+#include <ros/ros.h>
+#include <octomap/octomap.h>
+#include <octomap_msgs/Octomap.h>
+
+#include <octomap_path_planner/OctomapUpdate.h>
+
+
+/**
+ * Box of voxel keys (at maximum tree depth, bounds inclusive) changed by
+ * a map update, or the whole map.
+ */
+struct OctomapRegion
+{
+    bool full;
+    bool empty;
+    octomap::OcTreeKey min;
+    octomap::OcTreeKey max;
+
+    OctomapRegion() : full(false), empty(true) {}
+
+    void setFull()
+    {
+        full = true;
+        empty = false;
+    }
+
+    void add(const octomap::OcTreeKey& kmin, const octomap::OcTreeKey& kmax)
+    {
+        for(int i = 0; i < 3; i++)
+        {
+            min[i] = empty ? kmin[i] : std::min(min[i], kmin[i]);
+            max[i] = empty ? kmax[i] : std::max(max[i], kmax[i]);
+        }
+        empty = false;
+    }
+
+    void add(const OctomapRegion& o)
+    {
+        if(o.full) setFull();
+        else if(!o.empty) add(o.min, o.max);
+    }
+};
+
+
+/**
+ * Persistent octomap kept up to date by merging partial updates
+ * (OctomapUpdate messages) into it, so that the cost of an update depends
+ * on the size of the updated region and not on the size of the map.
+ *
+ * The map is synchronized by a full map; updates older than it are
+ * skipped, and a gap in the update sequence unsynchronizes it until the
+ * next full map.
+ *
+ * Merging edits the nodes in place without pruning (only collapsed leafs
+ * straddling the box are expanded), so leafs outside the box never change
+ * identity, and the tree's node count (size()) is not maintained.
+ */
+class IncrementalOctomap
+{
+public:
+    IncrementalOctomap();
+
+    bool setFullMap(const octomap_msgs::Octomap& msg, OctomapRegion& changed);
+    bool getUpdateBounds(const octomap_path_planner::OctomapUpdate& msg, octomap::OcTreeKey& min, octomap::OcTreeKey& max) const;
+    bool applyUpdate(const octomap_path_planner::OctomapUpdate& msg, OctomapRegion& changed);
+
+    bool isSynchronized() const {return synchronized_;}
+    boost::shared_ptr<octomap::OcTree> tree() const {return tree_;}
+    size_t numUpdates() const {return num_updates_;}
+    size_t numGaps() const {return num_gaps_;}
+
+protected:
+    octomap::key_type coordToKeyClamped(double c) const;
+    void copyNode(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src);
+    bool mergeNode(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src, const octomap::OcTreeKey& key, unsigned depth, const octomap::OcTreeKey& min, const octomap::OcTreeKey& max, OctomapRegion& changed);
+
+    boost::shared_ptr<octomap::OcTree> tree_;
+    bool synchronized_;
+    bool have_sequence_;
+    uint32_t last_sequence_;
+    ros::Time base_stamp_;
+    size_t num_updates_;
+    size_t num_gaps_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_INCREMENTAL_OCTOMAP_H_INCLUDED
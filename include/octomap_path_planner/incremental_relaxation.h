@@ -0,0 +1,223 @@
+#ifndef OCTOMAP_PATH_PLANNER_INCREMENTAL_RELAXATION_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_INCREMENTAL_RELAXATION_H_INCLUDED
+
+#include <vector>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <limits>
+
+
+/**
+ * Shortest path distances from a source over a graph of n nodes, kept up
+ * to date as the graph changes, in the way of LPA* and D* Lite: each node
+ * has besides its value a one-step lookahead (rhs, the minimum over its
+ * neighbors of their value plus the edge length), and only the nodes where
+ * the two differ (inconsistent nodes) are expanded again, so the cost of a
+ * repair grows with the change rather than the size of the graph.
+ *
+ * Nodes are expanded in the order of their value plus heuristic(i), a
+ * lower bound on the distance to a target (e.g. the robot): run() can then
+ * stop as soon as the target's value is final, as D* Lite does, and be
+ * called again later to repair the rest. Keys are recomputed on every
+ * update(), so the target may move between updates (no key modifier as in
+ * D* Lite is needed).
+ *
+ * When no node is left inconsistent, the values are those of a Dijkstra
+ * from the source, whatever the changes in between.
+ *
+ * Neighbors is called as neighbors(i, indices, lengths), and edges must be
+ * symmetric; Heuristic as heuristic(i), and must be consistent (no more
+ * than the edge lengths apart between neighbors).
+ */
+template<class Neighbors, class Heuristic>
+class IncrementalRelaxation
+{
+public:
+    IncrementalRelaxation(const Neighbors& neighbors, std::vector<float>& values)
+        : neighbors_(neighbors),
+          values_(values),
+          source_(0),
+          expansions_(0)
+    {
+    }
+
+    /**
+     * Start over from source: all other values infinite.
+     */
+    void reset(size_t source, const Heuristic& heuristic)
+    {
+        source_ = source;
+        heuristic_ = heuristic;
+        heap_.clear();
+        std::fill(values_.begin(), values_.end(), std::numeric_limits<float>::infinity());
+        rhs_.assign(values_.size(), std::numeric_limits<float>::infinity());
+        rhs_[source_] = 0.0f;
+        push(source_);
+    }
+
+    /**
+     * The graph changed, and the caller moved the values of the remaining
+     * nodes to their new indices: the nodes whose neighbors could have
+     * changed (the added ones and the neighbors of the removed ones) are in
+     * dirty, and any node left inconsistent by a previous run must either
+     * be in dirty (after takePending(), if the indices changed), or is
+     * still pending.
+     */
+    void update(size_t source, const std::vector<int>& dirty, const Heuristic& heuristic)
+    {
+        std::vector<int> nodes(dirty);
+        takePending(nodes);
+
+        source_ = source;
+        heuristic_ = heuristic;
+        rhs_ = values_;
+        rhs_[source_] = 0.0f;
+        push(source_);
+        for(size_t k = 0; k < nodes.size(); k++)
+            updateNode(nodes[k]);
+    }
+
+    /**
+     * Append the inconsistent nodes to nodes, and forget them.
+     */
+    void takePending(std::vector<int>& nodes)
+    {
+        for(size_t k = 0; k < heap_.size(); k++)
+            if(values_[heap_[k].node] != rhs_[heap_[k].node])
+                nodes.push_back(heap_[k].node);
+        heap_.clear();
+    }
+
+    bool done()
+    {
+        discardStale();
+        return heap_.empty();
+    }
+
+    /**
+     * Expand the inconsistent nodes until the value of target is final and
+     * the nodes with a key up to margin above its own are too (or all of
+     * them, with target -1), or max_expansions. Returns false if stopped by
+     * max_expansions.
+     */
+    bool run(int target = -1, float margin = 0.0f, size_t max_expansions = std::numeric_limits<size_t>::max())
+    {
+        std::vector<int> indices, indices2;
+        std::vector<float> lengths, lengths2;
+        for(size_t n = 0; n < max_expansions; n++)
+        {
+            discardStale();
+            if(heap_.empty()) return true;
+            if(target != -1 && values_[target] == rhs_[target])
+            {
+                const float g = std::min(values_[target], rhs_[target]);
+                if(heap_.front().key1 > g + heuristic_(target) + margin) return true;
+            }
+
+            std::pop_heap(heap_.begin(), heap_.end(), std::greater<Entry>());
+            const size_t u = heap_.back().node;
+            heap_.pop_back();
+            expansions_++;
+
+            neighbors_(u, indices, lengths);
+            if(rhs_[u] < values_[u])
+            {
+                // over-consistent: settle it, and lower its neighbors
+                values_[u] = rhs_[u];
+                for(size_t k = 0; k < indices.size(); k++)
+                {
+                    const int s = indices[k];
+                    const float value = values_[u] + lengths[k];
+                    if(s == int(source_) || value >= rhs_[s]) continue;
+                    rhs_[s] = value;
+                    push(s);
+                }
+            }
+            else
+            {
+                // under-consistent: unsettle it, and recompute the
+                // neighbors that depended on it
+                const float old_value = values_[u];
+                values_[u] = std::numeric_limits<float>::infinity();
+                for(size_t k = 0; k < indices.size(); k++)
+                {
+                    const int s = indices[k];
+                    // (rhs is never above the value through u; the
+                    // tolerance is for float rounding)
+                    if(rhs_[s] >= (old_value + lengths[k]) * (1.0f - 1e-6f))
+                        updateNode(s, indices2, lengths2);
+                }
+                updateNode(u, indices2, lengths2);
+            }
+        }
+        return false;
+    }
+
+    size_t expansions() const {return expansions_;}
+
+protected:
+    struct Entry
+    {
+        float key1;
+        float key2;
+        size_t node;
+
+        Entry(float k1, float k2, size_t n) : key1(k1), key2(k2), node(n) {}
+
+        bool operator>(const Entry& e) const
+        {
+            return key1 > e.key1 || (key1 == e.key1 && key2 > e.key2);
+        }
+    };
+
+    void push(size_t i)
+    {
+        if(values_[i] == rhs_[i]) return;
+        const float g = std::min(values_[i], rhs_[i]);
+        heap_.push_back(Entry(g + heuristic_(i), g, i));
+        std::push_heap(heap_.begin(), heap_.end(), std::greater<Entry>());
+    }
+
+    // (nodes are pushed again when their key changes: the entries of
+    // consistent nodes and those with an old key are left behind)
+    void discardStale()
+    {
+        while(!heap_.empty())
+        {
+            const Entry& e = heap_.front();
+            if(values_[e.node] != rhs_[e.node] && e.key2 == std::min(values_[e.node], rhs_[e.node])) return;
+            std::pop_heap(heap_.begin(), heap_.end(), std::greater<Entry>());
+            heap_.pop_back();
+        }
+    }
+
+    void updateNode(size_t i)
+    {
+        std::vector<int> indices;
+        std::vector<float> lengths;
+        updateNode(i, indices, lengths);
+    }
+
+    // recompute the rhs of i from its neighbors
+    void updateNode(size_t i, std::vector<int>& indices, std::vector<float>& lengths)
+    {
+        if(i == source_) return;
+        float rhs = std::numeric_limits<float>::infinity();
+        neighbors_(i, indices, lengths);
+        for(size_t k = 0; k < indices.size(); k++)
+            rhs = std::min(rhs, values_[indices[k]] + lengths[k]);
+        rhs_[i] = rhs;
+        push(i);
+    }
+
+    Neighbors neighbors_;
+    std::vector<float>& values_;
+    std::vector<float> rhs_;
+    std::vector<Entry> heap_;
+    Heuristic heuristic_;
+    size_t source_;
+    size_t expansions_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_INCREMENTAL_RELAXATION_H_INCLUDED
@@ -0,0 +1,154 @@
+#ifndef OCTOMAP_PATH_PLANNER_LATENCY_HISTOGRAM_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_LATENCY_HISTOGRAM_H_INCLUDED
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <algorithm>
+
+#include <ros/ros.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+
+
+/**
+ * Latency histogram with power-of-two microsecond buckets.
+ *
+ * Bucket 0 counts samples below 1us, bucket i counts samples in
+ * [2^(i-1), 2^i) us, and the last bucket is open ended (>= ~4s).
+ * Adding a sample is O(1) and allocation free, so it can be used from
+ * inside the control loop.
+ */
+class LatencyHistogram
+{
+public:
+    static const int num_buckets = 24;
+
+    LatencyHistogram()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        std::fill(buckets_, buckets_ + num_buckets, 0);
+        count_ = 0;
+        sum_ = 0.0;
+        max_ = 0.0;
+    }
+
+    void add(double seconds)
+    {
+        double us = seconds * 1e6;
+        int b = 0;
+        if(us >= 1.0)
+        {
+            b = 1 + (int)floor(log2(us));
+            if(b >= num_buckets) b = num_buckets - 1;
+        }
+        buckets_[b]++;
+        count_++;
+        sum_ += seconds;
+        max_ = std::max(max_, seconds);
+    }
+
+    void merge(const LatencyHistogram& other)
+    {
+        for(int b = 0; b < num_buckets; b++)
+            buckets_[b] += other.buckets_[b];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    size_t count() const
+    {
+        return count_;
+    }
+
+    double mean() const
+    {
+        return count_ ? sum_ / count_ : 0.0;
+    }
+
+    double max() const
+    {
+        return max_;
+    }
+
+    /**
+     * Upper bound (in seconds) of the bucket containing the p-th percentile.
+     */
+    double percentile(double p) const
+    {
+        if(!count_) return 0.0;
+        size_t rank = (size_t)ceil(p * count_), n = 0;
+        for(int b = 0; b < num_buckets; b++)
+        {
+            n += buckets_[b];
+            if(n >= rank) return std::min(max_, bucketUpperBound(b));
+        }
+        return max_;
+    }
+
+    static double bucketUpperBound(int b)
+    {
+        return ldexp(1.0, b) * 1e-6;
+    }
+
+    void toDiagnostics(const std::string& name, diagnostic_msgs::DiagnosticStatus& status) const
+    {
+        addValue(status, name + " count", (double)count_, "%.0f");
+        addValue(status, name + " mean [ms]", mean() * 1e3, "%.3f");
+        addValue(status, name + " p50 [ms]", percentile(0.50) * 1e3, "%.3f");
+        addValue(status, name + " p95 [ms]", percentile(0.95) * 1e3, "%.3f");
+        addValue(status, name + " p99 [ms]", percentile(0.99) * 1e3, "%.3f");
+        addValue(status, name + " max [ms]", max_ * 1e3, "%.3f");
+        for(int b = 0; b < num_buckets; b++)
+        {
+            if(!buckets_[b]) continue;
+            char key[64];
+            snprintf(key, sizeof(key), " < %g ms", bucketUpperBound(b) * 1e3);
+            addValue(status, name + key, (double)buckets_[b], "%.0f");
+        }
+    }
+
+protected:
+    static void addValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, double value, const char *fmt)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), fmt, value);
+        diagnostic_msgs::KeyValue kv;
+        kv.key = key;
+        kv.value = buf;
+        status.values.push_back(kv);
+    }
+
+    size_t buckets_[num_buckets];
+    size_t count_;
+    double sum_;
+    double max_;
+};
+
+
+/**
+ * Measures the duration of a scope into a LatencyHistogram.
+ */
+class ScopedLatency
+{
+public:
+    ScopedLatency(LatencyHistogram& hist)
+        : hist_(hist), start_(ros::WallTime::now())
+    {
+    }
+
+    ~ScopedLatency()
+    {
+        hist_.add((ros::WallTime::now() - start_).toSec());
+    }
+
+protected:
+    LatencyHistogram& hist_;
+    ros::WallTime start_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_LATENCY_HISTOGRAM_H_INCLUDED
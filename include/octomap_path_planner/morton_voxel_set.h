@@ -0,0 +1,421 @@
+#ifndef OCTOMAP_PATH_PLANNER_MORTON_VOXEL_SET_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_MORTON_VOXEL_SET_H_INCLUDED
+
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <limits>
+
+#include <stdint.h>
+
+#include <octomap/octomap.h>
+
+
+/**
+ * Compact set of voxels: octree keys (at maximum depth) packed in 64 bits
+ * and kept sorted in Morton (Z-)order, so that voxels close in space are
+ * mostly close in memory.
+ *
+ * The sorted codes form an implicit octree (a cube of the key space is a
+ * contiguous range of codes), which serves point lookups (binary search),
+ * radius and nearest neighbor queries, without any other index.
+ *
+ * Elements are appended with push_back() and become searchable after
+ * sort(), which only sorts the appended tail and merges it.
+ */
+class MortonKeySet
+{
+public:
+    typedef uint64_t Code;
+
+    MortonKeySet() : sorted_(0) {}
+
+    static Code encode(const octomap::OcTreeKey& key)
+    {
+        return spread(key[0]) | (spread(key[1]) << 1) | (spread(key[2]) << 2);
+    }
+
+    static octomap::OcTreeKey decode(Code code)
+    {
+        return octomap::OcTreeKey(compact(code), compact(code >> 1), compact(code >> 2));
+    }
+
+    size_t size() const {return codes_.size();}
+    bool empty() const {return codes_.empty();}
+    Code code(size_t i) const {return codes_[i];}
+    octomap::OcTreeKey key(size_t i) const {return decode(codes_[i]);}
+    size_t memoryUsage() const {return codes_.capacity() * sizeof(Code);}
+
+    void clear()
+    {
+        codes_.clear();
+        sorted_ = 0;
+    }
+
+    void reserve(size_t n)
+    {
+        codes_.reserve(n);
+    }
+
+    void push_back(const octomap::OcTreeKey& key)
+    {
+        codes_.push_back(encode(key));
+    }
+
+    void sort()
+    {
+        if(sorted_ == codes_.size()) return;
+        std::sort(codes_.begin() + sorted_, codes_.end());
+        std::inplace_merge(codes_.begin(), codes_.begin() + sorted_, codes_.end());
+        codes_.erase(std::unique(codes_.begin(), codes_.end()), codes_.end());
+        sorted_ = codes_.size();
+    }
+
+    /**
+     * Index of a key, or -1.
+     */
+    int find(const octomap::OcTreeKey& key) const
+    {
+        const Code c = encode(key);
+        std::vector<Code>::const_iterator it = std::lower_bound(codes_.begin(), codes_.begin() + sorted_, c);
+        return it != codes_.begin() + sorted_ && *it == c ? int(it - codes_.begin()) : -1;
+    }
+
+    /**
+     * Keep only the elements whose key doesn't satisfy pred (in order).
+     */
+    template<class Predicate>
+    void removeIf(Predicate pred)
+    {
+        size_t j = 0;
+        for(size_t i = 0; i < codes_.size(); i++)
+        {
+            if(pred(decode(codes_[i]))) continue;
+            codes_[j++] = codes_[i];
+        }
+        codes_.resize(j);
+        sorted_ = std::min(sorted_, j);
+    }
+
+    /**
+     * Call visitor(index, squared distance) for the elements within radius
+     * (in voxels) of center, until it returns false. Returns false if the
+     * visitor stopped the search.
+     */
+    template<class Visitor>
+    bool visitBall(const octomap::OcTreeKey& center, double radius, Visitor& visitor) const
+    {
+        const int c[3] = {center[0], center[1], center[2]};
+        return visitCube(c, radius * radius, 0, sorted_, 0, 16, visitor);
+    }
+
+    void radiusSearch(const octomap::OcTreeKey& center, double radius, std::vector<int>& indices, std::vector<float>& sqr_distances) const
+    {
+        indices.clear();
+        sqr_distances.clear();
+        CollectVisitor v(indices, sqr_distances);
+        visitBall(center, radius, v);
+    }
+
+    /**
+     * Check if some element is closer than radius (in voxels) to center.
+     */
+    bool isAnyCloserThan(const octomap::OcTreeKey& center, double radius) const
+    {
+        CloserThanVisitor v(radius * radius);
+        return !visitBall(center, radius, v);
+    }
+
+    /**
+     * Index of the element nearest to center, or -1 if empty.
+     */
+    int nearest(const octomap::OcTreeKey& center) const
+    {
+        const int c[3] = {center[0], center[1], center[2]};
+        int best = -1;
+        double best_d2 = std::numeric_limits<double>::infinity();
+        nearestInCube(c, 0, sorted_, 0, 16, best, best_d2);
+        return best;
+    }
+
+    static double squaredDistance(const octomap::OcTreeKey& a, const octomap::OcTreeKey& b)
+    {
+        double d2 = 0.0;
+        for(int k = 0; k < 3; k++)
+        {
+            double d = double(a[k]) - double(b[k]);
+            d2 += d * d;
+        }
+        return d2;
+    }
+
+protected:
+    // (bit interleaving of 16 bit keys, one bit every three)
+    static Code spread(Code x)
+    {
+        x &= 0xFFFF;
+        x = (x | (x << 16)) & 0x0000FF0000FFULL;
+        x = (x | (x << 8)) & 0x00F00F00F00FULL;
+        x = (x | (x << 4)) & 0x0C30C30C30C3ULL;
+        x = (x | (x << 2)) & 0x249249249249ULL;
+        return x;
+    }
+
+    static octomap::key_type compact(Code x)
+    {
+        x &= 0x249249249249ULL;
+        x = (x | (x >> 2)) & 0x0C30C30C30C3ULL;
+        x = (x | (x >> 4)) & 0x00F00F00F00FULL;
+        x = (x | (x >> 8)) & 0x0000FF0000FFULL;
+        x = (x | (x >> 16)) & 0xFFFF;
+        return (octomap::key_type)x;
+    }
+
+    // squared distance from c to the cube of side 2^level at the key of
+    // the Morton prefix:
+    static double cubeDistance(const int c[3], Code prefix, unsigned level)
+    {
+        const octomap::OcTreeKey lo = decode(prefix);
+        const int side = 1 << level;
+        double d2 = 0.0;
+        for(int k = 0; k < 3; k++)
+        {
+            int d = c[k] < lo[k] ? lo[k] - c[k] : c[k] > lo[k] + side - 1 ? c[k] - (lo[k] + side - 1) : 0;
+            d2 += double(d) * d;
+        }
+        return d2;
+    }
+
+    static double pointDistance(const int c[3], Code code)
+    {
+        const octomap::OcTreeKey k = decode(code);
+        double d2 = 0.0;
+        for(int i = 0; i < 3; i++)
+            d2 += double(k[i] - c[i]) * (k[i] - c[i]);
+        return d2;
+    }
+
+    // [begin, end) are the elements in the cube of the prefix
+    template<class Visitor>
+    bool visitCube(const int c[3], double r2, size_t begin, size_t end, Code prefix, unsigned level, Visitor& visitor) const
+    {
+        if(cubeDistance(c, prefix, level) > r2) return true;
+
+        if(end - begin <= 8)
+        {
+            for(size_t i = begin; i < end; i++)
+            {
+                double d2 = pointDistance(c, codes_[i]);
+                if(d2 <= r2 && !visitor(i, d2)) return false;
+            }
+            return true;
+        }
+
+        const Code child_size = Code(1) << (3 * (level - 1));
+        size_t b = begin;
+        for(int i = 0; i < 8 && b < end; i++)
+        {
+            const Code child_prefix = prefix + i * child_size;
+            size_t e = std::lower_bound(codes_.begin() + b, codes_.begin() + end, child_prefix + child_size) - codes_.begin();
+            if(e > b && !visitCube(c, r2, b, e, child_prefix, level - 1, visitor)) return false;
+            b = e;
+        }
+        return true;
+    }
+
+    void nearestInCube(const int c[3], size_t begin, size_t end, Code prefix, unsigned level, int& best, double& best_d2) const
+    {
+        if(cubeDistance(c, prefix, level) >= best_d2) return;
+
+        if(end - begin <= 8)
+        {
+            for(size_t i = begin; i < end; i++)
+            {
+                double d2 = pointDistance(c, codes_[i]);
+                if(d2 < best_d2)
+                {
+                    best_d2 = d2;
+                    best = i;
+                }
+            }
+            return;
+        }
+
+        // visit the nearest children first, to prune more:
+        const Code child_size = Code(1) << (3 * (level - 1));
+        std::pair<double, int> order[8];
+        size_t bounds[9];
+        int n = 0;
+        bounds[0] = begin;
+        for(int i = 0; i < 8; i++)
+        {
+            const Code child_prefix = prefix + i * child_size;
+            bounds[i + 1] = std::lower_bound(codes_.begin() + bounds[i], codes_.begin() + end, child_prefix + child_size) - codes_.begin();
+            if(bounds[i + 1] > bounds[i])
+                order[n++] = std::make_pair(cubeDistance(c, child_prefix, level - 1), i);
+        }
+        std::sort(order, order + n);
+        for(int j = 0; j < n; j++)
+        {
+            const int i = order[j].second;
+            nearestInCube(c, bounds[i], bounds[i + 1], prefix + i * child_size, level - 1, best, best_d2);
+        }
+    }
+
+    struct CollectVisitor
+    {
+        std::vector<int>& indices;
+        std::vector<float>& sqr_distances;
+
+        CollectVisitor(std::vector<int>& i, std::vector<float>& d) : indices(i), sqr_distances(d) {}
+
+        bool operator()(size_t i, double d2)
+        {
+            indices.push_back(i);
+            sqr_distances.push_back(d2);
+            return true;
+        }
+    };
+
+    struct CloserThanVisitor
+    {
+        double r2;
+
+        CloserThanVisitor(double r) : r2(r) {}
+
+        bool operator()(size_t i, double d2)
+        {
+            return d2 >= r2;
+        }
+    };
+
+    std::vector<Code> codes_;
+    size_t sorted_;
+};
+
+
+/**
+ * MortonKeySet with a value per voxel, in a parallel array.
+ */
+template<typename T>
+class MortonVoxelMap : public MortonKeySet
+{
+public:
+    T& value(size_t i) {return values_[i];}
+    const T& value(size_t i) const {return values_[i];}
+    std::vector<T>& values() {return values_;}
+    const std::vector<T>& values() const {return values_;}
+    size_t memoryUsage() const {return MortonKeySet::memoryUsage() + values_.capacity() * sizeof(T);}
+
+    void clear()
+    {
+        MortonKeySet::clear();
+        values_.clear();
+    }
+
+    void reserve(size_t n)
+    {
+        MortonKeySet::reserve(n);
+        values_.reserve(n);
+    }
+
+    void push_back(const octomap::OcTreeKey& key, const T& value)
+    {
+        MortonKeySet::push_back(key);
+        values_.push_back(value);
+    }
+
+    void fill(const T& value)
+    {
+        std::fill(values_.begin(), values_.end(), value);
+    }
+
+    /**
+     * Sort by code, moving the values along (for duplicate keys, the
+     * first pushed value is kept).
+     */
+    void sort()
+    {
+        if(sorted_ == codes_.size()) return;
+
+        bool in_order = true;
+        for(size_t i = std::max<size_t>(sorted_, 1); i < codes_.size() && in_order; i++)
+            in_order = codes_[i - 1] < codes_[i];
+        if(!in_order)
+        {
+            std::vector<std::pair<Code, size_t> > order(codes_.size());
+            for(size_t i = 0; i < codes_.size(); i++)
+                order[i] = std::make_pair(codes_[i], i);
+            std::stable_sort(order.begin(), order.end(), compareCodes);
+            std::vector<T> values;
+            values.reserve(values_.size());
+            size_t j = 0;
+            for(size_t i = 0; i < order.size(); i++)
+            {
+                if(j > 0 && codes_[j - 1] == order[i].first) continue;
+                codes_[j++] = order[i].first;
+                values.push_back(values_[order[i].second]);
+            }
+            codes_.resize(j);
+            values_.swap(values);
+        }
+        sorted_ = codes_.size();
+    }
+
+    template<class Predicate>
+    void removeIf(Predicate pred)
+    {
+        size_t j = 0;
+        for(size_t i = 0; i < codes_.size(); i++)
+        {
+            if(pred(decode(codes_[i]))) continue;
+            codes_[j] = codes_[i];
+            values_[j] = values_[i];
+            j++;
+        }
+        codes_.resize(j);
+        values_.resize(j);
+        sorted_ = std::min(sorted_, j);
+    }
+
+protected:
+    static bool compareCodes(const std::pair<Code, size_t>& a, const std::pair<Code, size_t>& b)
+    {
+        return a.first < b.first;
+    }
+
+    std::vector<T> values_;
+};
+
+
+/**
+ * Carry the values of previous (the old ground voxels in region) over to
+ * the same voxels of ground in region, giving the others an infinite
+ * value, and collect the keys of the voxels added and removed.
+ */
+template<class Region>
+void carryValues(const MortonVoxelMap<float>& previous, MortonVoxelMap<float>& ground, const Region& region, std::vector<octomap::OcTreeKey>& added, std::vector<octomap::OcTreeKey>& removed)
+{
+    size_t j = 0;
+    for(size_t i = 0; i < ground.size(); i++)
+    {
+        if(!region(ground.key(i))) continue;
+        const MortonKeySet::Code c = ground.code(i);
+        while(j < previous.size() && previous.code(j) < c)
+            removed.push_back(previous.key(j++));
+        if(j < previous.size() && previous.code(j) == c)
+        {
+            ground.value(i) = previous.value(j++);
+        }
+        else
+        {
+            ground.value(i) = std::numeric_limits<float>::infinity();
+            added.push_back(ground.key(i));
+        }
+    }
+    while(j < previous.size())
+        removed.push_back(previous.key(j++));
+}
+
+#endif // OCTOMAP_PATH_PLANNER_MORTON_VOXEL_SET_H_INCLUDED
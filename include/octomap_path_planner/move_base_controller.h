@@ -0,0 +1,209 @@
+#ifndef OCTOMAP_PATH_PLANNER_MOVE_BASE_CONTROLLER_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_MOVE_BASE_CONTROLLER_H_INCLUDED
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include <ros/ros.h>
+#include <geometry_msgs/Point.h>
+#include <geometry_msgs/PointStamped.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <geometry_msgs/Twist.h>
+#include <nav_msgs/Path.h>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/octree/octree_search.h>
+
+
+template<typename PointA, typename PointB>
+double sqdist(const PointA& a, const PointB& b)
+{
+    double dx = a.x - b.x;
+    double dy = a.y - b.y;
+    double dz = a.z - b.z;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+
+template<typename PointA, typename PointB>
+double dist(const PointA& a, const PointB& b)
+{
+    return sqrt(sqdist(a, b));
+}
+
+
+/**
+ * An immutable navigation function, as received on navfn_in, together with
+ * its search structure.
+ *
+ * Snapshots are built by the navfn subscriber and handed over to the
+ * controller thread by atomically swapping a shared pointer, so the
+ * controller never sees a half-built index. (Deltas update snapshots in
+ * place, but only those no one else holds.)
+ */
+struct NavigationFunctionSnapshot
+{
+    pcl::PointCloud<pcl::PointXYZI>::Ptr cloud;
+    pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr octree;
+    // stamp of the map it was computed from
+    ros::Time map_stamp;
+    // size of the voxels the points stand for (0 if unknown)
+    double resolution;
+    // value of unreachable voxels: 1 in a normalized cloud, infinite in deltas
+    float unreachable;
+    // changes whenever the contents do (snapshots updated in place are
+    // published again with a new version)
+    uint64_t version;
+
+    NavigationFunctionSnapshot() : resolution(0.0), unreachable(1.0f), version(0) {}
+};
+
+double estimateVoxelSize(const NavigationFunctionSnapshot& navfn);
+
+typedef boost::shared_ptr<const NavigationFunctionSnapshot> NavigationFunctionSnapshotConstPtr;
+
+
+/**
+ * Sampling-based local planner: rolls out a fixed set of (v, w) arcs for a
+ * short horizon and scores all of them against a local cost grid.
+ *
+ * Arc shapes in the robot frame only depend on the sampled velocities, so
+ * they are precomputed once. At each tick the candidates are rotated and
+ * translated to the robot pose and scored in a single pass over flat
+ * structure-of-arrays buffers (one array per step, one lane per candidate),
+ * which the compiler can vectorize; the only per-candidate random access is
+ * the cost grid lookup.
+ */
+class TrajectoryRollout
+{
+public:
+    TrajectoryRollout();
+    void configure(double max_v, double max_w, int num_v, int num_w, double horizon, int num_steps);
+    void buildCostGrid(const NavigationFunctionSnapshot& navfn, double cx, double cy, double z, double half_size, double resolution, double max_dz);
+    int evaluate(double px, double py, double yaw, double min_clearance, double goal_weight, double clearance_weight);
+    int numCandidates() const;
+    double linearVelocity(int i) const;
+    double angularVelocity(int i) const;
+    void endPoint(int i, double& x, double& y) const;
+
+protected:
+    int num_candidates_;
+    int num_steps_;
+    std::vector<float> v_;
+    std::vector<float> w_;
+    std::vector<float> offset_x_;
+    std::vector<float> offset_y_;
+    std::vector<float> x_;
+    std::vector<float> y_;
+    std::vector<float> end_value_;
+    std::vector<float> min_clearance_;
+    int grid_width_;
+    int grid_height_;
+    double grid_resolution_;
+    double grid_origin_x_;
+    double grid_origin_y_;
+    std::vector<float> value_;
+    std::vector<float> clearance_;
+};
+
+
+
+
+struct MoveBaseControllerParams
+{
+    std::string frame_id;
+    std::string robot_frame_id;
+    double robot_radius;
+    double goal_reached_threshold;
+    double local_target_radius;
+    double twist_linear_gain;
+    double twist_angular_gain;
+    int max_repeated_failures;
+    std::string local_planner;
+    double path_step_radius;
+    double lookahead_distance;
+    double path_deviation_threshold;
+    double rollout_max_linear_velocity;
+    double rollout_max_angular_velocity;
+    int rollout_linear_samples;
+    int rollout_angular_samples;
+    double rollout_horizon;
+    int rollout_steps;
+    double rollout_grid_resolution;
+    double rollout_max_height_difference;
+    double rollout_goal_weight;
+    double rollout_clearance_weight;
+
+    MoveBaseControllerParams();
+};
+
+
+/**
+ * The move_base control law, free of any ROS communication and TF lookup,
+ * so that it can be driven both by move_base_node and by the offline
+ * simulator.
+ *
+ * The caller sets the navigation function, the goal and the robot pose
+ * (in frame_id), then calls update() once per control period.
+ */
+class MoveBaseController
+{
+public:
+    enum Status
+    {
+        REGULATING_POSITION,
+        REGULATING_ORIENTATION,
+        REACHED_GOAL,
+        FAILED,
+        GAVE_UP
+    };
+
+    MoveBaseController(const MoveBaseControllerParams& params = MoveBaseControllerParams());
+    const MoveBaseControllerParams& params() const;
+    void setNavigationFunction(const NavigationFunctionSnapshotConstPtr& navfn);
+    const NavigationFunctionSnapshotConstPtr& navigationFunction() const;
+    bool setGoal(const geometry_msgs::PoseStamped& goal);
+    const geometry_msgs::PoseStamped& goal() const;
+    void setRobotPose(const geometry_msgs::PoseStamped& robot_pose);
+    void reportFailure();
+    bool hasGivenUp() const;
+    Status update(geometry_msgs::Twist& twist);
+    static const char * statusString(Status status);
+    double positionError();
+    double orientationError();
+    const geometry_msgs::PointStamped& localTarget() const;
+    double localTargetDuration() const;
+    const nav_msgs::Path& path() const;
+    unsigned int pathRevision() const;
+    int projectPositionToNavigationFunction(const geometry_msgs::Point& pos);
+    void getNavigationFunctionNeighborhood(const geometry_msgs::Point& pos, pcl::PointCloud<pcl::PointXYZI>& neighbors);
+    bool projectGoalPositionToNavigationFunction();
+    void transformToRobotFrame(const geometry_msgs::Point& p_map, geometry_msgs::Point& p_local);
+    bool generateLocalTarget(geometry_msgs::PointStamped& p_local);
+    bool extractPath();
+    bool generatePathTarget(geometry_msgs::PointStamped& p_local);
+    bool generateRolloutCommand(geometry_msgs::Twist& twist);
+    void generateTwistCommand(const geometry_msgs::PointStamped& local_target, geometry_msgs::Twist& twist);
+
+protected:
+    MoveBaseControllerParams params_;
+    NavigationFunctionSnapshotConstPtr navfn_;
+    geometry_msgs::PoseStamped robot_pose_;
+    geometry_msgs::PoseStamped goal_;
+    geometry_msgs::PointStamped local_target_;
+    double local_target_duration_;
+    // (by value: holding the snapshot would keep a navfn buffer in use)
+    uint64_t path_navfn_version_;
+    nav_msgs::Path path_;
+    size_t path_index_;
+    unsigned int path_revision_;
+    TrajectoryRollout rollout_;
+    bool reached_position_;
+    int repeated_failures_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_MOVE_BASE_CONTROLLER_H_INCLUDED
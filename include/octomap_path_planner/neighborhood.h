@@ -0,0 +1,73 @@
+#ifndef OCTOMAP_PATH_PLANNER_NEIGHBORHOOD_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_NEIGHBORHOOD_H_INCLUDED
+
+#include <cmath>
+
+#include <boost/static_assert.hpp>
+
+
+/**
+ * Voxel neighborhood fixed at compile time: the offsets (dx, dy, dz) other
+ * than zero with dx^2 + dy^2 + dz^2 <= R2. R2 = 1, 2 and 3 are the 6, 18
+ * and 26 connectivities; larger values are balls of radius sqrt(R2)
+ * voxels (up to R2 = 15).
+ *
+ * forEach(f) calls f(dx, dy, dz, length) for each offset, where length is
+ * the length of the offset in voxels, until f returns false (forEach then
+ * returns false). The loop is unrolled at compile time, with constant
+ * arguments, so after inlining f there is no offset table left.
+ */
+template<int R2>
+struct Neighborhood
+{
+    BOOST_STATIC_ASSERT(R2 >= 1 && R2 <= 15);
+
+    enum {RADIUS = R2 >= 9 ? 3 : R2 >= 4 ? 2 : 1};
+
+    template<int DX, int DY, int DZ, bool END = (DZ > RADIUS)>
+    struct Offset
+    {
+        enum {D2 = DX * DX + DY * DY + DZ * DZ};
+
+        // (x fastest, then y, then z)
+        typedef Offset<(DX < RADIUS) ? DX + 1 : -RADIUS,
+                       (DX < RADIUS) ? DY : (DY < RADIUS) ? DY + 1 : -RADIUS,
+                       (DX < RADIUS || DY < RADIUS) ? DZ : DZ + 1> Next;
+
+        template<class F>
+        static bool forEach(F& f)
+        {
+            if(D2 > 0 && D2 <= R2 && !f(DX, DY, DZ, float(std::sqrt(double(D2)))))
+                return false;
+            return Next::forEach(f);
+        }
+    };
+
+    template<int DX, int DY, int DZ>
+    struct Offset<DX, DY, DZ, true>
+    {
+        template<class F>
+        static bool forEach(F& f)
+        {
+            return true;
+        }
+    };
+
+    template<class F>
+    static bool forEach(F& f)
+    {
+        return Offset<-RADIUS, -RADIUS, -RADIUS>::forEach(f);
+    }
+};
+
+
+/**
+ * R2 of the Neighborhood equivalent to a radius search of the given
+ * radius (in voxels).
+ */
+inline int neighborhoodR2(double radius)
+{
+    return int(std::floor(radius * radius + 1e-6));
+}
+
+#endif // OCTOMAP_PATH_PLANNER_NEIGHBORHOOD_H_INCLUDED
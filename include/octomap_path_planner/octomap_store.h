@@ -0,0 +1,52 @@
+#ifndef OCTOMAP_PATH_PLANNER_OCTOMAP_STORE_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_OCTOMAP_STORE_H_INCLUDED
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <ros/ros.h>
+#include <octomap/octomap.h>
+#include <octomap_msgs/Octomap.h>
+
+
+typedef boost::shared_ptr<const octomap::OcTree> OcTreeConstPtr;
+
+
+/**
+ * Process-wide store of decoded octomaps.
+ *
+ * Each map revision is decoded once into an immutable, reference counted
+ * OcTree which is handed read-only to every consumer in the process (e.g.
+ * the planner nodelets loaded in the same manager, which receive the very
+ * same message). The store itself only keeps weak references, so a tree
+ * is freed as soon as the last consumer drops it.
+ */
+class OctomapStore
+{
+public:
+    static OctomapStore& instance();
+
+    OcTreeConstPtr get(const octomap_msgs::Octomap::ConstPtr& msg);
+
+    size_t numDecoded() const {return num_decoded_;}
+    size_t numShared() const {return num_shared_;}
+
+protected:
+    OctomapStore();
+
+    bool isSameRevision(const octomap_msgs::Octomap::ConstPtr& msg) const;
+
+    boost::mutex mutex_;
+    boost::weak_ptr<const octomap_msgs::Octomap> last_msg_;
+    std::string last_frame_id_;
+    ros::Time last_stamp_;
+    uint32_t last_seq_;
+    boost::weak_ptr<const octomap::OcTree> last_tree_;
+    size_t num_decoded_;
+    size_t num_shared_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_OCTOMAP_STORE_H_INCLUDED
@@ -0,0 +1,235 @@
+#ifndef OCTOMAP_PATH_PLANNER_PARALLEL_RELAXATION_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_PARALLEL_RELAXATION_H_INCLUDED
+
+#include <vector>
+#include <queue>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <limits>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+
+#include <octomap_path_planner/worker_pool.h>
+
+
+/**
+ * Shortest path distances from a source over a graph of n nodes, solved
+ * block-parallel: the nodes are split in tiles of contiguous indices (for
+ * voxels in Morton order, compact blocks of space), and in each round
+ * worker threads take the active tiles and solve each one locally, by
+ * Dijkstra's algorithm from the values its boundary nodes pull from the
+ * neighboring tiles. Each round only settles the values below a bound
+ * that grows by delta per round (as in delta-stepping), so that a tile
+ * is rarely solved again on values still to be improved; the next round
+ * takes the tiles with values left above the bound, and those next to a
+ * tile whose boundary improved, until there are none.
+ *
+ * Within a round a tile reads the other tiles' values as they were at
+ * the start of the round (a tile only reads its neighbors' boundary
+ * nodes, so only those are copied, after a round from the tiles it
+ * solved), so threads only write their own tiles. The
+ * result is that of a sequential Dijkstra (up to a relative tolerance of
+ * 1e-6 per relaxation), while a wavefront keeps the first path reaching
+ * a node, which can be slightly longer.
+ *
+ * Neighbors is called as neighbors(i, indices, lengths) and must be safe
+ * to call from several threads; values must be initially infinite. The
+ * rounds run on the threads of a WorkerPool, which the caller keeps.
+ */
+template<class Neighbors>
+class ParallelRelaxation
+{
+public:
+    ParallelRelaxation(const Neighbors& neighbors, size_t size, std::vector<float>& values, float delta, size_t tile_size = 4096)
+        : neighbors_(neighbors),
+          size_(size),
+          values_(values),
+          previous_(size, std::numeric_limits<float>::infinity()),
+          delta_(delta),
+          bound_(0.0f),
+          tile_size_(tile_size),
+          num_tiles_((size + tile_size - 1) / tile_size),
+          heaps_(num_tiles_),
+          adjacent_tiles_(num_tiles_),
+          boundary_edges_(num_tiles_),
+          boundary_nodes_(num_tiles_),
+          explored_(num_tiles_, 0),
+          changed_(num_tiles_, 0)
+    {
+    }
+
+    /**
+     * Solve on the workers of pool; returns the number of rounds.
+     */
+    size_t run(size_t source, WorkerPool& pool)
+    {
+        values_[source] = 0.0f;
+        heaps_[source / tile_size_].push(Entry(0.0f, source));
+        std::vector<int> tiles(1, source / tile_size_), next_tiles;
+        std::vector<char> active(num_tiles_, 0);
+        size_t rounds = 0;
+        for(bound_ = delta_; !tiles.empty(); rounds++)
+        {
+            boost::atomic<size_t> next(0);
+            const size_t n = std::min<size_t>(pool.size(), tiles.size());
+            if(n <= 1)
+                solveTiles(tiles, next);
+            else
+                pool.run(boost::bind(&ParallelRelaxation::solveTiles, this, boost::cref(tiles), boost::ref(next)), n);
+
+            // the boundary values the neighbors of the solved tiles will
+            // read in the next round:
+            for(size_t k = 0; k < tiles.size(); k++)
+            {
+                const std::vector<size_t>& boundary = boundary_nodes_[tiles[k]];
+                for(size_t b = 0; b < boundary.size(); b++)
+                    previous_[boundary[b]] = values_[boundary[b]];
+            }
+
+            // next round: the tiles with pending nodes, and those next to
+            // a changed boundary
+            next_tiles.clear();
+            float min_pending = std::numeric_limits<float>::infinity();
+            for(size_t k = 0; k < tiles.size(); k++)
+            {
+                const int tile = tiles[k];
+                if(!heaps_[tile].empty())
+                {
+                    min_pending = std::min(min_pending, heaps_[tile].top().first);
+                    if(!active[tile])
+                    {
+                        active[tile] = 1;
+                        next_tiles.push_back(tile);
+                    }
+                }
+                if(!changed_[tile]) continue;
+                const std::vector<int>& adjacent = adjacent_tiles_[tile];
+                for(size_t a = 0; a < adjacent.size(); a++)
+                {
+                    if(active[adjacent[a]]) continue;
+                    active[adjacent[a]] = 1;
+                    next_tiles.push_back(adjacent[a]);
+                }
+            }
+            for(size_t k = 0; k < next_tiles.size(); k++)
+                active[next_tiles[k]] = 0;
+            tiles.swap(next_tiles);
+
+            // (skip the empty bands)
+            bound_ = std::max(bound_ + delta_, min_pending);
+        }
+        return rounds;
+    }
+
+protected:
+    typedef std::pair<float, size_t> Entry;
+    typedef std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > Heap;
+
+    struct Edge
+    {
+        size_t from;
+        size_t to;
+        float length;
+
+        Edge(size_t f, size_t t, float l) : from(f), to(t), length(l) {}
+    };
+
+    void solveTiles(const std::vector<int>& tiles, boost::atomic<size_t>& next)
+    {
+        std::vector<int> indices;
+        std::vector<float> lengths;
+        for(size_t k = next++; k < tiles.size(); k = next++)
+            changed_[tiles[k]] = solveTile(tiles[k], indices, lengths);
+    }
+
+    // (changes below the tolerance would only spread float rounding)
+    static bool improves(float value, float old_value)
+    {
+        return value < old_value * (1.0f - 1e-6f);
+    }
+
+    // the first time, find the tile's edges to other tiles, its boundary
+    // nodes (those with such edges) and its adjacent tiles
+    void exploreTile(int tile, size_t begin, size_t end, std::vector<int>& indices, std::vector<float>& lengths)
+    {
+        std::vector<int>& adjacent = adjacent_tiles_[tile];
+        for(size_t i = begin; i < end; i++)
+        {
+            neighbors_(i, indices, lengths);
+            bool boundary = false;
+            for(size_t n = 0; n < indices.size(); n++)
+            {
+                const size_t j = indices[n];
+                if(j >= begin && j < end) continue;
+                adjacent.push_back(j / tile_size_);
+                boundary_edges_[tile].push_back(Edge(i, j, lengths[n]));
+                boundary = true;
+            }
+            if(boundary) boundary_nodes_[tile].push_back(i);
+        }
+        std::sort(adjacent.begin(), adjacent.end());
+        adjacent.erase(std::unique(adjacent.begin(), adjacent.end()), adjacent.end());
+        explored_[tile] = 1;
+    }
+
+    // returns true if the value of a boundary node improved
+    bool solveTile(int tile, std::vector<int>& indices, std::vector<float>& lengths)
+    {
+        const size_t begin = tile * tile_size_, end = std::min(size_, begin + tile_size_);
+        if(!explored_[tile])
+            exploreTile(tile, begin, end, indices, lengths);
+
+        Heap& heap = heaps_[tile];
+
+        // pull from the neighboring tiles:
+        const std::vector<Edge>& edges = boundary_edges_[tile];
+        for(size_t e = 0; e < edges.size(); e++)
+        {
+            const float value = previous_[edges[e].to] + edges[e].length;
+            if(!improves(value, values_[edges[e].from])) continue;
+            values_[edges[e].from] = value;
+            heap.push(Entry(value, edges[e].from));
+        }
+
+        // and propagate within the tile, up to the bound of the round:
+        bool changed = false;
+        while(!heap.empty() && heap.top().first <= bound_)
+        {
+            const Entry e = heap.top();
+            heap.pop();
+            if(e.first > values_[e.second]) continue;
+            changed = changed || std::binary_search(boundary_nodes_[tile].begin(), boundary_nodes_[tile].end(), e.second);
+
+            neighbors_(e.second, indices, lengths);
+            for(size_t n = 0; n < indices.size(); n++)
+            {
+                const size_t j = indices[n];
+                if(j < begin || j >= end) continue;
+                const float value = e.first + lengths[n];
+                if(!improves(value, values_[j])) continue;
+                values_[j] = value;
+                heap.push(Entry(value, j));
+            }
+        }
+        return changed;
+    }
+
+    const Neighbors& neighbors_;
+    const size_t size_;
+    std::vector<float>& values_;
+    std::vector<float> previous_;
+    const float delta_;
+    float bound_;
+    const size_t tile_size_;
+    const size_t num_tiles_;
+    std::vector<Heap> heaps_;
+    std::vector<std::vector<int> > adjacent_tiles_;
+    std::vector<std::vector<Edge> > boundary_edges_;
+    std::vector<std::vector<size_t> > boundary_nodes_;
+    std::vector<char> explored_;
+    std::vector<char> changed_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_PARALLEL_RELAXATION_H_INCLUDED
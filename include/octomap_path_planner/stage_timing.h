@@ -0,0 +1,97 @@
+#ifndef OCTOMAP_PATH_PLANNER_STAGE_TIMING_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_STAGE_TIMING_H_INCLUDED
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+
+
+/**
+ * Wall time of the stages of one computation, plus a few result sizes,
+ * collected as a DiagnosticStatus. Nodes publish it on their timing
+ * topic for planner_benchmark, which matches it to the map it sent by
+ * the "map stamp" value. The stages are also kept as spans, for Tracer.
+ */
+class StageTiming
+{
+public:
+    StageTiming(const std::string& name)
+        : start_(ros::WallTime::now()), last_(start_)
+    {
+        status_.name = name;
+        status_.level = diagnostic_msgs::DiagnosticStatus::OK;
+    }
+
+    struct Span
+    {
+        std::string name;
+        ros::WallTime start;
+        ros::WallTime end;
+    };
+
+    void mark(const std::string& stage)
+    {
+        ros::WallTime now = ros::WallTime::now();
+        add(stage + " [ms]", (now - last_).toSec() * 1e3, "%.3f");
+        Span span;
+        span.name = stage;
+        span.start = last_;
+        span.end = now;
+        spans_.push_back(span);
+        last_ = now;
+    }
+
+    void add(const std::string& key, double value, const char *fmt = "%.0f")
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), fmt, value);
+        addString(key, buf);
+    }
+
+    void setMapStamp(const ros::Time& stamp)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%u.%09u", (unsigned)stamp.sec, (unsigned)stamp.nsec);
+        addString("map stamp", buf);
+    }
+
+    double totalTime() const {return (last_ - start_).toSec();}
+
+    const diagnostic_msgs::DiagnosticStatus& status() const {return status_;}
+    const std::string& name() const {return status_.name;}
+    const std::vector<Span>& spans() const {return spans_;}
+    ros::WallTime startTime() const {return start_;}
+    ros::WallTime lastTime() const {return last_;}
+
+    /**
+     * Publish along with the total time, only if someone is listening.
+     */
+    void publish(const ros::Publisher& pub)
+    {
+        if(pub.getNumSubscribers() == 0) return;
+        add("total [ms]", totalTime() * 1e3, "%.3f");
+        diagnostic_msgs::DiagnosticArray msg;
+        msg.header.stamp = ros::Time::now();
+        msg.status.push_back(status_);
+        pub.publish(msg);
+    }
+
+protected:
+    void addString(const std::string& key, const std::string& value)
+    {
+        diagnostic_msgs::KeyValue kv;
+        kv.key = key;
+        kv.value = value;
+        status_.values.push_back(kv);
+    }
+
+    ros::WallTime start_;
+    ros::WallTime last_;
+    std::vector<Span> spans_;
+    diagnostic_msgs::DiagnosticStatus status_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_STAGE_TIMING_H_INCLUDED
@@ -0,0 +1,55 @@
+#ifndef OCTOMAP_PATH_PLANNER_SURFACE_MAP_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_SURFACE_MAP_H_INCLUDED
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <octomap/octomap.h>
+
+#include <octomap_path_planner/morton_voxel_set.h>
+
+
+/**
+ * Multi-level surface map: the occupied voxels of an octree condensed, for
+ * each (x, y) column, into runs along z. The top voxel of a run with
+ * robot_height of free space above it is a surface the robot can stand
+ * on; the other voxels of runs taller than max_superable_height are
+ * obstacles. This is the same classification as the voxel by voxel one of
+ * navigation_function_node, but it walks each column only once.
+ *
+ * Surfaces and obstacle runs are kept sorted by column, so the columns
+ * around a cell are found by binary search. Meant for mostly 2.5D sites,
+ * where a column has one or few runs.
+ */
+class SurfaceMap
+{
+public:
+    typedef uint64_t Code;
+
+    void build(const octomap::OcTree& tree, double robot_height, double max_superable_height, bool treat_unknown_as_free);
+    void inflate(double radius);
+
+    size_t size() const {return surfaces_.size();}
+    octomap::OcTreeKey key(size_t i) const {return decode(surfaces_[i]);}
+    bool isTraversable(size_t i) const {return traversable_[i];}
+    int find(const octomap::OcTreeKey& key) const;
+    void neighbors(size_t i, double radius, int max_step, std::vector<int>& indices, std::vector<float>& sqr_distances) const;
+    void getObstacles(MortonKeySet& obstacles) const;
+    size_t memoryUsage() const;
+
+protected:
+    // (column major: x, then y, then z)
+    static Code encode(unsigned x, unsigned y, unsigned z) {return (Code(x) << 32) | (Code(y) << 16) | Code(z);}
+    static octomap::OcTreeKey decode(Code c) {return octomap::OcTreeKey((c >> 32) & 0xFFFF, (c >> 16) & 0xFFFF, c & 0xFFFF);}
+
+    bool isNearObstacle(const octomap::OcTreeKey& key, double radius) const;
+
+    std::vector<Code> surfaces_;
+    std::vector<char> traversable_;
+    // obstacle runs: column and lowest z, and highest z
+    std::vector<Code> obstacle_runs_;
+    std::vector<octomap::key_type> obstacle_run_max_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_SURFACE_MAP_H_INCLUDED
@@ -0,0 +1,79 @@
+#ifndef OCTOMAP_PATH_PLANNER_TRACER_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_TRACER_H_INCLUDED
+
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+#include <ros/ros.h>
+
+#include <octomap_path_planner/TraceSpans.h>
+#include <octomap_path_planner/stage_timing.h>
+
+
+/**
+ * Latency trace spans of a node, published on its trace topic for
+ * latency_tracer. Spans carry the stamps of the map and of the goal they
+ * derive from, which correlate them across nodes.
+ *
+ * Disabled unless init() is called with enabled (the ~trace parameter),
+ * in which case every call returns after testing one flag. Spans are
+ * buffered and sent by flush(), once per computation or control tick.
+ */
+class Tracer
+{
+public:
+    Tracer() : enabled_(false) {}
+
+    void init(ros::NodeHandle& nh, bool enabled)
+    {
+        enabled_ = enabled;
+        if(!enabled_) return;
+        pub_ = nh.advertise<octomap_path_planner::TraceSpans>("trace", 100, false);
+        msg_.node = ros::this_node::getName();
+    }
+
+    bool enabled() const {return enabled_;}
+
+    void add(const std::string& name, const ros::WallTime& start, const ros::WallTime& end, const ros::Time& map_stamp, const ros::Time& goal_stamp = ros::Time())
+    {
+        if(!enabled_) return;
+        octomap_path_planner::TraceSpan span;
+        span.name = name;
+        span.start = ros::Time(start.sec, start.nsec);
+        ros::WallDuration d = end - start;
+        span.duration = ros::Duration(d.sec, d.nsec);
+        span.map_stamp = map_stamp;
+        span.goal_stamp = goal_stamp;
+        boost::mutex::scoped_lock lock(mutex_);
+        msg_.spans.push_back(span);
+    }
+
+    /**
+     * Add the stages of timing, as "<timing name>/<stage>".
+     */
+    void add(const StageTiming& timing, const ros::Time& map_stamp, const ros::Time& goal_stamp = ros::Time())
+    {
+        if(!enabled_) return;
+        const std::vector<StageTiming::Span>& spans = timing.spans();
+        for(size_t i = 0; i < spans.size(); i++)
+            add(timing.name() + "/" + spans[i].name, spans[i].start, spans[i].end, map_stamp, goal_stamp);
+    }
+
+    void flush()
+    {
+        if(!enabled_) return;
+        boost::mutex::scoped_lock lock(mutex_);
+        if(msg_.spans.empty()) return;
+        pub_.publish(msg_);
+        msg_.spans.clear();
+    }
+
+protected:
+    bool enabled_;
+    ros::Publisher pub_;
+    boost::mutex mutex_;
+    octomap_path_planner::TraceSpans msg_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_TRACER_H_INCLUDED
@@ -0,0 +1,105 @@
+#ifndef OCTOMAP_PATH_PLANNER_WORKER_POOL_H_INCLUDED
+#define OCTOMAP_PATH_PLANNER_WORKER_POOL_H_INCLUDED
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+
+/**
+ * A fixed set of worker threads, created once, that run a task together:
+ * run() hands the task to the first n workers and returns when all of them
+ * are done with it, which makes each call a barrier. Repeated parallel
+ * steps (the rounds of ParallelRelaxation, the blocks of each frontier
+ * computation) so don't pay for creating and joining threads every time.
+ *
+ * Workers typically share the work through an atomic counter captured by
+ * the task. run() must not be called from several threads at once. A pool
+ * of no threads is allowed, for callers that then do the work themselves.
+ */
+class WorkerPool : boost::noncopyable
+{
+public:
+    WorkerPool(int num_threads)
+        : num_threads_(std::max(0, num_threads)),
+          generation_(0),
+          active_(0),
+          pending_(0),
+          shutdown_(false)
+    {
+        for(int i = 0; i < num_threads_; i++)
+            threads_.create_thread(boost::bind(&WorkerPool::worker, this, i));
+    }
+
+    ~WorkerPool()
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            shutdown_ = true;
+        }
+        start_cond_.notify_all();
+        threads_.join_all();
+    }
+
+    int size() const {return num_threads_;}
+
+    /**
+     * Run task on num_workers threads (all of them if not given), and wait
+     * for them to finish.
+     */
+    void run(const boost::function<void ()>& task, int num_workers = -1)
+    {
+        if(num_workers < 0 || num_workers > num_threads_) num_workers = num_threads_;
+        if(num_workers == 0) return;
+        boost::mutex::scoped_lock lock(mutex_);
+        task_ = task;
+        active_ = num_workers;
+        pending_ = num_workers;
+        generation_++;
+        start_cond_.notify_all();
+        while(pending_ > 0)
+            done_cond_.wait(lock);
+        task_.clear();
+    }
+
+protected:
+    void worker(int index)
+    {
+        size_t generation = 0;
+        while(true)
+        {
+            boost::function<void ()> task;
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                while(!shutdown_ && generation_ == generation)
+                    start_cond_.wait(lock);
+                if(shutdown_) return;
+                generation = generation_;
+                if(index >= active_) continue;
+                task = task_;
+            }
+            task();
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                if(--pending_ == 0) done_cond_.notify_one();
+            }
+        }
+    }
+
+    const int num_threads_;
+    boost::mutex mutex_;
+    boost::condition_variable start_cond_;
+    boost::condition_variable done_cond_;
+    boost::function<void ()> task_;
+    size_t generation_;
+    int active_;
+    int pending_;
+    bool shutdown_;
+    boost::thread_group threads_;
+};
+
+#endif // OCTOMAP_PATH_PLANNER_WORKER_POOL_H_INCLUDED
@@ -0,0 +1,203 @@
+#include <cmath>
+
+#include <octomap_msgs/conversions.h>
+
+#include <octomap_path_planner/incremental_octomap.h>
+
+
+IncrementalOctomap::IncrementalOctomap()
+    : synchronized_(false), have_sequence_(false), last_sequence_(0), num_updates_(0), num_gaps_(0)
+{
+}
+
+
+/**
+ * Replace the map with a full map, which (re)synchronizes it: updates
+ * are accepted again from any sequence number, and the ones not newer
+ * than this map are skipped.
+ */
+bool IncrementalOctomap::setFullMap(const octomap_msgs::Octomap& msg, OctomapRegion& changed)
+{
+    boost::shared_ptr<octomap::OcTree> tree(octomap_msgs::binaryMsgToMap(msg));
+    if(!tree)
+    {
+        ROS_ERROR("failed to decode octomap");
+        return false;
+    }
+
+    tree_ = tree;
+    base_stamp_ = msg.header.stamp;
+    synchronized_ = true;
+    have_sequence_ = false;
+    changed.setFull();
+    return true;
+}
+
+
+/**
+ * (as OcTree::coordToKey, but clamped to the key range)
+ */
+octomap::key_type IncrementalOctomap::coordToKeyClamped(double c) const
+{
+    const double max_val = 1 << (tree_->getTreeDepth() - 1);
+    double k = floor(c / tree_->getResolution()) + max_val;
+    return (octomap::key_type)std::max(0.0, std::min(2 * max_val - 1, k));
+}
+
+
+/**
+ * Get the box of keys replaced by an update. Returns false if the box is
+ * empty or there is no map yet.
+ */
+bool IncrementalOctomap::getUpdateBounds(const octomap_path_planner::OctomapUpdate& msg, octomap::OcTreeKey& min, octomap::OcTreeKey& max) const
+{
+    if(!tree_) return false;
+
+    const double bmin[3] = {msg.bbx_min.x, msg.bbx_min.y, msg.bbx_min.z};
+    const double bmax[3] = {msg.bbx_max.x, msg.bbx_max.y, msg.bbx_max.z};
+    for(int a = 0; a < 3; a++)
+    {
+        if(bmin[a] > bmax[a]) return false;
+        min[a] = coordToKeyClamped(bmin[a]);
+        max[a] = coordToKeyClamped(bmax[a]);
+    }
+    return true;
+}
+
+
+void IncrementalOctomap::copyNode(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src)
+{
+    dst->setLogOdds(src->getLogOdds());
+    if(!src->hasChildren()) return;
+    for(unsigned i = 0; i < 8; i++)
+    {
+        if(!src->childExists(i)) continue;
+        dst->createChild(i);
+        copyNode(dst->getChild(i), src->getChild(i));
+    }
+}
+
+
+/**
+ * Replace the part of dst (a node at depth, with index key key) inside the
+ * box [min, max] with src, the node of the update at the same place (NULL
+ * if unknown; a leaf of the update stands for all of its descendants).
+ *
+ * Returns false if dst is left without children, i.e. all of it is now
+ * unknown and it must be deleted by the caller.
+ */
+bool IncrementalOctomap::mergeNode(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src, const octomap::OcTreeKey& key, unsigned depth, const octomap::OcTreeKey& min, const octomap::OcTreeKey& max, OctomapRegion& changed)
+{
+    const unsigned child_span = 1 << (tree_->getTreeDepth() - depth - 1);
+
+    for(unsigned i = 0; i < 8; i++)
+    {
+        octomap::OcTreeKey ck, ck_max;
+        bool overlaps = true, inside = true;
+        for(int a = 0; a < 3; a++)
+        {
+            ck[a] = key[a] + ((i & (1 << a)) ? child_span : 0);
+            ck_max[a] = ck[a] + child_span - 1;
+            if(ck_max[a] < min[a] || ck[a] > max[a]) overlaps = false;
+            if(ck[a] < min[a] || ck_max[a] > max[a]) inside = false;
+        }
+        if(!overlaps) continue;
+
+        const octomap::OcTreeNode *src_child = 0;
+        if(src) src_child = !src->hasChildren() ? src : src->childExists(i) ? src->getChild(i) : 0;
+
+        if(inside)
+        {
+            if(dst->childExists(i)) dst->deleteChild(i);
+            if(src_child)
+            {
+                dst->createChild(i);
+                copyNode(dst->getChild(i), src_child);
+            }
+            continue;
+        }
+
+        if(!dst->childExists(i))
+        {
+            if(!src_child) continue;
+            dst->createChild(i);
+        }
+        else if(!dst->getChild(i)->hasChildren())
+        {
+            // collapsed leaf straddling the box: its part outside the box
+            // keeps the value, but its leafs change
+            dst->getChild(i)->expandNode();
+            changed.add(ck, ck_max);
+        }
+
+        if(!mergeNode(dst->getChild(i), src_child, ck, depth + 1, min, max, changed))
+            dst->deleteChild(i);
+    }
+
+    if(!dst->hasChildren()) return false;
+    dst->updateOccupancyChildren();
+    return true;
+}
+
+
+/**
+ * Merge an update into the map, adding the changed keys to changed.
+ *
+ * Returns false if the map is not (or no longer, because of a gap in the
+ * sequence or a bad update) synchronized; a full map is then needed.
+ */
+bool IncrementalOctomap::applyUpdate(const octomap_path_planner::OctomapUpdate& msg, OctomapRegion& changed)
+{
+    if(!synchronized_) return false;
+
+    if(have_sequence_ && msg.sequence != last_sequence_ + 1)
+    {
+        ROS_WARN("octomap update %u after %u: updates lost, waiting for a full map", msg.sequence, last_sequence_);
+        synchronized_ = false;
+        num_gaps_++;
+        return false;
+    }
+    have_sequence_ = true;
+    last_sequence_ = msg.sequence;
+
+    // already contained in the full map:
+    if(msg.header.stamp <= base_stamp_) return true;
+
+    octomap::OcTreeKey min, max;
+    if(!getUpdateBounds(msg, min, max)) return true;
+
+    boost::shared_ptr<octomap::OcTree> update(octomap_msgs::binaryMsgToMap(msg.octomap));
+    if(!update || update->getResolution() != tree_->getResolution() || update->getTreeDepth() != tree_->getTreeDepth())
+    {
+        ROS_ERROR("failed to decode octomap update, or its resolution doesn't match the map");
+        synchronized_ = false;
+        return false;
+    }
+
+    num_updates_++;
+
+    const octomap::key_type key_max = (1 << tree_->getTreeDepth()) - 1;
+    if(min[0] == 0 && min[1] == 0 && min[2] == 0 && max[0] == key_max && max[1] == key_max && max[2] == key_max)
+    {
+        tree_ = update;
+        changed.setFull();
+        return true;
+    }
+
+    changed.add(min, max);
+
+    // empty map: create the root through a voxel in the box, which the
+    // merge then overwrites
+    if(!tree_->getRoot())
+        tree_->updateNode(min, 0.0f);
+
+    octomap::OcTreeNode *root = tree_->getRoot();
+    if(!root->hasChildren())
+    {
+        root->expandNode();
+        changed.setFull();
+    }
+    if(!mergeNode(root, update->getRoot(), octomap::OcTreeKey(0, 0, 0), 0, min, max, changed))
+        tree_->clear();
+    return true;
+}
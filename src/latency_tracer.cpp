@@ -0,0 +1,290 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <algorithm>
+
+#include <ros/ros.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+
+#include <octomap_path_planner/TraceSpans.h>
+#include <octomap_path_planner/latency_histogram.h>
+
+
+/**
+ * Collects the trace spans of the planner nodes (run with ~trace, see
+ * tracer.h) from the trace topic, writes them to a Chrome trace JSON file
+ * (for chrome://tracing or Perfetto: a process per node, a track per
+ * span name), and summarizes the latencies: the p50 and p95 of each
+ * span, and of the end-to-end latency of each map, from its arrival at
+ * the first node to the end of the first twist move_base computed from
+ * it. End-to-end latencies also appear in the trace as spans of an
+ * "end-to-end" process. Latencies are kept in histograms, so the summary
+ * takes constant memory however long the tracer runs (and percentiles
+ * are bucket upper bounds).
+ *
+ * The nodes' spans come on separate connections, in no particular order,
+ * so the end-to-end latency of a map is only taken ~grace_period seconds
+ * after its first twist span was received; spans of the map received
+ * later are ignored.
+ *
+ * Nodes on different hosts need synchronized clocks, since spans are in
+ * wall clock time.
+ */
+class LatencyTracer
+{
+public:
+    LatencyTracer();
+    ~LatencyTracer();
+    void onSpans(const octomap_path_planner::TraceSpans::ConstPtr& msg);
+    void onSummaryTimer(const ros::WallTimerEvent& event);
+    void closeMaps(double now, bool all);
+    void printSummary();
+
+protected:
+    // wall time (seconds) of the first map and of the first twist for it,
+    // while the map is open
+    struct MapLatency
+    {
+        double arrival;
+        double twist;
+        ros::Time goal_stamp;
+        bool closed;
+
+        MapLatency() : arrival(std::numeric_limits<double>::infinity()), twist(std::numeric_limits<double>::infinity()), closed(false) {}
+    };
+
+    int processId(const std::string& node);
+    int threadId(int pid, const std::string& name);
+    void writeEvent(const std::string& name, int pid, int tid, double start, double duration, const ros::Time& map_stamp, const ros::Time& goal_stamp);
+
+    ros::NodeHandle nh_;
+    ros::NodeHandle pnh_;
+    ros::Subscriber trace_sub_;
+    ros::Publisher diagnostics_pub_;
+    ros::WallTimer summary_timer_;
+    std::string output_file_;
+    std::string twist_span_;
+    double summary_period_;
+    double grace_period_;
+    int max_pending_maps_;
+    FILE *output_;
+    bool first_event_;
+    double origin_;
+    std::map<std::string, int> pids_;
+    std::map<std::pair<int, std::string>, int> tids_;
+    std::map<std::string, LatencyHistogram> durations_;
+    std::map<ros::Time, MapLatency> maps_;
+    // maps with a twist, by the (receive) wall time at which they close
+    std::multimap<double, ros::Time> closing_;
+    LatencyHistogram end_to_end_;
+};
+
+
+LatencyTracer::LatencyTracer()
+    : pnh_("~"),
+      output_file_("trace.json"),
+      twist_span_("move_base/twist"),
+      summary_period_(10.0),
+      grace_period_(1.0),
+      max_pending_maps_(1000),
+      output_(0),
+      first_event_(true),
+      origin_(-1.0)
+{
+    pnh_.param("output_file", output_file_, output_file_);
+    pnh_.param("twist_span", twist_span_, twist_span_);
+    pnh_.param("summary_period", summary_period_, summary_period_);
+    pnh_.param("grace_period", grace_period_, grace_period_);
+    pnh_.param("max_pending_maps", max_pending_maps_, max_pending_maps_);
+    if(grace_period_ < 0.0)
+    {
+        ROS_ERROR("grace_period must not be negative; using 1.0");
+        grace_period_ = 1.0;
+    }
+
+    if(!output_file_.empty())
+    {
+        output_ = fopen(output_file_.c_str(), "w");
+        if(output_)
+            fprintf(output_, "[\n");
+        else
+            ROS_ERROR("failed to open %s; spans are only summarized", output_file_.c_str());
+    }
+
+    trace_sub_ = nh_.subscribe<octomap_path_planner::TraceSpans>("trace", 100, &LatencyTracer::onSpans, this);
+    diagnostics_pub_ = nh_.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 1, false);
+    if(summary_period_ > 0.0)
+        summary_timer_ = nh_.createWallTimer(ros::WallDuration(summary_period_), &LatencyTracer::onSummaryTimer, this);
+}
+
+
+LatencyTracer::~LatencyTracer()
+{
+    closeMaps(0.0, true);
+    printSummary();
+    if(output_)
+    {
+        // (the closing bracket is optional in the Chrome trace format, so
+        // the file is usable even if this never runs)
+        fprintf(output_, "\n]\n");
+        fclose(output_);
+    }
+}
+
+
+int LatencyTracer::processId(const std::string& node)
+{
+    std::map<std::string, int>::iterator it = pids_.find(node);
+    if(it != pids_.end()) return it->second;
+
+    const int pid = pids_.size() + 1;
+    pids_[node] = pid;
+    if(output_)
+    {
+        fprintf(output_, "%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first_event_ ? "" : ",\n", pid, node.c_str());
+        first_event_ = false;
+    }
+    return pid;
+}
+
+
+int LatencyTracer::threadId(int pid, const std::string& name)
+{
+    std::pair<int, std::string> key(pid, name);
+    std::map<std::pair<int, std::string>, int>::iterator it = tids_.find(key);
+    if(it != tids_.end()) return it->second;
+
+    const int tid = tids_.size() + 1;
+    tids_[key] = tid;
+    if(output_)
+    {
+        fprintf(output_, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                pid, tid, name.c_str());
+    }
+    return tid;
+}
+
+
+/**
+ * Write a complete ("X") event; times in seconds of wall clock.
+ */
+void LatencyTracer::writeEvent(const std::string& name, int pid, int tid, double start, double duration, const ros::Time& map_stamp, const ros::Time& goal_stamp)
+{
+    if(!output_) return;
+    if(origin_ < 0.0) origin_ = start;
+    fprintf(output_, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+            "\"args\": {\"map stamp\": \"%u.%09u\", \"goal stamp\": \"%u.%09u\"}}",
+            name.c_str(), pid, tid, (start - origin_) * 1e6, duration * 1e6,
+            (unsigned)map_stamp.sec, (unsigned)map_stamp.nsec, (unsigned)goal_stamp.sec, (unsigned)goal_stamp.nsec);
+}
+
+
+void LatencyTracer::onSpans(const octomap_path_planner::TraceSpans::ConstPtr& msg)
+{
+    const double now = ros::WallTime::now().toSec();
+    const int pid = processId(msg->node);
+    for(size_t i = 0; i < msg->spans.size(); i++)
+    {
+        const octomap_path_planner::TraceSpan& span = msg->spans[i];
+        const double start = span.start.toSec(), duration = span.duration.toSec();
+        writeEvent(span.name, pid, threadId(pid, span.name), start, duration, span.map_stamp, span.goal_stamp);
+        durations_[span.name].add(duration);
+
+        if(span.map_stamp.isZero()) continue;
+        std::map<ros::Time, MapLatency>::iterator it = maps_.find(span.map_stamp);
+        if(it == maps_.end())
+        {
+            // (forget the oldest maps that never got a twist)
+            if(int(maps_.size()) >= max_pending_maps_)
+                maps_.erase(maps_.begin());
+            it = maps_.insert(std::make_pair(span.map_stamp, MapLatency())).first;
+        }
+        MapLatency& latency = it->second;
+        if(latency.closed) continue;
+        latency.arrival = std::min(latency.arrival, start);
+        if(span.name != twist_span_ || start + duration >= latency.twist) continue;
+
+        if(latency.twist == std::numeric_limits<double>::infinity())
+            closing_.insert(std::make_pair(now + grace_period_, span.map_stamp));
+        latency.twist = start + duration;
+        latency.goal_stamp = span.goal_stamp;
+    }
+
+    closeMaps(now, false);
+}
+
+
+/**
+ * Take the end-to-end latency of the maps whose grace period is over (of
+ * all maps with a twist, if all is set).
+ */
+void LatencyTracer::closeMaps(double now, bool all)
+{
+    while(!closing_.empty() && (all || closing_.begin()->first <= now))
+    {
+        const ros::Time stamp = closing_.begin()->second;
+        closing_.erase(closing_.begin());
+
+        // (unless it was forgotten meanwhile)
+        std::map<ros::Time, MapLatency>::iterator it = maps_.find(stamp);
+        if(it == maps_.end()) continue;
+        MapLatency& latency = it->second;
+        latency.closed = true;
+        end_to_end_.add(latency.twist - latency.arrival);
+        const int e2e_pid = processId("end-to-end");
+        writeEvent("map to twist", e2e_pid, threadId(e2e_pid, "map to twist"), latency.arrival, latency.twist - latency.arrival, stamp, latency.goal_stamp);
+    }
+}
+
+
+void LatencyTracer::onSummaryTimer(const ros::WallTimerEvent& event)
+{
+    closeMaps(ros::WallTime::now().toSec(), false);
+    if(output_) fflush(output_);
+    printSummary();
+}
+
+
+/**
+ * Log the p50 and p95 of the end-to-end latency and of each span, and
+ * publish their histograms on diagnostics.
+ */
+void LatencyTracer::printSummary()
+{
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = ros::this_node::getName() + ": latency";
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+
+    std::vector<std::pair<std::string, const LatencyHistogram*> > rows;
+    rows.push_back(std::make_pair(std::string("end-to-end map to twist"), &end_to_end_));
+    for(std::map<std::string, LatencyHistogram>::const_iterator it = durations_.begin(); it != durations_.end(); ++it)
+        rows.push_back(std::make_pair(it->first, &it->second));
+
+    for(size_t i = 0; i < rows.size(); i++)
+    {
+        const LatencyHistogram& h = *rows[i].second;
+        ROS_INFO("%-40s n=%-6lu p50 %9.3f ms  p95 %9.3f ms  max %9.3f ms", rows[i].first.c_str(), (unsigned long)h.count(),
+                h.percentile(0.50) * 1e3, h.percentile(0.95) * 1e3, h.max() * 1e3);
+        h.toDiagnostics(rows[i].first, status);
+    }
+
+    if(diagnostics_pub_.getNumSubscribers() == 0) return;
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    msg.status.push_back(status);
+    diagnostics_pub_.publish(msg);
+}
+
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "latency_tracer");
+
+    LatencyTracer tracer;
+    ros::spin();
+
+    return 0;
+}
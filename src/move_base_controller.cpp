@@ -0,0 +1,887 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <Eigen/Geometry>
+
+#include <tf/transform_datatypes.h>
+
+#include <octomap_path_planner/move_base_controller.h>
+
+
+/**
+ * Voxel size of a navigation function received as a plain cloud: the
+ * smallest distance between neighboring points, over a few samples.
+ */
+double estimateVoxelSize(const NavigationFunctionSnapshot& navfn)
+{
+    const pcl::PointCloud<pcl::PointXYZI>& cloud = *navfn.cloud;
+    const size_t num_samples = 32;
+    const size_t step = std::max<size_t>(1, cloud.size() / num_samples);
+    double size = std::numeric_limits<double>::infinity();
+    std::vector<int> pointIdx;
+    std::vector<float> pointDistSq;
+    for(size_t i = 0; i < cloud.size(); i += step)
+    {
+        if(navfn.octree->nearestKSearch(cloud[i], 2, pointIdx, pointDistSq) < 2) continue;
+        if(pointDistSq[1] > 1e-8) size = std::min(size, sqrt((double)pointDistSq[1]));
+    }
+    return std::isfinite(size) ? size : 0.0;
+}
+
+
+TrajectoryRollout::TrajectoryRollout()
+    : num_candidates_(0), num_steps_(0),
+      grid_width_(0), grid_height_(0), grid_resolution_(0.05),
+      grid_origin_x_(0), grid_origin_y_(0)
+{
+}
+
+
+/**
+ * Precompute arc shapes for num_v x num_w velocity samples in
+ * [0, max_v] x [-max_w, max_w], over horizon seconds split in num_steps.
+ */
+void TrajectoryRollout::configure(double max_v, double max_w, int num_v, int num_w, double horizon, int num_steps)
+{
+    num_v = std::max(num_v, 1);
+    num_w = std::max(num_w, 1);
+    num_steps_ = std::max(num_steps, 1);
+    num_candidates_ = num_v * num_w;
+    v_.resize(num_candidates_);
+    w_.resize(num_candidates_);
+    offset_x_.resize(num_steps_ * num_candidates_);
+    offset_y_.resize(num_steps_ * num_candidates_);
+    x_.resize(num_candidates_);
+    y_.resize(num_candidates_);
+    end_value_.resize(num_candidates_);
+    min_clearance_.resize(num_candidates_);
+
+    for(int i = 0; i < num_v; i++)
+    {
+        for(int j = 0; j < num_w; j++)
+        {
+            int c = i * num_w + j;
+            v_[c] = num_v > 1 ? max_v * i / (num_v - 1) : max_v;
+            w_[c] = num_w > 1 ? max_w * (2.0 * j / (num_w - 1) - 1.0) : 0.0;
+            for(int k = 0; k < num_steps_; k++)
+            {
+                double t = horizon * (k + 1) / num_steps_;
+                double x, y;
+                if(fabs(w_[c]) < 1e-6)
+                {
+                    x = v_[c] * t;
+                    y = 0.0;
+                }
+                else
+                {
+                    x = v_[c] / w_[c] * sin(w_[c] * t);
+                    y = v_[c] / w_[c] * (1.0 - cos(w_[c] * t));
+                }
+                offset_x_[k * num_candidates_ + c] = x;
+                offset_y_[k * num_candidates_ + c] = y;
+            }
+        }
+    }
+}
+
+
+/**
+ * Rasterize the navigation function around (cx, cy) into a flat grid of
+ * the given half size, keeping only ground within max_dz of z, and
+ * compute the clearance of every cell from non-traversable cells with
+ * a two-pass chamfer distance transform.
+ *
+ * Each voxel covers all the cells under its footprint, so the grid can be
+ * finer than the navigation function without leaving holes between voxels.
+ */
+void TrajectoryRollout::buildCostGrid(const NavigationFunctionSnapshot& navfn, double cx, double cy, double z, double half_size, double resolution, double max_dz)
+{
+    grid_resolution_ = resolution;
+    grid_width_ = grid_height_ = 2 * (int)ceil(half_size / resolution) + 1;
+    grid_origin_x_ = cx - half_size;
+    grid_origin_y_ = cy - half_size;
+    value_.assign(grid_width_ * grid_height_, std::numeric_limits<float>::infinity());
+    clearance_.assign(grid_width_ * grid_height_, 0.0f);
+
+    pcl::PointXYZI center;
+    center.x = cx;
+    center.y = cy;
+    center.z = z;
+    std::vector<int> pointIdx;
+    std::vector<float> pointDistSq;
+    navfn.octree->radiusSearch(center, half_size * M_SQRT2 + max_dz, pointIdx, pointDistSq);
+
+    const pcl::PointCloud<pcl::PointXYZI>& cloud = *navfn.cloud;
+    const double h = 0.5 * navfn.resolution;
+    for(std::vector<int>::iterator it = pointIdx.begin(); it != pointIdx.end(); ++it)
+    {
+        const pcl::PointXYZI& p = cloud[*it];
+        if(fabs(p.z - z) > max_dz) continue;
+        // unreachable ground is an obstacle like no ground at all:
+        if(!(p.intensity < navfn.unreachable)) continue;
+        int ix0 = std::max(0, (int)floor((p.x - h - grid_origin_x_) / resolution));
+        int iy0 = std::max(0, (int)floor((p.y - h - grid_origin_y_) / resolution));
+        int ix1 = std::min(grid_width_ - 1, std::max(ix0, (int)ceil((p.x + h - grid_origin_x_) / resolution) - 1));
+        int iy1 = std::min(grid_height_ - 1, std::max(iy0, (int)ceil((p.y + h - grid_origin_y_) / resolution) - 1));
+        for(int iy = iy0; iy <= iy1; iy++)
+        {
+            for(int ix = ix0; ix <= ix1; ix++)
+            {
+                float& v = value_[iy * grid_width_ + ix];
+                v = std::min(v, p.intensity);
+            }
+        }
+    }
+
+    // chamfer distance transform (weights res and res * sqrt(2)); cells
+    // without reachable ground are obstacles:
+    const float inf = std::numeric_limits<float>::infinity();
+    const float d1 = resolution, d2 = resolution * M_SQRT2;
+    for(size_t i = 0; i < value_.size(); i++)
+        clearance_[i] = std::isfinite(value_[i]) ? inf : 0.0f;
+    for(int iy = 0; iy < grid_height_; iy++)
+    {
+        for(int ix = 0; ix < grid_width_; ix++)
+        {
+            float& c = clearance_[iy * grid_width_ + ix];
+            if(ix > 0) c = std::min(c, clearance_[iy * grid_width_ + ix - 1] + d1);
+            if(iy > 0)
+            {
+                c = std::min(c, clearance_[(iy - 1) * grid_width_ + ix] + d1);
+                if(ix > 0) c = std::min(c, clearance_[(iy - 1) * grid_width_ + ix - 1] + d2);
+                if(ix < grid_width_ - 1) c = std::min(c, clearance_[(iy - 1) * grid_width_ + ix + 1] + d2);
+            }
+        }
+    }
+    for(int iy = grid_height_ - 1; iy >= 0; iy--)
+    {
+        for(int ix = grid_width_ - 1; ix >= 0; ix--)
+        {
+            float& c = clearance_[iy * grid_width_ + ix];
+            if(ix < grid_width_ - 1) c = std::min(c, clearance_[iy * grid_width_ + ix + 1] + d1);
+            if(iy < grid_height_ - 1)
+            {
+                c = std::min(c, clearance_[(iy + 1) * grid_width_ + ix] + d1);
+                if(ix < grid_width_ - 1) c = std::min(c, clearance_[(iy + 1) * grid_width_ + ix + 1] + d2);
+                if(ix > 0) c = std::min(c, clearance_[(iy + 1) * grid_width_ + ix - 1] + d2);
+            }
+        }
+    }
+}
+
+
+/**
+ * Score all candidates from pose (px, py, yaw) and return the index of
+ * the best one, or -1 if every candidate collides or leaves the known
+ * ground. Trajectories closer than min_clearance to non-traversable
+ * cells are discarded.
+ */
+int TrajectoryRollout::evaluate(double px, double py, double yaw, double min_clearance, double goal_weight, double clearance_weight)
+{
+    const int n = num_candidates_;
+    const float c = cos(yaw), s = sin(yaw);
+    const float ox = px - grid_origin_x_, oy = py - grid_origin_y_;
+    const float inv_res = 1.0 / grid_resolution_;
+    const float inf = std::numeric_limits<float>::infinity();
+
+    std::fill(min_clearance_.begin(), min_clearance_.end(), inf);
+
+    for(int k = 0; k < num_steps_; k++)
+    {
+        const float *dx = &offset_x_[k * n];
+        const float *dy = &offset_y_[k * n];
+        float *x = &x_[0];
+        float *y = &y_[0];
+
+        // rigid transform of the whole batch (vectorizable):
+        for(int i = 0; i < n; i++)
+        {
+            x[i] = (ox + c * dx[i] - s * dy[i]) * inv_res;
+            y[i] = (oy + s * dx[i] + c * dy[i]) * inv_res;
+        }
+
+        // grid lookups:
+        for(int i = 0; i < n; i++)
+        {
+            int ix = (int)x[i], iy = (int)y[i];
+            float cl = 0.0f;
+            end_value_[i] = inf;
+            if(x[i] >= 0 && y[i] >= 0 && ix < grid_width_ && iy < grid_height_)
+            {
+                int cell = iy * grid_width_ + ix;
+                cl = clearance_[cell];
+                end_value_[i] = value_[cell];
+            }
+            min_clearance_[i] = std::min(min_clearance_[i], cl);
+        }
+    }
+
+    float vmin = inf, vmax = -inf;
+    for(int i = 0; i < n; i++)
+    {
+        if(min_clearance_[i] < min_clearance || !std::isfinite(end_value_[i])) continue;
+        vmin = std::min(vmin, end_value_[i]);
+        vmax = std::max(vmax, end_value_[i]);
+    }
+    if(!std::isfinite(vmin)) return -1;
+
+    // progress normalized to [0, 1] so the weights don't depend on the
+    // scale of the navigation function (normalized or metric):
+    const float range = vmax - vmin + 1e-6f;
+    int best = -1;
+    float best_cost = inf;
+    for(int i = 0; i < n; i++)
+    {
+        if(min_clearance_[i] < min_clearance || !std::isfinite(end_value_[i])) continue;
+        float cost = goal_weight * (end_value_[i] - vmin) / range
+            + clearance_weight * min_clearance / std::max(min_clearance_[i], 1e-3f);
+        if(cost < best_cost)
+        {
+            best_cost = cost;
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+int TrajectoryRollout::numCandidates() const
+{
+    return num_candidates_;
+}
+
+
+double TrajectoryRollout::linearVelocity(int i) const
+{
+    return v_[i];
+}
+
+
+double TrajectoryRollout::angularVelocity(int i) const
+{
+    return w_[i];
+}
+
+
+/**
+ * End point of candidate i in the robot frame.
+ */
+void TrajectoryRollout::endPoint(int i, double& x, double& y) const
+{
+    x = offset_x_[(num_steps_ - 1) * num_candidates_ + i];
+    y = offset_y_[(num_steps_ - 1) * num_candidates_ + i];
+}
+
+
+MoveBaseControllerParams::MoveBaseControllerParams()
+    : frame_id("/map"),
+      robot_frame_id("/base_link"),
+      robot_radius(0.2),
+      goal_reached_threshold(0.5),
+      local_target_radius(0.4),
+      twist_linear_gain(0.5),
+      twist_angular_gain(1.0),
+      max_repeated_failures(5),
+      local_planner("path"),
+      path_step_radius(0.15),
+      lookahead_distance(0.4),
+      path_deviation_threshold(0.5),
+      rollout_max_linear_velocity(0.5),
+      rollout_max_angular_velocity(1.0),
+      rollout_linear_samples(11),
+      rollout_angular_samples(41),
+      rollout_horizon(2.0),
+      rollout_steps(20),
+      rollout_grid_resolution(0.05),
+      rollout_max_height_difference(0.3),
+      rollout_goal_weight(1.0),
+      rollout_clearance_weight(0.2)
+{
+}
+
+
+MoveBaseController::MoveBaseController(const MoveBaseControllerParams& params)
+    : params_(params),
+      local_target_duration_(0.0),
+      path_navfn_version_(0),
+      path_index_(0),
+      path_revision_(0),
+      reached_position_(false),
+      repeated_failures_(0)
+{
+    if(params_.local_planner != "path" && params_.local_planner != "greedy" && params_.local_planner != "rollout")
+    {
+        ROS_ERROR("invalid local_planner '%s' (must be 'path', 'greedy' or 'rollout'); using 'path'", params_.local_planner.c_str());
+        params_.local_planner = "path";
+    }
+    if(params_.local_planner == "rollout")
+    {
+        rollout_.configure(params_.rollout_max_linear_velocity, params_.rollout_max_angular_velocity,
+                params_.rollout_linear_samples, params_.rollout_angular_samples, params_.rollout_horizon, params_.rollout_steps);
+    }
+    robot_pose_.pose.orientation.w = 1.0;
+}
+
+
+const MoveBaseControllerParams& MoveBaseController::params() const
+{
+    return params_;
+}
+
+
+void MoveBaseController::setNavigationFunction(const NavigationFunctionSnapshotConstPtr& navfn)
+{
+    navfn_ = navfn;
+}
+
+
+const NavigationFunctionSnapshotConstPtr& MoveBaseController::navigationFunction() const
+{
+    return navfn_;
+}
+
+
+/**
+ * Set a new goal (in frame_id) and reset the controller state.
+ *
+ * The goal position is projected to the navigation function; returns false
+ * if that is not possible.
+ */
+bool MoveBaseController::setGoal(const geometry_msgs::PoseStamped& goal)
+{
+    goal_ = goal;
+
+    if(!projectGoalPositionToNavigationFunction())
+        return false;
+
+    reached_position_ = false;
+    repeated_failures_ = 0;
+    // force path extraction towards the new goal:
+    path_.poses.clear();
+    return true;
+}
+
+
+const geometry_msgs::PoseStamped& MoveBaseController::goal() const
+{
+    return goal_;
+}
+
+
+void MoveBaseController::setRobotPose(const geometry_msgs::PoseStamped& robot_pose)
+{
+    robot_pose_ = robot_pose;
+}
+
+
+/**
+ * Count a failure that happened outside update() (e.g. a failed robot pose
+ * lookup) towards max_repeated_failures.
+ */
+void MoveBaseController::reportFailure()
+{
+    repeated_failures_++;
+}
+
+
+bool MoveBaseController::hasGivenUp() const
+{
+    return repeated_failures_ >= params_.max_repeated_failures;
+}
+
+
+/**
+ * Run one control step: regulate position (following the navigation
+ * function with the configured local planner) until within
+ * goal_reached_threshold, then regulate orientation.
+ */
+MoveBaseController::Status MoveBaseController::update(geometry_msgs::Twist& twist)
+{
+    twist.linear.x = 0.0;
+    twist.linear.y = 0.0;
+    twist.linear.z = 0.0;
+    twist.angular.x = 0.0;
+    twist.angular.y = 0.0;
+    twist.angular.z = 0.0;
+
+    if(hasGivenUp())
+        return GAVE_UP;
+
+    if(!navfn_)
+    {
+        ROS_ERROR("controller: no navigation function received yet");
+        repeated_failures_++;
+        return FAILED;
+    }
+
+    double ep = positionError();
+    double eo = orientationError();
+
+    Status status;
+
+    if((!reached_position_ && ep > params_.goal_reached_threshold)
+        || (reached_position_ && ep > 2 * params_.goal_reached_threshold))
+    {
+        // regulate position
+
+        status = REGULATING_POSITION;
+
+        reached_position_ = false;
+
+        ros::WallTime local_target_start = ros::WallTime::now();
+        bool got_local_target;
+        if(params_.local_planner == "rollout")
+            got_local_target = generateRolloutCommand(twist);
+        else if(params_.local_planner == "path")
+            got_local_target = generatePathTarget(local_target_);
+        else
+            got_local_target = generateLocalTarget(local_target_);
+        local_target_duration_ = (ros::WallTime::now() - local_target_start).toSec();
+        if(!got_local_target)
+        {
+            repeated_failures_++;
+            ROS_ERROR("controller: failed to generate a local target to follow");
+            return FAILED;
+        }
+
+        if(params_.local_planner != "rollout")
+            generateTwistCommand(local_target_, twist);
+    }
+    else
+    {
+        reached_position_ = true;
+
+        if(fabs(eo) > 0.02)
+        {
+            // regulate orientation
+
+            status = REGULATING_ORIENTATION;
+
+            twist.angular.z = params_.twist_angular_gain * eo;
+        }
+        else
+        {
+            // goal reached
+
+            status = REACHED_GOAL;
+        }
+    }
+
+    repeated_failures_ = 0;
+
+    return status;
+}
+
+
+const char * MoveBaseController::statusString(Status status)
+{
+    switch(status)
+    {
+    case REGULATING_POSITION: return "REGULATING POSITION";
+    case REGULATING_ORIENTATION: return "REGULATING ORIENTATION";
+    case REACHED_GOAL: return "REACHED GOAL";
+    case FAILED: return "FAILED";
+    case GAVE_UP: return "GAVE UP";
+    }
+    return "";
+}
+
+
+const geometry_msgs::PointStamped& MoveBaseController::localTarget() const
+{
+    return local_target_;
+}
+
+
+/**
+ * Time (in seconds) spent by the local planner in the last update().
+ */
+double MoveBaseController::localTargetDuration() const
+{
+    return local_target_duration_;
+}
+
+
+const nav_msgs::Path& MoveBaseController::path() const
+{
+    return path_;
+}
+
+
+/**
+ * Incremented every time path() changes.
+ */
+unsigned int MoveBaseController::pathRevision() const
+{
+    return path_revision_;
+}
+
+
+/**
+ * Express a point given in frame_id in the robot frame, using the current
+ * robot pose.
+ */
+void MoveBaseController::transformToRobotFrame(const geometry_msgs::Point& p_map, geometry_msgs::Point& p_local)
+{
+    const geometry_msgs::Pose& pose = robot_pose_.pose;
+    Eigen::Quaterniond q(pose.orientation.w, pose.orientation.x, pose.orientation.y, pose.orientation.z);
+    Eigen::Vector3d d(p_map.x - pose.position.x, p_map.y - pose.position.y, p_map.z - pose.position.z);
+    Eigen::Vector3d l = q.conjugate() * d;
+    p_local.x = l(0);
+    p_local.y = l(1);
+    p_local.z = l(2);
+}
+
+
+int MoveBaseController::projectPositionToNavigationFunction(const geometry_msgs::Point& pos)
+{
+    if(!navfn_) return -1;
+
+    pcl::PointXYZI p;
+    p.x = pos.x;
+    p.y = pos.y;
+    p.z = pos.z;
+    std::vector<int> pointIdx;
+    std::vector<float> pointDistSq;
+    if(navfn_->octree->nearestKSearch(p, 1, pointIdx, pointDistSq) < 1)
+    {
+        return -1;
+    }
+    return pointIdx[0];
+}
+
+
+void MoveBaseController::getNavigationFunctionNeighborhood(const geometry_msgs::Point& pos, pcl::PointCloud<pcl::PointXYZI>& neighbors)
+{
+    pcl::PointXYZI robot_position;
+
+    robot_position.x = pos.x;
+    robot_position.y = pos.y;
+    robot_position.z = pos.z;
+
+    std::vector<int> pointIdx;
+    std::vector<float> pointDistSq;
+
+    navfn_->octree->radiusSearch(robot_position, params_.local_target_radius, pointIdx, pointDistSq);
+
+    const pcl::PointCloud<pcl::PointXYZI>& navfn = *navfn_->cloud;
+    neighbors.header.frame_id = navfn.header.frame_id;
+    neighbors.header.stamp = navfn.header.stamp;
+    for(std::vector<int>::iterator it = pointIdx.begin(); it != pointIdx.end(); ++it)
+        neighbors.push_back(navfn[*it]);
+}
+
+
+bool MoveBaseController::projectGoalPositionToNavigationFunction()
+{
+    int goal_index = projectPositionToNavigationFunction(goal_.pose.position);
+    if(goal_index == -1)
+    {
+        ROS_ERROR("Failed to project goal position to navfn pcl");
+        return false;
+    }
+    const pcl::PointXYZI& p = (*navfn_->cloud)[goal_index];
+    if(dist(goal_.pose.position, p) > params_.robot_radius)
+    {
+        ROS_ERROR("Failed to project goal position to navfn pcl (point is too far from ground)");
+        return false;
+    }
+    goal_.pose.position.x = p.x;
+    goal_.pose.position.y = p.y;
+    goal_.pose.position.z = p.z;
+    return true;
+}
+
+
+double MoveBaseController::positionError()
+{
+    return sqrt(
+            pow(robot_pose_.pose.position.x - goal_.pose.position.x, 2) +
+            pow(robot_pose_.pose.position.y - goal_.pose.position.y, 2) +
+            pow(robot_pose_.pose.position.z - goal_.pose.position.z, 2)
+    );
+}
+
+
+double MoveBaseController::orientationError()
+{
+    // check if goal is only by position:
+    double qnorm = pow(goal_.pose.orientation.w, 2) +
+            pow(goal_.pose.orientation.x, 2) +
+            pow(goal_.pose.orientation.y, 2) +
+            pow(goal_.pose.orientation.z, 2);
+
+    // if so, we never have an orientation error:
+    if(qnorm < 1e-5) return 0;
+
+    // "Robotica - Modellistica Pianificazione e Controllo" eq. 3.88
+    double nd = goal_.pose.orientation.w,
+            ne = robot_pose_.pose.orientation.w;
+    Eigen::Vector3d ed(goal_.pose.orientation.x, goal_.pose.orientation.y, goal_.pose.orientation.z),
+            ee(robot_pose_.pose.orientation.x, robot_pose_.pose.orientation.y, robot_pose_.pose.orientation.z);
+    Eigen::Vector3d eo = ne * ed - nd * ee - ed.cross(ee);
+    return eo(2);
+}
+
+
+bool MoveBaseController::generateLocalTarget(geometry_msgs::PointStamped& p_local)
+{
+    // get navigation function neighborhood centered at robot pos:
+    pcl::PointCloud<pcl::PointXYZI> neighbors;
+    getNavigationFunctionNeighborhood(robot_pose_.pose.position, neighbors);
+
+    // find minimum distance point in neighborhood:
+    int min_index = -1;
+    float min_value = std::numeric_limits<float>::infinity();
+
+    for(size_t i = 0; i < neighbors.size(); i++)
+    {
+        pcl::PointXYZI& p = neighbors[i];
+
+        if(p.intensity < min_value)
+        {
+            min_value = p.intensity;
+            min_index = i;
+        }
+    }
+
+    if(min_index == -1)
+    {
+        ROS_ERROR("Failed to find a target in robot vicinity");
+        return false;
+    }
+
+    // check if we are actually improving the value in the navigation function
+    int rob_index = projectPositionToNavigationFunction(robot_pose_.pose.position);
+    if(rob_index == -1)
+    {
+        ROS_ERROR("Failed to project robot position to navfn pcl");
+        return false;
+    }
+    double delta = (*navfn_->cloud)[rob_index].intensity - min_value;
+    if(delta < 1e-6)
+    {
+        ROS_ERROR("Failed to generate a target: gradient is null");
+        return false;
+    }
+
+    geometry_msgs::Point p_map;
+    p_map.x = neighbors[min_index].x;
+    p_map.y = neighbors[min_index].y;
+    p_map.z = neighbors[min_index].z;
+
+    p_local.header.stamp = robot_pose_.header.stamp;
+    p_local.header.frame_id = params_.robot_frame_id;
+    transformToRobotFrame(p_map, p_local.point);
+
+    return true;
+}
+
+
+/**
+ * Extract the full descent path from the robot to the goal by following the
+ * navigation function downhill.
+ *
+ * On plateaus the search radius is doubled (up to params_.local_target_radius) until
+ * a lower value is found.
+ */
+bool MoveBaseController::extractPath()
+{
+    path_navfn_version_ = navfn_->version;
+    path_index_ = 0;
+    path_.poses.clear();
+    path_.header.frame_id = params_.frame_id;
+    path_.header.stamp = robot_pose_.header.stamp;
+
+    const pcl::PointCloud<pcl::PointXYZI>& navfn = *navfn_->cloud;
+
+    int i = projectPositionToNavigationFunction(robot_pose_.pose.position);
+    int goal_index = projectPositionToNavigationFunction(goal_.pose.position);
+    if(i == -1 || goal_index == -1)
+    {
+        ROS_ERROR("Failed to extract path: cannot project robot or goal to navfn pcl");
+        return false;
+    }
+
+    std::vector<int> pointIdx;
+    std::vector<float> pointDistSq;
+
+    while(true)
+    {
+        geometry_msgs::PoseStamped pose;
+        pose.header = path_.header;
+        pose.pose.position.x = navfn[i].x;
+        pose.pose.position.y = navfn[i].y;
+        pose.pose.position.z = navfn[i].z;
+        pose.pose.orientation.w = 1.0;
+        path_.poses.push_back(pose);
+
+        if(i == goal_index || navfn[i].intensity <= navfn[goal_index].intensity)
+            break;
+
+        // steepest descent in the neighborhood, widening the search on plateaus:
+        int next = -1;
+        for(double r = params_.path_step_radius; next == -1 && r <= std::max(params_.path_step_radius, params_.local_target_radius); r *= 2)
+        {
+            navfn_->octree->radiusSearch(navfn[i], r, pointIdx, pointDistSq);
+            float min_value = navfn[i].intensity - 1e-6;
+            for(std::vector<int>::iterator it = pointIdx.begin(); it != pointIdx.end(); ++it)
+            {
+                if(navfn[*it].intensity < min_value)
+                {
+                    min_value = navfn[*it].intensity;
+                    next = *it;
+                }
+            }
+        }
+
+        if(next == -1)
+        {
+            if(dist(navfn[i], goal_.pose.position) <= params_.goal_reached_threshold)
+                break;
+
+            ROS_ERROR("Failed to extract path: gradient is null at (%f, %f, %f)", navfn[i].x, navfn[i].y, navfn[i].z);
+            path_.poses.clear();
+            path_revision_++;
+            return false;
+        }
+
+        i = next;
+    }
+
+    // orient each pose towards the next one:
+    for(size_t k = 0; k + 1 < path_.poses.size(); k++)
+    {
+        const geometry_msgs::Point& a = path_.poses[k].pose.position;
+        const geometry_msgs::Point& b = path_.poses[k + 1].pose.position;
+        path_.poses[k].pose.orientation = tf::createQuaternionMsgFromYaw(atan2(b.y - a.y, b.x - a.x));
+    }
+    if(path_.poses.size() > 1)
+        path_.poses.back().pose.orientation = path_.poses[path_.poses.size() - 2].pose.orientation;
+
+    ROS_DEBUG("extracted path of %ld poses", path_.poses.size());
+    path_revision_++;
+
+    return true;
+}
+
+
+/**
+ * Generate a local target by tracking a lookahead point on the cached path.
+ *
+ * The path is (re-)extracted when a new navigation function is received or
+ * when the robot deviates from it by more than params_.path_deviation_threshold.
+ */
+bool MoveBaseController::generatePathTarget(geometry_msgs::PointStamped& p_local)
+{
+    if(path_navfn_version_ != navfn_->version || path_.poses.empty())
+    {
+        if(!extractPath()) return false;
+    }
+
+    const geometry_msgs::Point& robot = robot_pose_.pose.position;
+
+    // advance the path index to the closest pose, looking ahead only a bit
+    // so that self-intersecting paths are followed in order:
+    double best_d = std::numeric_limits<double>::infinity();
+    for(size_t k = path_index_; k < path_.poses.size(); k++)
+    {
+        double d = dist(path_.poses[k].pose.position, robot);
+        if(d < best_d)
+        {
+            best_d = d;
+            path_index_ = k;
+        }
+        else if(d > best_d + params_.lookahead_distance) break;
+    }
+
+    if(best_d > params_.path_deviation_threshold)
+    {
+        ROS_WARN("robot deviated %f m from path; extracting a new one", best_d);
+        if(!extractPath()) return false;
+    }
+
+    size_t target = path_index_;
+    while(target + 1 < path_.poses.size() && dist(path_.poses[target].pose.position, robot) < params_.lookahead_distance)
+        target++;
+
+    p_local.header.frame_id = params_.robot_frame_id;
+    p_local.header.stamp = robot_pose_.header.stamp;
+    transformToRobotFrame(path_.poses[target].pose.position, p_local.point);
+
+    return true;
+}
+
+
+/**
+ * Pick the best of the sampled arcs by rolling them out on a local cost grid
+ * built from the navigation function around the robot.
+ */
+bool MoveBaseController::generateRolloutCommand(geometry_msgs::Twist& twist)
+{
+    int rob_index = projectPositionToNavigationFunction(robot_pose_.pose.position);
+    if(rob_index == -1)
+    {
+        ROS_ERROR("Failed to project robot position to navfn pcl");
+        return false;
+    }
+    double ground_z = (*navfn_->cloud)[rob_index].z;
+
+    const geometry_msgs::Point& p = robot_pose_.pose.position;
+    double half_size = params_.rollout_max_linear_velocity * params_.rollout_horizon + params_.robot_radius + params_.rollout_grid_resolution;
+    rollout_.buildCostGrid(*navfn_, p.x, p.y, ground_z, half_size, params_.rollout_grid_resolution, params_.rollout_max_height_difference);
+
+    double yaw = tf::getYaw(robot_pose_.pose.orientation);
+    int best = rollout_.evaluate(p.x, p.y, yaw, params_.robot_radius, params_.rollout_goal_weight, params_.rollout_clearance_weight);
+    if(best == -1)
+    {
+        ROS_ERROR("Failed to find a collision-free trajectory among %d candidates", rollout_.numCandidates());
+        return false;
+    }
+
+    twist.linear.x = rollout_.linearVelocity(best);
+    twist.angular.z = rollout_.angularVelocity(best);
+
+    local_target_.header.frame_id = params_.robot_frame_id;
+    local_target_.header.stamp = robot_pose_.header.stamp;
+    rollout_.endPoint(best, local_target_.point.x, local_target_.point.y);
+    local_target_.point.z = 0.0;
+
+    return true;
+}
+
+
+void MoveBaseController::generateTwistCommand(const geometry_msgs::PointStamped& local_target, geometry_msgs::Twist& twist)
+{
+    if(local_target.header.frame_id != params_.robot_frame_id)
+    {
+        ROS_ERROR("generateTwistCommand: local_target must be in frame '%s'", params_.robot_frame_id.c_str());
+        return;
+    }
+
+    twist.linear.x = 0.0;
+    twist.linear.y = 0.0;
+    twist.linear.z = 0.0;
+    twist.angular.x = 0.0;
+    twist.angular.y = 0.0;
+    twist.angular.z = 0.0;
+
+    const geometry_msgs::Point& p = local_target.point;
+
+    if(p.x < 0 || fabs(p.y) > p.x)
+    {
+        // turn in place
+        twist.angular.z = (p.y > 0 ? 1 : -1) * params_.twist_angular_gain;
+    }
+    else
+    {
+        // make arc
+        double center_y = (pow(p.x, 2) + pow(p.y, 2)) / (2 * p.y);
+        double theta = fabs(atan2(p.x, fabs(center_y) - fabs(p.y)));
+        double arc_length = fabs(center_y * theta);
+
+        twist.linear.x = params_.twist_linear_gain * arc_length;
+        twist.angular.z = params_.twist_angular_gain * (p.y >= 0 ? 1 : -1) * theta;
+    }
+}
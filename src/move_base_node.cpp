@@ -3,19 +3,28 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
 #include <limits>
+#include <algorithm>
 
 #include <boost/foreach.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/thread.hpp>
 #include <boost/chrono.hpp>
 #include <boost/random.hpp>
 #include <boost/random/uniform_real.hpp>
 #include <boost/random/normal_distribution.hpp>
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <std_msgs/Float32.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <geometry_msgs/Point.h>
 #include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/PoseStamped.h>
@@ -44,22 +53,36 @@
 
 #include <pcl_conversions/pcl_conversions.h>
 
+#include <octomap_path_planner/NavigationFunctionDelta.h>
+#include <octomap_path_planner/latency_histogram.h>
+#include <octomap_path_planner/tracer.h>
+#include <octomap_path_planner/move_base_controller.h>
+
 
-template<typename PointA, typename PointB>
-double sqdist(const PointA& a, const PointB& b)
+/**
+ * The changes of a navigation function delta, in terms of cloud indices:
+ * new values, removed points, and points appended to the cloud (in the
+ * map frame).
+ */
+struct NavigationFunctionChange
 {
-    double dx = a.x - b.x;
-    double dy = a.y - b.y;
-    double dz = a.z - b.z;
-    return dx * dx + dy * dy + dz * dz;
-}
+    std::vector<std::pair<int, float> > values;
+    std::vector<int> removed;
+    pcl::PointCloud<pcl::PointXYZI> added;
+};
 
 
-template<typename PointA, typename PointB>
-double dist(const PointA& a, const PointB& b)
+/**
+ * A navigation function snapshot updated in place by the deltas, and the
+ * number of changes applied to it since the keyframe.
+ */
+struct NavigationFunctionBuffer
 {
-    return sqrt(sqdist(a, b));
-}
+    boost::shared_ptr<NavigationFunctionSnapshot> snapshot;
+    size_t version;
+
+    NavigationFunctionBuffer(const boost::shared_ptr<NavigationFunctionSnapshot>& s, size_t v) : snapshot(s), version(v) {}
+};
 
 
 class MoveBase
@@ -67,45 +90,65 @@ class MoveBase
 protected:
     ros::NodeHandle nh_;
     ros::NodeHandle pnh_;
+    ros::NodeHandle controller_nh_;
+    ros::CallbackQueue controller_queue_;
+    boost::thread controller_thread_;
     std::string frame_id_;
     std::string robot_frame_id_;
     ros::Subscriber navfn_sub_;
+    ros::Subscriber navfn_delta_sub_;
     ros::Subscriber goal_point_sub_;
     ros::Subscriber goal_pose_sub_;
     ros::Publisher twist_pub_;
     ros::Publisher target_pub_;
+    ros::Publisher path_pub_;
     ros::Publisher position_error_pub_;
     ros::Publisher orientation_error_pub_;
+    ros::Publisher diagnostics_pub_;
     tf::TransformListener tf_listener_;    
     geometry_msgs::PoseStamped robot_pose_;
-    geometry_msgs::PoseStamped goal_;
-    pcl::PointCloud<pcl::PointXYZI> navfn_;
-    pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr navfn_octree_ptr_;
+    MoveBaseController controller_;
+    unsigned int published_path_revision_;
+    NavigationFunctionSnapshotConstPtr navfn_latest_;
+    NavigationFunctionSnapshotConstPtr navfn_retired_;
+    boost::unordered_map<uint64_t, int> navfn_delta_index_;
+    uint32_t navfn_delta_sequence_;
+    bool navfn_delta_synced_;
+    std::vector<NavigationFunctionBuffer> navfn_buffers_;
+    std::deque<NavigationFunctionChange> navfn_changes_;
+    size_t navfn_version_;
+    // versions of the published snapshots
+    uint64_t navfn_published_;
     ros::Timer controller_timer_;
-    double robot_radius_;
-    double goal_reached_threshold_;
+    ros::Timer diagnostics_timer_;
+    double diagnostics_period_;
+    LatencyHistogram tick_jitter_hist_;
+    LatencyHistogram tf_wait_hist_;
+    LatencyHistogram local_target_hist_;
+    LatencyHistogram tick_total_hist_;
+    LatencyHistogram map_to_twist_hist_;
+    ros::Time last_twist_map_stamp_;
+    Tracer tracer_;
+    const char *last_status_str_;
     double controller_frequency_;
-    double local_target_radius_;
-    double twist_linear_gain_;
-    double twist_angular_gain_;
-    bool reached_position_;
-    int controller_repeated_failures_;
+    bool use_navfn_delta_;
+    int controller_thread_priority_;
     void startController();
+    void publishNavigationFunction(const boost::shared_ptr<NavigationFunctionSnapshot>& snapshot);
+    boost::shared_ptr<NavigationFunctionSnapshot> updateNavigationFunctionBuffer(const NavigationFunctionChange& change);
+    bool updateNavigationFunction();
+    void controllerThread();
 public:
     MoveBase();
     ~MoveBase();
     void onNavigationFunctionChange(const sensor_msgs::PointCloud2::ConstPtr& msg);
+    void onNavigationFunctionDelta(const octomap_path_planner::NavigationFunctionDelta::ConstPtr& msg);
     void onGoal(const geometry_msgs::PointStamped::ConstPtr& msg);
     void onGoal(const geometry_msgs::PoseStamped::ConstPtr& msg);
-    int projectPositionToNavigationFunction(const geometry_msgs::Point& pos);
-    void getNavigationFunctionNeighborhood(const geometry_msgs::Point& pos, pcl::PointCloud<pcl::PointXYZI>& neighbors);
-    bool projectGoalPositionToNavigationFunction();
     bool getRobotPose();
-    double positionError();
-    double orientationError();
-    bool generateLocalTarget(geometry_msgs::PointStamped& p_local);
-    void generateTwistCommand(const geometry_msgs::PointStamped& local_target, geometry_msgs::Twist& twist);
     void controllerCallback(const ros::TimerEvent& event);
+    void diagnosticsCallback(const ros::TimerEvent& event);
+    void publishDiagnostics();
 };
 
 
@@ -113,396 +156,591 @@ MoveBase::MoveBase()
     : pnh_("~"),
       frame_id_("/map"),
       robot_frame_id_("/base_link"),
-      robot_radius_(0.2),
-      goal_reached_threshold_(0.5),
+      published_path_revision_(0),
+      navfn_delta_sequence_(0),
+      navfn_delta_synced_(false),
+      navfn_version_(0),
+      navfn_published_(0),
+      diagnostics_period_(1.0),
+      last_status_str_(""),
       controller_frequency_(2.0),
-      local_target_radius_(0.4),
-      twist_linear_gain_(0.5),
-      twist_angular_gain_(1.0),
-      reached_position_(false),
-      controller_repeated_failures_(0)
+      use_navfn_delta_(false),
+      controller_thread_priority_(0)
 {
+    MoveBaseControllerParams params;
     pnh_.param("frame_id", frame_id_, frame_id_);
     pnh_.param("robot_frame_id", robot_frame_id_, robot_frame_id_);
-    pnh_.param("robot_radius", robot_radius_, robot_radius_);
-    pnh_.param("goal_reached_threshold", goal_reached_threshold_, goal_reached_threshold_);
+    params.frame_id = frame_id_;
+    params.robot_frame_id = robot_frame_id_;
+    pnh_.param("robot_radius", params.robot_radius, params.robot_radius);
+    pnh_.param("goal_reached_threshold", params.goal_reached_threshold, params.goal_reached_threshold);
     pnh_.param("controller_frequency", controller_frequency_, controller_frequency_);
-    pnh_.param("local_target_radius", local_target_radius_, local_target_radius_);
-    pnh_.param("twist_linear_gain", twist_linear_gain_, twist_linear_gain_);
-    pnh_.param("twist_angular_gain", twist_angular_gain_, twist_angular_gain_);
-    navfn_sub_ = nh_.subscribe<sensor_msgs::PointCloud2>("navfn_in", 1, &MoveBase::onNavigationFunctionChange, this);
-    goal_point_sub_ = nh_.subscribe<geometry_msgs::PointStamped>("goal_point_in", 1, &MoveBase::onGoal, this);
-    goal_pose_sub_ = nh_.subscribe<geometry_msgs::PoseStamped>("goal_pose_in", 1, &MoveBase::onGoal, this);
+    pnh_.param("local_target_radius", params.local_target_radius, params.local_target_radius);
+    pnh_.param("twist_linear_gain", params.twist_linear_gain, params.twist_linear_gain);
+    pnh_.param("twist_angular_gain", params.twist_angular_gain, params.twist_angular_gain);
+    pnh_.param("use_navfn_delta", use_navfn_delta_, use_navfn_delta_);
+    pnh_.param("local_planner", params.local_planner, params.local_planner);
+    pnh_.param("path_step_radius", params.path_step_radius, params.path_step_radius);
+    pnh_.param("lookahead_distance", params.lookahead_distance, params.lookahead_distance);
+    pnh_.param("path_deviation_threshold", params.path_deviation_threshold, params.path_deviation_threshold);
+    pnh_.param("rollout_max_linear_velocity", params.rollout_max_linear_velocity, params.rollout_max_linear_velocity);
+    pnh_.param("rollout_max_angular_velocity", params.rollout_max_angular_velocity, params.rollout_max_angular_velocity);
+    pnh_.param("rollout_linear_samples", params.rollout_linear_samples, params.rollout_linear_samples);
+    pnh_.param("rollout_angular_samples", params.rollout_angular_samples, params.rollout_angular_samples);
+    pnh_.param("rollout_horizon", params.rollout_horizon, params.rollout_horizon);
+    pnh_.param("rollout_steps", params.rollout_steps, params.rollout_steps);
+    pnh_.param("rollout_grid_resolution", params.rollout_grid_resolution, params.rollout_grid_resolution);
+    pnh_.param("rollout_max_height_difference", params.rollout_max_height_difference, params.rollout_max_height_difference);
+    pnh_.param("rollout_goal_weight", params.rollout_goal_weight, params.rollout_goal_weight);
+    pnh_.param("rollout_clearance_weight", params.rollout_clearance_weight, params.rollout_clearance_weight);
+    controller_ = MoveBaseController(params);
+    pnh_.param("controller_thread_priority", controller_thread_priority_, controller_thread_priority_);
+    pnh_.param("diagnostics_period", diagnostics_period_, diagnostics_period_);
+    bool trace = false;
+    pnh_.param("trace", trace, trace);
+    tracer_.init(nh_, trace);
+    // goals and controller ticks are served by a dedicated thread, so that
+    // ingesting a large navigation function never delays a control tick:
+    controller_nh_.setCallbackQueue(&controller_queue_);
+    if(use_navfn_delta_)
+        navfn_delta_sub_ = nh_.subscribe<octomap_path_planner::NavigationFunctionDelta>("navfn_delta_in", 10, &MoveBase::onNavigationFunctionDelta, this);
+    else
+        navfn_sub_ = nh_.subscribe<sensor_msgs::PointCloud2>("navfn_in", 1, &MoveBase::onNavigationFunctionChange, this);
+    goal_point_sub_ = controller_nh_.subscribe<geometry_msgs::PointStamped>("goal_point_in", 1, &MoveBase::onGoal, this);
+    goal_pose_sub_ = controller_nh_.subscribe<geometry_msgs::PoseStamped>("goal_pose_in", 1, &MoveBase::onGoal, this);
     twist_pub_ = nh_.advertise<geometry_msgs::Twist>("twist_out", 1, false);
     target_pub_ = nh_.advertise<geometry_msgs::PointStamped>("target_out", 1, false);
+    path_pub_ = nh_.advertise<nav_msgs::Path>("path_out", 1, true);
     position_error_pub_ = nh_.advertise<std_msgs::Float32>("position_error", 10, false);;
     orientation_error_pub_ = nh_.advertise<std_msgs::Float32>("orientation_error", 10, false);;
+    diagnostics_pub_ = nh_.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 1, false);
+    if(diagnostics_period_ > 0)
+        diagnostics_timer_ = controller_nh_.createTimer(ros::Duration(diagnostics_period_), &MoveBase::diagnosticsCallback, this);
+    controller_thread_ = boost::thread(&MoveBase::controllerThread, this);
 }
 
 
 MoveBase::~MoveBase()
 {
+    controller_thread_.join();
+}
+
+
+void MoveBase::controllerThread()
+{
+    if(controller_thread_priority_ > 0)
+    {
+        struct sched_param sp;
+        sp.sched_priority = controller_thread_priority_;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if(err != 0)
+            ROS_WARN("failed to set controller thread priority to %d (SCHED_FIFO): %s", controller_thread_priority_, strerror(err));
+    }
+
+    while(controller_nh_.ok())
+    {
+        controller_queue_.callAvailable(ros::WallDuration(0.01));
+    }
 }
 
 
 void MoveBase::onNavigationFunctionChange(const sensor_msgs::PointCloud2::ConstPtr& pcl_msg)
 {
+    ros::WallTime start = ros::WallTime::now();
     pcl::PointCloud<pcl::PointXYZI> pcl;
     pcl::fromROSMsg(*pcl_msg, pcl);
+    // (the stamp is the map's: transform with the latest tf)
+    pcl.header.stamp = 0;
+
+    boost::shared_ptr<NavigationFunctionSnapshot> snapshot(new NavigationFunctionSnapshot);
+    snapshot->cloud = pcl::PointCloud<pcl::PointXYZI>::Ptr(new pcl::PointCloud<pcl::PointXYZI>);
+    pcl_ros::transformPointCloud(frame_id_, pcl, *snapshot->cloud, tf_listener_);
+
+    snapshot->octree = pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr(new pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>(0.01));
+    snapshot->octree->setInputCloud(snapshot->cloud);
+    snapshot->octree->addPointsFromInputCloud();
+    snapshot->map_stamp = pcl_msg->header.stamp;
+    snapshot->resolution = estimateVoxelSize(*snapshot);
+
+    publishNavigationFunction(snapshot);
+    tracer_.add("move_base/navfn", start, ros::WallTime::now(), snapshot->map_stamp);
+    tracer_.flush();
+}
 
-    navfn_.clear();
-    pcl_ros::transformPointCloud(frame_id_, pcl, navfn_, tf_listener_);
 
-    navfn_octree_ptr_ = pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr(new pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>(0.01));
-    navfn_octree_ptr_->setInputCloud(navfn_.makeShared());
-    navfn_octree_ptr_->addPointsFromInputCloud();
+void MoveBase::publishNavigationFunction(const boost::shared_ptr<NavigationFunctionSnapshot>& snapshot)
+{
+    snapshot->version = ++navfn_published_;
+    // keep a reference to the replaced snapshot until the next update, so
+    // that it gets freed on this thread rather than by the controller thread
+    // when it drops its own reference:
+    navfn_retired_ = boost::atomic_exchange(&navfn_latest_, NavigationFunctionSnapshotConstPtr(snapshot));
 }
 
 
-void MoveBase::startController()
+static inline uint64_t packNavigationFunctionKey(const std::vector<uint16_t>& keys, size_t i)
 {
-    reached_position_ = false;
-    controller_repeated_failures_ = 0;
-    controller_timer_ = nh_.createTimer(ros::Duration(1.0 / controller_frequency_), &MoveBase::controllerCallback, this);
+    return ((uint64_t)keys[3 * i] << 32) | ((uint64_t)keys[3 * i + 1] << 16) | (uint64_t)keys[3 * i + 2];
 }
 
 
-void MoveBase::onGoal(const geometry_msgs::PointStamped::ConstPtr& msg)
+static inline float navigationFunctionKeyToCoord(uint16_t key, double resolution)
 {
-    try
-    {
-        geometry_msgs::PointStamped msg2;
-        tf_listener_.transformPoint(frame_id_, *msg, msg2);
-        goal_.header.stamp = msg2.header.stamp;
-        goal_.header.frame_id = msg2.header.frame_id;
-        goal_.pose.position.x = msg2.point.x;
-        goal_.pose.position.y = msg2.point.y;
-        goal_.pose.position.z = msg2.point.z;
-        goal_.pose.orientation.x = 0.0;
-        goal_.pose.orientation.y = 0.0;
-        goal_.pose.orientation.z = 0.0;
-        goal_.pose.orientation.w = 0.0;
-
-        if(projectGoalPositionToNavigationFunction())
-        {
-            ROS_INFO("goal set to point (%f, %f, %f)",
-                goal_.pose.position.x, goal_.pose.position.y, goal_.pose.position.z);
-
-            startController();
-        }
-    }
-    catch(tf::TransformException& ex)
-    {
-        ROS_ERROR("Failed to lookup robot position: %s", ex.what());
-    }
+    // see NavigationFunctionDelta.msg
+    return ((int)key - 32768 + 0.5) * resolution;
 }
 
 
-void MoveBase::onGoal(const geometry_msgs::PoseStamped::ConstPtr& msg)
+static pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr makeNavigationFunctionIndex(const pcl::PointCloud<pcl::PointXYZI>::Ptr& cloud)
 {
-    try
-    {
-        tf_listener_.transformPose(frame_id_, *msg, goal_);
-        
-        if(projectGoalPositionToNavigationFunction())
-        {
-            ROS_INFO("goal set to pose (%f, %f, %f), (%f, %f, %f, %f)",
-                    goal_.pose.position.x, goal_.pose.position.y, goal_.pose.position.z,
-                    goal_.pose.orientation.x, goal_.pose.orientation.y, goal_.pose.orientation.z,
-                    goal_.pose.orientation.w);
+    pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr octree(new pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>(0.01));
+    octree->setInputCloud(cloud);
+    // (removed points have NaN coordinates, and are skipped)
+    octree->addPointsFromInputCloud();
+    return octree;
+}
 
-            startController();
-        }
-    }
-    catch(tf::TransformException& ex)
+
+/**
+ * Apply a change to a snapshot and its search index, in place.
+ *
+ * Removed points are taken out of the index, and left in the cloud as
+ * NaN points with an infinite value, so that the indices of the others
+ * don't change.
+ */
+static void applyNavigationFunctionChange(NavigationFunctionSnapshot& snapshot, const NavigationFunctionChange& change)
+{
+    pcl::PointCloud<pcl::PointXYZI>& cloud = *snapshot.cloud;
+    for(size_t k = 0; k < change.removed.size(); k++)
     {
-        ROS_ERROR("Failed to lookup robot position: %s", ex.what());
+        pcl::PointXYZI& p = cloud[change.removed[k]];
+        snapshot.octree->deleteVoxelAtPoint(p);
+        p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN();
+        p.intensity = std::numeric_limits<float>::infinity();
     }
+    for(size_t k = 0; k < change.values.size(); k++)
+        cloud[change.values[k].first].intensity = change.values[k].second;
+    for(size_t k = 0; k < change.added.size(); k++)
+        snapshot.octree->addPointToCloud(change.added[k], snapshot.cloud);
 }
 
 
-int MoveBase::projectPositionToNavigationFunction(const geometry_msgs::Point& pos)
+/**
+ * Bring a buffer the controller doesn't hold up to date with change (the
+ * latest in navfn_changes_), and return its snapshot for publishing.
+ *
+ * The controller holds at most the snapshot of its last tick (its path
+ * only remembers the version it was extracted from), so out of three
+ * buffers (the one published, the one the controller may still hold, and
+ * a spare) one is always free; it gets the changes it missed replayed
+ * from navfn_changes_. A buffer is only copied from the published one
+ * while there are fewer than three.
+ */
+boost::shared_ptr<NavigationFunctionSnapshot> MoveBase::updateNavigationFunctionBuffer(const NavigationFunctionChange& change)
 {
-    pcl::PointXYZI p;
-    p.x = pos.x;
-    p.y = pos.y;
-    p.z = pos.z;
-    std::vector<int> pointIdx;
-    std::vector<float> pointDistSq;
-    if(navfn_octree_ptr_->nearestKSearch(p, 1, pointIdx, pointDistSq) < 1)
+    navfn_version_++;
+    navfn_changes_.push_back(change);
+
+    // (the reference kept to free the previous snapshot on this thread is
+    // one of the buffers, which stay alive anyway)
+    navfn_retired_.reset();
+
+    int b = -1, front = 0;
+    for(size_t i = 0; i < navfn_buffers_.size(); i++)
     {
-        return -1;
+        if(navfn_buffers_[i].version > navfn_buffers_[front].version)
+            front = i;
+        // (no one else can get a reference to a snapshot that is no longer
+        // published, so a unique one stays so)
+        if(navfn_buffers_[i].snapshot.unique() && (b == -1 || navfn_buffers_[i].version > navfn_buffers_[b].version))
+            b = i;
     }
-    return pointIdx[0];
+    if(b == -1)
+    {
+        const NavigationFunctionSnapshot& s = *navfn_buffers_[front].snapshot;
+        boost::shared_ptr<NavigationFunctionSnapshot> copy(new NavigationFunctionSnapshot);
+        copy->cloud = pcl::PointCloud<pcl::PointXYZI>::Ptr(new pcl::PointCloud<pcl::PointXYZI>(*s.cloud));
+        copy->octree = makeNavigationFunctionIndex(copy->cloud);
+        if(navfn_buffers_.size() < 3)
+        {
+            b = navfn_buffers_.size();
+            navfn_buffers_.push_back(NavigationFunctionBuffer(copy, navfn_buffers_[front].version));
+        }
+        else
+        {
+            ROS_WARN("all navfn buffers in use; copying the navigation function");
+            b = front == 0 ? 1 : 0;
+            navfn_buffers_[b] = NavigationFunctionBuffer(copy, navfn_buffers_[front].version);
+        }
+    }
+
+    NavigationFunctionBuffer& buffer = navfn_buffers_[b];
+    for(size_t k = navfn_changes_.size() - (navfn_version_ - buffer.version); k < navfn_changes_.size(); k++)
+        applyNavigationFunctionChange(*buffer.snapshot, navfn_changes_[k]);
+    buffer.version = navfn_version_;
+
+    // forget the changes all the buffers have:
+    size_t oldest = navfn_version_;
+    for(size_t i = 0; i < navfn_buffers_.size(); i++)
+        oldest = std::min(oldest, navfn_buffers_[i].version);
+    while(navfn_changes_.size() > navfn_version_ - oldest)
+        navfn_changes_.pop_front();
+
+    return buffer.snapshot;
 }
 
 
-void MoveBase::getNavigationFunctionNeighborhood(const geometry_msgs::Point& pos, pcl::PointCloud<pcl::PointXYZI>& neighbors)
+/**
+ * Apply an incremental navigation function update.
+ *
+ * Deltas are applied in place to a snapshot the controller doesn't hold
+ * (see updateNavigationFunctionBuffer()), value changes, removals and
+ * additions alike, so their cost only depends on the size of the delta.
+ * Keyframes replace the whole state.
+ */
+void MoveBase::onNavigationFunctionDelta(const octomap_path_planner::NavigationFunctionDelta::ConstPtr& msg)
 {
-    pcl::PointXYZI robot_position;
+    ros::WallTime start = ros::WallTime::now();
+    if(msg->updated_keys.size() != 3 * msg->updated_values.size() || msg->removed_keys.size() % 3 != 0)
+    {
+        ROS_ERROR("malformed navfn delta (sequence %d)", msg->sequence);
+        return;
+    }
 
-    robot_position.x = pos.x;
-    robot_position.y = pos.y;
-    robot_position.z = pos.z;
+    if(!msg->keyframe)
+    {
+        if(!navfn_delta_synced_)
+            return;
 
-    std::vector<int> pointIdx;
-    std::vector<float> pointDistSq;
+        if(msg->sequence != navfn_delta_sequence_ + 1)
+        {
+            ROS_WARN("navfn delta sequence gap (%d -> %d); waiting for next keyframe", navfn_delta_sequence_, msg->sequence);
+            navfn_delta_synced_ = false;
+            return;
+        }
+    }
 
-    navfn_octree_ptr_->radiusSearch(robot_position, local_target_radius_, pointIdx, pointDistSq);
+    if(msg->keyframe)
+        navfn_delta_index_.clear();
 
-    neighbors.header.frame_id = navfn_.header.frame_id;
-    neighbors.header.stamp = navfn_.header.stamp;
-    for(std::vector<int>::iterator it = pointIdx.begin(); it != pointIdx.end(); ++it)
-        neighbors.push_back(navfn_[*it]);
-}
+    // (if this fails halfway, the index is rebuilt by the next keyframe)
+    NavigationFunctionChange change;
+    for(size_t i = 0; i < msg->removed_keys.size() / 3; i++)
+    {
+        boost::unordered_map<uint64_t, int>::iterator it = navfn_delta_index_.find(packNavigationFunctionKey(msg->removed_keys, i));
+        if(it == navfn_delta_index_.end()) continue;
+        change.removed.push_back(it->second);
+        navfn_delta_index_.erase(it);
+    }
 
+    pcl::PointCloud<pcl::PointXYZI> added;
+    added.header.frame_id = msg->header.frame_id;
+    std::vector<uint64_t> added_keys;
 
-bool MoveBase::projectGoalPositionToNavigationFunction()
-{
-    int goal_index = projectPositionToNavigationFunction(goal_.pose.position);
-    if(goal_index == -1)
+    for(size_t i = 0; i < msg->updated_values.size(); i++)
     {
-        ROS_ERROR("Failed to project goal position to navfn pcl");
-        return false;
+        uint64_t key = packNavigationFunctionKey(msg->updated_keys, i);
+        boost::unordered_map<uint64_t, int>::iterator it = navfn_delta_index_.find(key);
+        if(it != navfn_delta_index_.end())
+        {
+            change.values.push_back(std::make_pair(it->second, msg->updated_values[i]));
+        }
+        else
+        {
+            pcl::PointXYZI p;
+            p.x = navigationFunctionKeyToCoord(msg->updated_keys[3 * i], msg->resolution);
+            p.y = navigationFunctionKeyToCoord(msg->updated_keys[3 * i + 1], msg->resolution);
+            p.z = navigationFunctionKeyToCoord(msg->updated_keys[3 * i + 2], msg->resolution);
+            p.intensity = msg->updated_values[i];
+            added.push_back(p);
+            added_keys.push_back(key);
+        }
     }
-    if(dist(goal_.pose.position, navfn_[goal_index]) > robot_radius_)
+
+    if(added.size() > 0 && !pcl_ros::transformPointCloud(frame_id_, added, change.added, tf_listener_))
     {
-        ROS_ERROR("Failed to project goal position to navfn pcl (point is too far from ground)");
-        return false;
+        ROS_ERROR("Failed to transform navfn delta to frame '%s'; waiting for next keyframe", frame_id_.c_str());
+        navfn_delta_synced_ = false;
+        return;
     }
-    goal_.pose.position.x = navfn_[goal_index].x;
-    goal_.pose.position.y = navfn_[goal_index].y;
-    goal_.pose.position.z = navfn_[goal_index].z;
-    return true;
-}
 
+    // the indices of the new points follow those of the published cloud:
+    size_t size = 0;
+    for(size_t i = 0; i < navfn_buffers_.size() && !msg->keyframe; i++)
+        if(navfn_buffers_[i].version == navfn_version_)
+            size = navfn_buffers_[i].snapshot->cloud->size();
+    for(size_t i = 0; i < added_keys.size(); i++)
+        navfn_delta_index_[added_keys[i]] = size + i;
 
-bool MoveBase::getRobotPose()
-{
-    try
+    boost::shared_ptr<NavigationFunctionSnapshot> snapshot;
+    if(msg->keyframe)
     {
-        geometry_msgs::PoseStamped robot_pose_local;
-        robot_pose_local.header.frame_id = robot_frame_id_;
-        robot_pose_local.pose.position.x = 0.0;
-        robot_pose_local.pose.position.y = 0.0;
-        robot_pose_local.pose.position.z = 0.0;
-        robot_pose_local.pose.orientation.x = 0.0;
-        robot_pose_local.pose.orientation.y = 0.0;
-        robot_pose_local.pose.orientation.z = 0.0;
-        robot_pose_local.pose.orientation.w = 1.0;
-        tf_listener_.transformPose(frame_id_, robot_pose_local, robot_pose_);
-        return true;
+        snapshot.reset(new NavigationFunctionSnapshot);
+        snapshot->cloud = pcl::PointCloud<pcl::PointXYZI>::Ptr(new pcl::PointCloud<pcl::PointXYZI>);
+        snapshot->cloud->swap(change.added);
+        snapshot->octree = makeNavigationFunctionIndex(snapshot->cloud);
+        navfn_buffers_.assign(1, NavigationFunctionBuffer(snapshot, 0));
+        navfn_changes_.clear();
+        navfn_version_ = 0;
     }
-    catch(tf::TransformException& ex)
+    else
     {
-        ROS_ERROR("Failed to lookup robot position: %s", ex.what());
+        snapshot = updateNavigationFunctionBuffer(change);
     }
+    snapshot->cloud->header.frame_id = frame_id_;
+    snapshot->map_stamp = msg->header.stamp;
+    snapshot->resolution = msg->resolution;
+    snapshot->unreachable = std::numeric_limits<float>::infinity();
+
+    navfn_delta_sequence_ = msg->sequence;
+    navfn_delta_synced_ = true;
+
+    ROS_DEBUG("applied navfn %s %d: %ld updated (%ld new), %ld removed",
+            msg->keyframe ? "keyframe" : "delta", msg->sequence,
+            msg->updated_values.size(), added.size(), msg->removed_keys.size() / 3);
+
+    publishNavigationFunction(snapshot);
+    tracer_.add("move_base/navfn delta", start, ros::WallTime::now(), snapshot->map_stamp);
+    tracer_.flush();
 }
 
 
-double MoveBase::positionError()
+bool MoveBase::updateNavigationFunction()
 {
-    return sqrt(
-            pow(robot_pose_.pose.position.x - goal_.pose.position.x, 2) +
-            pow(robot_pose_.pose.position.y - goal_.pose.position.y, 2) +
-            pow(robot_pose_.pose.position.z - goal_.pose.position.z, 2)
-    );
+    controller_.setNavigationFunction(boost::atomic_load(&navfn_latest_));
+    return controller_.navigationFunction().get() != 0;
 }
 
 
-double MoveBase::orientationError()
+void MoveBase::startController()
 {
-    // check if goal is only by position:
-    double qnorm = pow(goal_.pose.orientation.w, 2) +
-            pow(goal_.pose.orientation.x, 2) +
-            pow(goal_.pose.orientation.y, 2) +
-            pow(goal_.pose.orientation.z, 2);
-
-    // if so, we never have an orientation error:
-    if(qnorm < 1e-5) return 0;
-
-    // "Robotica - Modellistica Pianificazione e Controllo" eq. 3.88
-    double nd = goal_.pose.orientation.w,
-            ne = robot_pose_.pose.orientation.w;
-    Eigen::Vector3d ed(goal_.pose.orientation.x, goal_.pose.orientation.y, goal_.pose.orientation.z),
-            ee(robot_pose_.pose.orientation.x, robot_pose_.pose.orientation.y, robot_pose_.pose.orientation.z);
-    Eigen::Vector3d eo = ne * ed - nd * ee - ed.cross(ee);
-    return eo(2);
+    controller_timer_ = controller_nh_.createTimer(ros::Duration(1.0 / controller_frequency_), &MoveBase::controllerCallback, this);
 }
 
 
-bool MoveBase::generateLocalTarget(geometry_msgs::PointStamped& p_local)
+void MoveBase::onGoal(const geometry_msgs::PointStamped::ConstPtr& msg)
 {
-    // get navigation function neighborhood centered at robot pos:
-    pcl::PointCloud<pcl::PointXYZI> neighbors, neighbors_local;
-    getNavigationFunctionNeighborhood(robot_pose_.pose.position, neighbors);
+    try
+    {
+        geometry_msgs::PointStamped msg2;
+        geometry_msgs::PoseStamped goal;
+        tf_listener_.transformPoint(frame_id_, *msg, msg2);
+        goal.header.stamp = msg2.header.stamp;
+        goal.header.frame_id = msg2.header.frame_id;
+        goal.pose.position.x = msg2.point.x;
+        goal.pose.position.y = msg2.point.y;
+        goal.pose.position.z = msg2.point.z;
+        goal.pose.orientation.x = 0.0;
+        goal.pose.orientation.y = 0.0;
+        goal.pose.orientation.z = 0.0;
+        goal.pose.orientation.w = 0.0;
+
+        updateNavigationFunction();
+        if(controller_.setGoal(goal))
+        {
+            goal = controller_.goal();
+            ROS_INFO("goal set to point (%f, %f, %f)",
+                goal.pose.position.x, goal.pose.position.y, goal.pose.position.z);
 
-    if(!pcl_ros::transformPointCloud(robot_frame_id_, neighbors, neighbors_local, tf_listener_))
+            startController();
+        }
+    }
+    catch(tf::TransformException& ex)
     {
-        ROS_ERROR("Failed to transform robot neighborhood");
-        return false;
+        ROS_ERROR("Failed to lookup robot position: %s", ex.what());
     }
+}
 
-    // find minimum distance point in neighborhood:
-    int min_index = -1, min_index_straight = -1;
-    float min_value = std::numeric_limits<float>::infinity();
 
-    for(size_t i = 0; i < neighbors_local.size(); i++)
+void MoveBase::onGoal(const geometry_msgs::PoseStamped::ConstPtr& msg)
+{
+    try
     {
-        pcl::PointXYZI& p = neighbors_local[i];
+        geometry_msgs::PoseStamped goal;
+        tf_listener_.transformPose(frame_id_, *msg, goal);
 
-        if(p.intensity < min_value)
+        updateNavigationFunction();
+        if(controller_.setGoal(goal))
         {
-            min_value = p.intensity;
-            min_index = i;
-        }
-    }
+            goal = controller_.goal();
+            ROS_INFO("goal set to pose (%f, %f, %f), (%f, %f, %f, %f)",
+                    goal.pose.position.x, goal.pose.position.y, goal.pose.position.z,
+                    goal.pose.orientation.x, goal.pose.orientation.y, goal.pose.orientation.z,
+                    goal.pose.orientation.w);
 
-    if(min_index == -1)
-    {
-        ROS_ERROR("Failed to find a target in robot vicinity");
-        return false;
+            startController();
+        }
     }
-
-    // check if we are actually improving the value in the navigation function
-    int rob_index = projectPositionToNavigationFunction(robot_pose_.pose.position);
-    double delta = navfn_[rob_index].intensity - min_value;
-    if(delta < 1e-6)
+    catch(tf::TransformException& ex)
     {
-        ROS_ERROR("Failed to generate a target: gradient is null");
-        return false;
+        ROS_ERROR("Failed to lookup robot position: %s", ex.what());
     }
-
-    p_local.header.stamp = ros::Time::now();
-    p_local.header.frame_id = neighbors_local.header.frame_id;
-    p_local.point.x = neighbors_local[min_index].x;
-    p_local.point.y = neighbors_local[min_index].y;
-    p_local.point.z = neighbors_local[min_index].z;
-
-    target_pub_.publish(p_local);
-
-    return true;
 }
 
 
-void MoveBase::generateTwistCommand(const geometry_msgs::PointStamped& local_target, geometry_msgs::Twist& twist)
+bool MoveBase::getRobotPose()
 {
-    if(local_target.header.frame_id != robot_frame_id_)
-    {
-        ROS_ERROR("generateTwistCommand: local_target must be in frame '%s'", robot_frame_id_.c_str());
-        return;
-    }
-
-    twist.linear.x = 0.0;
-    twist.linear.y = 0.0;
-    twist.linear.z = 0.0;
-    twist.angular.x = 0.0;
-    twist.angular.y = 0.0;
-    twist.angular.z = 0.0;
-
-    const geometry_msgs::Point& p = local_target.point;
-
-    if(p.x < 0 || fabs(p.y) > p.x)
+    try
     {
-        // turn in place
-        twist.angular.z = (p.y > 0 ? 1 : -1) * twist_angular_gain_;
+        geometry_msgs::PoseStamped robot_pose_local;
+        robot_pose_local.header.frame_id = robot_frame_id_;
+        robot_pose_local.pose.position.x = 0.0;
+        robot_pose_local.pose.position.y = 0.0;
+        robot_pose_local.pose.position.z = 0.0;
+        robot_pose_local.pose.orientation.x = 0.0;
+        robot_pose_local.pose.orientation.y = 0.0;
+        robot_pose_local.pose.orientation.z = 0.0;
+        robot_pose_local.pose.orientation.w = 1.0;
+        tf_listener_.transformPose(frame_id_, robot_pose_local, robot_pose_);
+        return true;
     }
-    else
+    catch(tf::TransformException& ex)
     {
-        // make arc
-        double center_y = (pow(p.x, 2) + pow(p.y, 2)) / (2 * p.y);
-        double theta = fabs(atan2(p.x, fabs(center_y) - fabs(p.y)));
-        double arc_length = fabs(center_y * theta);
-
-        twist.linear.x = twist_linear_gain_ * arc_length;
-        twist.angular.z = twist_angular_gain_ * (p.y >= 0 ? 1 : -1) * theta;
+        ROS_ERROR("Failed to lookup robot position: %s", ex.what());
+        return false;
     }
 }
 
 
 void MoveBase::controllerCallback(const ros::TimerEvent& event)
 {
-    if(controller_repeated_failures_ >= 5)
+    ScopedLatency tick_latency(tick_total_hist_);
+    ros::WallTime start = ros::WallTime::now();
+
+    // scheduling jitter w.r.t. the nominal controller_frequency_ period:
+    if(!event.last_expected.isZero())
+        tick_jitter_hist_.add(fabs((event.current_real - event.current_expected).toSec()));
+
+    if(controller_.hasGivenUp())
     {
         ROS_ERROR("controller keeps failing. giving up :-(");
         controller_timer_.stop();
         return;
     }
 
-    if(!getRobotPose())
+    if(!updateNavigationFunction())
     {
-        controller_repeated_failures_++;
+        controller_.reportFailure();
+        ROS_ERROR("controllerCallback: no navigation function received yet");
+        return;
+    }
+
+    ros::WallTime tf_start = ros::WallTime::now();
+    bool got_robot_pose = getRobotPose();
+    tf_wait_hist_.add((ros::WallTime::now() - tf_start).toSec());
+    if(!got_robot_pose)
+    {
+        controller_.reportFailure();
         ROS_ERROR("controllerCallback: failed to get robot pose");
         return;
     }
+    controller_.setRobotPose(robot_pose_);
 
     geometry_msgs::Twist twist;
-    twist.linear.x = 0.0;
-    twist.linear.y = 0.0;
-    twist.linear.z = 0.0;
-    twist.angular.x = 0.0;
-    twist.angular.y = 0.0;
-    twist.angular.z = 0.0;
+    MoveBaseController::Status status = controller_.update(twist);
+
+    if(controller_.pathRevision() != published_path_revision_)
+    {
+        path_pub_.publish(controller_.path());
+        published_path_revision_ = controller_.pathRevision();
+    }
+
+    if(status == MoveBaseController::FAILED || status == MoveBaseController::GAVE_UP)
+        return;
 
     std_msgs::Float32 ep, eo;
 
-    ep.data = positionError();
+    ep.data = controller_.positionError();
     position_error_pub_.publish(ep);
 
-    eo.data = orientationError();
+    eo.data = controller_.orientationError();
     orientation_error_pub_.publish(eo);
 
-    const char *status_str;
-
-    if((!reached_position_ && ep.data > goal_reached_threshold_)
-        || (reached_position_ && ep.data > 2 * goal_reached_threshold_))
+    if(status == MoveBaseController::REGULATING_POSITION)
+    {
+        local_target_hist_.add(controller_.localTargetDuration());
+        target_pub_.publish(controller_.localTarget());
+    }
+    else if(status == MoveBaseController::REACHED_GOAL)
     {
-        // regulate position
+        ROS_INFO("goal reached! stopping controller timer");
 
-        status_str = "REGULATING POSITION";
+        controller_timer_.stop();
+    }
 
-        reached_position_ = false;
+    const char *status_str = MoveBaseController::statusString(status);
 
-        geometry_msgs::PointStamped local_target;
+    // logging every tick is expensive at high rates; only report status changes:
+    if(strcmp(status_str, last_status_str_) != 0)
+        ROS_INFO("controller: ep=%f, eo=%f, status=%s", ep.data, eo.data, status_str);
+    else
+        ROS_DEBUG("controller: ep=%f, eo=%f, status=%s", ep.data, eo.data, status_str);
+    last_status_str_ = status_str;
 
-        if(!generateLocalTarget(local_target))
-        {
-            controller_repeated_failures_++;
-            ROS_ERROR("controllerCallback: failed to generate a local target to follow");
-            return;
-        }
+    twist_pub_.publish(twist);
 
-        generateTwistCommand(local_target, twist);
-    }
-    else
+    // end-to-end latency: the first twist computed from each map
+    const ros::Time map_stamp = controller_.navigationFunction()->map_stamp;
+    if(!map_stamp.isZero() && map_stamp != last_twist_map_stamp_)
     {
-        reached_position_ = true;
+        map_to_twist_hist_.add((ros::Time::now() - map_stamp).toSec());
+        last_twist_map_stamp_ = map_stamp;
+        tracer_.add("move_base/twist", start, ros::WallTime::now(), map_stamp, controller_.goal().header.stamp);
+        tracer_.flush();
+    }
+}
 
-        if(fabs(eo.data) > 0.02)
-        {
-            // regulate orientation
 
-            status_str = "REGULATING ORIENTATION";
+/**
+ * Publish the controller loop timing of the last diagnostics_period, and
+ * start a new period (the histograms are reset, so that one slow tick
+ * doesn't keep the status at WARN).
+ */
+void MoveBase::diagnosticsCallback(const ros::TimerEvent& event)
+{
+    if(diagnostics_pub_.getNumSubscribers() > 0)
+        publishDiagnostics();
+
+    // (this runs on the controller queue, like the ticks filling them)
+    tick_jitter_hist_.reset();
+    tf_wait_hist_.reset();
+    local_target_hist_.reset();
+    tick_total_hist_.reset();
+    map_to_twist_hist_.reset();
+}
+
 
-            twist.angular.z = twist_angular_gain_ * eo.data;
-        }
-        else
-        {
-            // goal reached
+void MoveBase::publishDiagnostics()
+{
 
-            status_str = "REACHED GOAL";
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
 
-            ROS_INFO("goal reached! stopping controller timer");
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = ros::this_node::getName() + ": controller loop timing";
+    status.hardware_id = robot_frame_id_;
 
-            controller_timer_.stop();
-        }
+    // the tick budget is one controller period:
+    double budget = 1.0 / controller_frequency_;
+    if(tick_total_hist_.max() + tick_jitter_hist_.max() > budget)
+    {
+        status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+        status.message = "controller tick exceeded its period";
+    }
+    else
+    {
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.message = "controller tick within budget";
     }
 
-    ROS_INFO("controller: ep=%f, eo=%f, status=%s", ep.data, eo.data, status_str);
-
-    twist_pub_.publish(twist);
+    tick_jitter_hist_.toDiagnostics("tick jitter", status);
+    tf_wait_hist_.toDiagnostics("tf wait", status);
+    local_target_hist_.toDiagnostics("local target", status);
+    tick_total_hist_.toDiagnostics("tick total", status);
+    map_to_twist_hist_.toDiagnostics("map to twist", status);
 
-    controller_repeated_failures_ = 0;
+    msg.status.push_back(status);
+    diagnostics_pub_.publish(msg);
 }
 
 
@@ -0,0 +1,537 @@
+#include <iostream>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <queue>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <algorithm>
+
+#include <boost/thread.hpp>
+#include <boost/random.hpp>
+#include <boost/random/uniform_real.hpp>
+#include <boost/random/uniform_int.hpp>
+
+#include <ros/ros.h>
+#include <ros/console.h>
+#include <tf/transform_datatypes.h>
+
+#include <pcl/io/pcd_io.h>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+#include <octomap_path_planner/latency_histogram.h>
+#include <octomap_path_planner/move_base_controller.h>
+
+
+/**
+ * Offline closed-loop benchmark of the move_base controller.
+ *
+ * Runs many goal episodes of MoveBaseController against a unicycle
+ * kinematic model instead of TF, faster than real time and in parallel,
+ * on either a recorded navigation function (a PCD file of
+ * ground_cloud_out) or on synthetic worlds, and reports time-to-goal,
+ * failures and per-tick compute cost. The exit status is non-zero if the
+ * configured failure rate or tick time budget is exceeded, so it can be
+ * used as a regression gate.
+ */
+struct SimulatorOptions
+{
+    std::string navfn_file;
+    int episodes;
+    int threads;
+    unsigned int seed;
+    double controller_frequency;
+    int integration_substeps;
+    double max_episode_time;
+    double collision_distance;
+    double world_size;
+    double world_resolution;
+    int world_obstacles;
+    double max_failure_rate;
+    double max_tick_p95;
+    bool verbose;
+    MoveBaseControllerParams controller;
+
+    SimulatorOptions()
+        : episodes(1000),
+          threads(boost::thread::hardware_concurrency()),
+          seed(0),
+          controller_frequency(2.0),
+          integration_substeps(10),
+          max_episode_time(300.0),
+          collision_distance(0.1),
+          world_size(10.0),
+          world_resolution(0.05),
+          world_obstacles(8),
+          max_failure_rate(1.0),
+          max_tick_p95(std::numeric_limits<double>::infinity()),
+          verbose(false)
+    {
+        controller.frame_id = "map";
+        controller.robot_frame_id = "base_link";
+    }
+};
+
+
+struct SimulatorResults
+{
+    int episodes;
+    int reached;
+    int gave_up;
+    int timed_out;
+    int collided;
+    int invalid;
+    double simulated_time;
+    std::vector<double> time_to_goal;
+    LatencyHistogram tick_hist;
+
+    SimulatorResults()
+        : episodes(0), reached(0), gave_up(0), timed_out(0), collided(0), invalid(0), simulated_time(0.0)
+    {
+    }
+
+    void merge(const SimulatorResults& other)
+    {
+        episodes += other.episodes;
+        reached += other.reached;
+        gave_up += other.gave_up;
+        timed_out += other.timed_out;
+        collided += other.collided;
+        invalid += other.invalid;
+        simulated_time += other.simulated_time;
+        time_to_goal.insert(time_to_goal.end(), other.time_to_goal.begin(), other.time_to_goal.end());
+        tick_hist.merge(other.tick_hist);
+    }
+};
+
+
+typedef boost::mt19937 RandomGenerator;
+
+
+static double uniform(RandomGenerator& rng, double a, double b)
+{
+    boost::uniform_real<double> dist(a, b);
+    return dist(rng);
+}
+
+
+static NavigationFunctionSnapshotConstPtr makeSnapshot(const pcl::PointCloud<pcl::PointXYZI>::Ptr& cloud, double resolution = 0.0)
+{
+    boost::shared_ptr<NavigationFunctionSnapshot> snapshot(new NavigationFunctionSnapshot);
+    snapshot->cloud = cloud;
+    snapshot->octree = pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr(new pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>(0.01));
+    snapshot->octree->setInputCloud(cloud);
+    snapshot->octree->addPointsFromInputCloud();
+    snapshot->resolution = resolution > 0.0 ? resolution : estimateVoxelSize(*snapshot);
+    return snapshot;
+}
+
+
+/**
+ * Normalize distances like navigation_function_node does: reachable values
+ * are mapped to [0, 1), unreachable ones to 1.
+ */
+static void normalizeIntensity(pcl::PointCloud<pcl::PointXYZI>& cloud)
+{
+    float imin = std::numeric_limits<float>::infinity();
+    float imax = -std::numeric_limits<float>::infinity();
+    for(pcl::PointCloud<pcl::PointXYZI>::iterator it = cloud.begin(); it != cloud.end(); ++it)
+    {
+        if(!std::isfinite(it->intensity)) continue;
+        imin = fmin(imin, it->intensity);
+        imax = fmax(imax, it->intensity);
+    }
+    const float eps = 0.01;
+    float d = imax - imin + eps;
+    for(pcl::PointCloud<pcl::PointXYZI>::iterator it = cloud.begin(); it != cloud.end(); ++it)
+    {
+        if(std::isfinite(it->intensity))
+            it->intensity = (it->intensity - imin) / d;
+        else
+            it->intensity = 1.0;
+    }
+}
+
+
+/**
+ * Build a flat square world with random box obstacles, pick a random goal
+ * on it and compute the navigation function (8-connected Dijkstra) to it.
+ *
+ * Ground within robot_radius of an obstacle is removed, as done by
+ * navigation_function_node.
+ */
+static NavigationFunctionSnapshotConstPtr makeSyntheticNavigationFunction(const SimulatorOptions& opts, RandomGenerator& rng, geometry_msgs::Point& goal)
+{
+    const double res = opts.world_resolution;
+    const int n = (int)ceil(opts.world_size / res);
+    std::vector<char> free_cell(n * n, 1);
+
+    for(int o = 0; o < opts.world_obstacles; o++)
+    {
+        double cx = uniform(rng, 0, opts.world_size), cy = uniform(rng, 0, opts.world_size);
+        double hx = uniform(rng, 0.15, 0.75) + opts.controller.robot_radius;
+        double hy = uniform(rng, 0.15, 0.75) + opts.controller.robot_radius;
+        for(int iy = std::max(0, (int)((cy - hy) / res)); iy < std::min(n, (int)((cy + hy) / res) + 1); iy++)
+            for(int ix = std::max(0, (int)((cx - hx) / res)); ix < std::min(n, (int)((cx + hx) / res) + 1); ix++)
+                free_cell[iy * n + ix] = 0;
+    }
+
+    std::vector<int> free_cells;
+    for(int i = 0; i < n * n; i++)
+        if(free_cell[i]) free_cells.push_back(i);
+    if(free_cells.empty())
+        return NavigationFunctionSnapshotConstPtr();
+
+    boost::uniform_int<int> pick(0, free_cells.size() - 1);
+    int goal_cell = free_cells[pick(rng)];
+
+    std::vector<float> d(n * n, std::numeric_limits<float>::infinity());
+    typedef std::pair<float, int> QueueItem;
+    std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem> > q;
+    d[goal_cell] = 0.0;
+    q.push(QueueItem(0.0, goal_cell));
+    while(!q.empty())
+    {
+        QueueItem item = q.top();
+        q.pop();
+        int c = item.second;
+        if(item.first > d[c]) continue;
+        int cx = c % n, cy = c / n;
+        for(int dy = -1; dy <= 1; dy++)
+        {
+            for(int dx = -1; dx <= 1; dx++)
+            {
+                int nx = cx + dx, ny = cy + dy;
+                if((!dx && !dy) || nx < 0 || ny < 0 || nx >= n || ny >= n) continue;
+                int nc = ny * n + nx;
+                if(!free_cell[nc]) continue;
+                float nd = d[c] + res * ((dx && dy) ? M_SQRT2 : 1.0);
+                if(nd < d[nc])
+                {
+                    d[nc] = nd;
+                    q.push(QueueItem(nd, nc));
+                }
+            }
+        }
+    }
+
+    pcl::PointCloud<pcl::PointXYZI>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZI>);
+    cloud->header.frame_id = opts.controller.frame_id;
+    cloud->reserve(free_cells.size());
+    for(std::vector<int>::iterator it = free_cells.begin(); it != free_cells.end(); ++it)
+    {
+        pcl::PointXYZI p;
+        p.x = (*it % n + 0.5) * res;
+        p.y = (*it / n + 0.5) * res;
+        p.z = 0.0;
+        p.intensity = d[*it];
+        cloud->push_back(p);
+    }
+    cloud->width = cloud->size();
+    cloud->height = 1;
+    normalizeIntensity(*cloud);
+
+    goal.x = (goal_cell % n + 0.5) * res;
+    goal.y = (goal_cell / n + 0.5) * res;
+    goal.z = 0.0;
+
+    return makeSnapshot(cloud, res);
+}
+
+
+/**
+ * The goal of a recorded navigation function is its minimum.
+ */
+static bool findGoal(const NavigationFunctionSnapshot& navfn, geometry_msgs::Point& goal)
+{
+    const pcl::PointCloud<pcl::PointXYZI>& cloud = *navfn.cloud;
+    int goal_index = -1;
+    for(size_t i = 0; i < cloud.size(); i++)
+        if(goal_index == -1 || cloud[i].intensity < cloud[goal_index].intensity)
+            goal_index = i;
+    if(goal_index == -1) return false;
+    goal.x = cloud[goal_index].x;
+    goal.y = cloud[goal_index].y;
+    goal.z = cloud[goal_index].z;
+    return true;
+}
+
+
+/**
+ * Pick a random reachable start position, not already at the goal.
+ */
+static bool pickStart(const SimulatorOptions& opts, const NavigationFunctionSnapshot& navfn, const geometry_msgs::Point& goal, RandomGenerator& rng, geometry_msgs::Point& start)
+{
+    const pcl::PointCloud<pcl::PointXYZI>& cloud = *navfn.cloud;
+    boost::uniform_int<int> pick(0, cloud.size() - 1);
+    for(int attempt = 0; attempt < 1000; attempt++)
+    {
+        const pcl::PointXYZI& p = cloud[pick(rng)];
+        if(p.intensity >= 1.0 || dist(p, goal) < 2 * opts.controller.goal_reached_threshold) continue;
+        start.x = p.x;
+        start.y = p.y;
+        start.z = p.z;
+        return true;
+    }
+    return false;
+}
+
+
+static bool isOnGround(const SimulatorOptions& opts, const NavigationFunctionSnapshot& navfn, const geometry_msgs::Point& pos)
+{
+    pcl::PointXYZI p;
+    p.x = pos.x;
+    p.y = pos.y;
+    p.z = pos.z;
+    std::vector<int> pointIdx;
+    std::vector<float> pointDistSq;
+    if(navfn.octree->nearestKSearch(p, 1, pointIdx, pointDistSq) < 1) return false;
+    return pointDistSq[0] <= opts.collision_distance * opts.collision_distance;
+}
+
+
+static void runEpisode(const SimulatorOptions& opts, const NavigationFunctionSnapshotConstPtr& recorded_navfn, unsigned int episode, SimulatorResults& results)
+{
+    RandomGenerator rng(opts.seed + episode);
+
+    results.episodes++;
+
+    geometry_msgs::Point goal_position, start;
+    NavigationFunctionSnapshotConstPtr navfn = recorded_navfn;
+    if(navfn)
+        findGoal(*navfn, goal_position);
+    else
+        navfn = makeSyntheticNavigationFunction(opts, rng, goal_position);
+
+    if(!navfn || !pickStart(opts, *navfn, goal_position, rng, start))
+    {
+        results.invalid++;
+        return;
+    }
+
+    MoveBaseController controller(opts.controller);
+    controller.setNavigationFunction(navfn);
+
+    geometry_msgs::PoseStamped goal;
+    goal.header.frame_id = opts.controller.frame_id;
+    goal.pose.position = goal_position;
+    goal.pose.orientation.w = 0.0;
+    if(!controller.setGoal(goal))
+    {
+        results.invalid++;
+        return;
+    }
+
+    // unicycle state:
+    double x = start.x, y = start.y, yaw = uniform(rng, -M_PI, M_PI);
+    const double dt = 1.0 / opts.controller_frequency;
+    double t = 0.0;
+
+    geometry_msgs::PoseStamped robot_pose;
+    robot_pose.header.frame_id = opts.controller.frame_id;
+
+    while(true)
+    {
+        robot_pose.header.stamp = ros::Time(t);
+        robot_pose.pose.position.x = x;
+        robot_pose.pose.position.y = y;
+        robot_pose.pose.position.z = start.z;
+        robot_pose.pose.orientation = tf::createQuaternionMsgFromYaw(yaw);
+
+        if(!isOnGround(opts, *navfn, robot_pose.pose.position))
+        {
+            results.collided++;
+            break;
+        }
+
+        controller.setRobotPose(robot_pose);
+
+        geometry_msgs::Twist twist;
+        ros::WallTime tick_start = ros::WallTime::now();
+        MoveBaseController::Status status = controller.update(twist);
+        results.tick_hist.add((ros::WallTime::now() - tick_start).toSec());
+
+        if(status == MoveBaseController::REACHED_GOAL)
+        {
+            results.reached++;
+            results.time_to_goal.push_back(t);
+            break;
+        }
+        if(status == MoveBaseController::GAVE_UP)
+        {
+            results.gave_up++;
+            break;
+        }
+        if(t >= opts.max_episode_time)
+        {
+            results.timed_out++;
+            break;
+        }
+
+        // integrate the unicycle model over one control period:
+        const double h = dt / opts.integration_substeps;
+        for(int k = 0; k < opts.integration_substeps; k++)
+        {
+            x += twist.linear.x * cos(yaw) * h;
+            y += twist.linear.x * sin(yaw) * h;
+            yaw += twist.angular.z * h;
+        }
+        t += dt;
+    }
+
+    results.simulated_time += t;
+}
+
+
+static void worker(const SimulatorOptions& opts, const NavigationFunctionSnapshotConstPtr& navfn, int thread_index, SimulatorResults& results)
+{
+    // episodes are statically interleaved between threads and seeded by
+    // their index, so results don't depend on the number of threads:
+    for(int episode = thread_index; episode < opts.episodes; episode += opts.threads)
+        runEpisode(opts, navfn, episode, results);
+}
+
+
+static double percentile(std::vector<double>& v, double p)
+{
+    if(v.empty()) return 0.0;
+    size_t k = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0 << " [options]" << std::endl
+        << "  --navfn FILE.pcd              recorded navigation function (default: synthetic worlds)" << std::endl
+        << "  --episodes N                  number of goal episodes (default: 1000)" << std::endl
+        << "  --threads N                   worker threads (default: number of cores)" << std::endl
+        << "  --seed N                      random seed (default: 0)" << std::endl
+        << "  --controller-frequency HZ     (default: 2.0)" << std::endl
+        << "  --max-episode-time S          simulated time limit per episode (default: 300)" << std::endl
+        << "  --local-planner NAME          path, greedy or rollout (default: path)" << std::endl
+        << "  --robot-radius M              (default: 0.2)" << std::endl
+        << "  --goal-reached-threshold M    (default: 0.5)" << std::endl
+        << "  --local-target-radius M       (default: 0.4)" << std::endl
+        << "  --world-size M                synthetic world side length (default: 10)" << std::endl
+        << "  --world-obstacles N           synthetic obstacles per world (default: 8)" << std::endl
+        << "  --max-failure-rate R          fail if more than this fraction of episodes fail (default: 1)" << std::endl
+        << "  --max-tick-p95 MS             fail if the p95 controller tick exceeds this (default: inf)" << std::endl
+        << "  --verbose                     show controller log output" << std::endl;
+}
+
+
+static bool parseOptions(int argc, char **argv, SimulatorOptions& opts)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        if(arg == "--verbose")
+        {
+            opts.verbose = true;
+            continue;
+        }
+        if(i + 1 >= argc)
+            return false;
+        const char *value = argv[++i];
+        if(arg == "--navfn") opts.navfn_file = value;
+        else if(arg == "--episodes") opts.episodes = atoi(value);
+        else if(arg == "--threads") opts.threads = atoi(value);
+        else if(arg == "--seed") opts.seed = atoi(value);
+        else if(arg == "--controller-frequency") opts.controller_frequency = atof(value);
+        else if(arg == "--max-episode-time") opts.max_episode_time = atof(value);
+        else if(arg == "--local-planner") opts.controller.local_planner = value;
+        else if(arg == "--robot-radius") opts.controller.robot_radius = atof(value);
+        else if(arg == "--goal-reached-threshold") opts.controller.goal_reached_threshold = atof(value);
+        else if(arg == "--local-target-radius") opts.controller.local_target_radius = atof(value);
+        else if(arg == "--world-size") opts.world_size = atof(value);
+        else if(arg == "--world-obstacles") opts.world_obstacles = atoi(value);
+        else if(arg == "--max-failure-rate") opts.max_failure_rate = atof(value);
+        else if(arg == "--max-tick-p95") opts.max_tick_p95 = atof(value) * 1e-3;
+        else return false;
+    }
+    opts.threads = std::max(1, opts.threads);
+    return opts.episodes > 0 && opts.controller_frequency > 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    SimulatorOptions opts;
+    if(!parseOptions(argc, argv, opts))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // no ROS master is needed: time stamps use the wall clock
+    ros::Time::init();
+
+    if(!opts.verbose && ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Fatal))
+        ros::console::notifyLoggerLevelsChanged();
+
+    NavigationFunctionSnapshotConstPtr navfn;
+    if(!opts.navfn_file.empty())
+    {
+        pcl::PointCloud<pcl::PointXYZI>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZI>);
+        if(pcl::io::loadPCDFile<pcl::PointXYZI>(opts.navfn_file, *cloud) < 0 || cloud->empty())
+        {
+            std::cerr << "failed to load navigation function from " << opts.navfn_file << std::endl;
+            return 2;
+        }
+        navfn = makeSnapshot(cloud);
+    }
+
+    std::vector<SimulatorResults> thread_results(opts.threads);
+    ros::WallTime start = ros::WallTime::now();
+    boost::thread_group threads;
+    for(int i = 0; i < opts.threads; i++)
+        threads.create_thread(boost::bind(&worker, boost::cref(opts), boost::cref(navfn), i, boost::ref(thread_results[i])));
+    threads.join_all();
+    double wall_time = (ros::WallTime::now() - start).toSec();
+
+    SimulatorResults results;
+    for(int i = 0; i < opts.threads; i++)
+        results.merge(thread_results[i]);
+
+    int failed = results.gave_up + results.timed_out + results.collided;
+    int valid = results.episodes - results.invalid;
+    double failure_rate = valid > 0 ? (double)failed / valid : 0.0;
+    double mean_ttg = 0.0;
+    for(size_t i = 0; i < results.time_to_goal.size(); i++)
+        mean_ttg += results.time_to_goal[i] / results.time_to_goal.size();
+
+    printf("episodes:            %d (%d invalid)\n", results.episodes, results.invalid);
+    printf("reached goal:        %d\n", results.reached);
+    printf("gave up:             %d\n", results.gave_up);
+    printf("timed out:           %d\n", results.timed_out);
+    printf("left the ground:     %d\n", results.collided);
+    printf("failure rate:        %.4f\n", failure_rate);
+    printf("time to goal [s]:    mean %.2f, p50 %.2f, p95 %.2f\n", mean_ttg,
+            percentile(results.time_to_goal, 0.50), percentile(results.time_to_goal, 0.95));
+    printf("controller ticks:    %lu\n", (unsigned long)results.tick_hist.count());
+    printf("tick compute [ms]:   mean %.3f, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n",
+            results.tick_hist.mean() * 1e3, results.tick_hist.percentile(0.50) * 1e3,
+            results.tick_hist.percentile(0.95) * 1e3, results.tick_hist.percentile(0.99) * 1e3,
+            results.tick_hist.max() * 1e3);
+    printf("wall time [s]:       %.2f (%d threads, %.0fx real time)\n", wall_time, opts.threads,
+            wall_time > 0 ? results.simulated_time / wall_time : 0.0);
+
+    bool pass = true;
+    if(failure_rate > opts.max_failure_rate)
+    {
+        printf("FAIL: failure rate %.4f exceeds %.4f\n", failure_rate, opts.max_failure_rate);
+        pass = false;
+    }
+    if(results.tick_hist.percentile(0.95) > opts.max_tick_p95)
+    {
+        printf("FAIL: p95 tick time %.3f ms exceeds %.3f ms\n", results.tick_hist.percentile(0.95) * 1e3, opts.max_tick_p95 * 1e3);
+        pass = false;
+    }
+
+    return pass ? 0 : 1;
+}
@@ -3,12 +3,19 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <map>
 #include <cstdlib>
 #include <cassert>
 #include <limits>
 
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/chrono.hpp>
 #include <boost/random.hpp>
 #include <boost/random/uniform_real.hpp>
@@ -16,6 +23,7 @@
 
 #include <ros/ros.h>
 #include <std_msgs/Float32.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <geometry_msgs/Point.h>
 #include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/PoseStamped.h>
@@ -23,6 +31,7 @@
 #include <tf/transform_listener.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <nav_msgs/Path.h>
+#include <visualization_msgs/MarkerArray.h>
 
 #include <octomap/octomap.h>
 #include <octomap_ros/conversions.h>
@@ -43,6 +52,24 @@
 
 #include <pcl_conversions/pcl_conversions.h>
 
+#ifdef OCTOMAP_PATH_PLANNER_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
+#include <octomap_path_planner/NavigationFunctionDelta.h>
+#include <octomap_path_planner/ComputeNavigationFunction.h>
+#include <octomap_path_planner/octomap_store.h>
+#include <octomap_path_planner/incremental_octomap.h>
+#include <octomap_path_planner/stage_timing.h>
+#include <octomap_path_planner/tracer.h>
+#include <octomap_path_planner/morton_voxel_set.h>
+#include <octomap_path_planner/neighborhood.h>
+#include <octomap_path_planner/surface_map.h>
+#include <octomap_path_planner/worker_pool.h>
+#include <octomap_path_planner/parallel_relaxation.h>
+#include <octomap_path_planner/incremental_relaxation.h>
+
 namespace pcl
 {
     template<typename PointA, typename PointB>
@@ -61,6 +88,725 @@ namespace pcl
     }
 }
 
+/**
+ * Predicate for keys in the columns [min, max] (only x and y are used).
+ */
+struct InColumns
+{
+    octomap::OcTreeKey min;
+    octomap::OcTreeKey max;
+
+    InColumns(const octomap::OcTreeKey& min_, const octomap::OcTreeKey& max_) : min(min_), max(max_) {}
+
+    bool operator()(const octomap::OcTreeKey& k) const
+    {
+        return k[0] >= min[0] && k[0] <= max[0] && k[1] >= min[1] && k[1] <= max[1];
+    }
+};
+
+
+/**
+ * Predicate for all keys.
+ */
+struct AllColumns
+{
+    bool operator()(const octomap::OcTreeKey& k) const
+    {
+        return true;
+    }
+};
+
+
+/**
+ * Wavefront step for Neighborhood::forEach(): label the unlabeled ground
+ * neighbors of a voxel, and queue them.
+ */
+struct WavefrontExpansion
+{
+    const MortonKeySet& ground;
+    std::vector<float>& values;
+    std::queue<int>& queue;
+    const float resolution;
+    octomap::OcTreeKey key;
+    float value;
+
+    WavefrontExpansion(const MortonKeySet& g, std::vector<float>& v, std::queue<int>& q, float res) : ground(g), values(v), queue(q), resolution(res), value(0.0f) {}
+
+    bool operator()(int dx, int dy, int dz, float length)
+    {
+        const int x = key[0] + dx, y = key[1] + dy, z = key[2] + dz;
+        if(x < 0 || y < 0 || z < 0 || x > 0xFFFF || y > 0xFFFF || z > 0xFFFF) return true;
+        int j = ground.find(octomap::OcTreeKey(x, y, z));
+        if(j == -1 || std::isfinite(values[j])) return true;
+        values[j] = value + length * resolution;
+        queue.push(j);
+        return true;
+    }
+};
+
+
+/**
+ * Where to stop a wavefront early, leaving the rest queued: after
+ * max_expansions voxels, or once the voxel stop_idx is labeled and the
+ * front is more than stop_margin beyond it. Values are final once
+ * assigned, so a partial field is exact where it is labeled.
+ */
+struct WavefrontBound
+{
+    int stop_idx;
+    float stop_margin;
+    size_t max_expansions;
+
+    WavefrontBound() : stop_idx(-1), stop_margin(0.0f), max_expansions(std::numeric_limits<size_t>::max()) {}
+
+    bool reached(const std::vector<float>& values, int front, size_t expansions) const
+    {
+        if(expansions >= max_expansions) return true;
+        // (infinite until stop_idx is labeled)
+        return stop_idx != -1 && values[front] > values[stop_idx] + stop_margin;
+    }
+};
+
+
+/**
+ * Wavefront from the queued voxels of ground, over Neighborhood<R2>,
+ * labeling the voxels whose value is infinite. Returns true if complete,
+ * false if stopped by the bound.
+ */
+template<int R2>
+bool propagateWavefront(const MortonKeySet& ground, std::vector<float>& values, std::queue<int>& q, double resolution, const WavefrontBound& bound)
+{
+    WavefrontExpansion expand(ground, values, q, resolution);
+    for(size_t expansions = 0; !q.empty(); expansions++)
+    {
+        int i = q.front();
+        if(bound.reached(values, i, expansions)) return false;
+        q.pop();
+
+        expand.key = ground.key(i);
+        expand.value = values[i];
+        Neighborhood<R2>::forEach(expand);
+    }
+    return true;
+}
+
+
+/**
+ * Wavefront over the precompiled neighborhood neighborhood_r2, or else
+ * (neighborhood_r2 = 0) over a radius search of connectivity voxels.
+ */
+bool propagateWavefront(const MortonKeySet& ground, std::vector<float>& values, std::queue<int>& q, double resolution, int neighborhood_r2, double connectivity, const WavefrontBound& bound = WavefrontBound())
+{
+    // (7 and 15 are not sums of three squares: same neighborhoods as 6 and 14)
+    switch(neighborhood_r2)
+    {
+    case 1: return propagateWavefront<1>(ground, values, q, resolution, bound);
+    case 2: return propagateWavefront<2>(ground, values, q, resolution, bound);
+    case 3: return propagateWavefront<3>(ground, values, q, resolution, bound);
+    case 4: return propagateWavefront<4>(ground, values, q, resolution, bound);
+    case 5: return propagateWavefront<5>(ground, values, q, resolution, bound);
+    case 6: case 7: return propagateWavefront<6>(ground, values, q, resolution, bound);
+    case 8: return propagateWavefront<8>(ground, values, q, resolution, bound);
+    case 9: return propagateWavefront<9>(ground, values, q, resolution, bound);
+    case 10: return propagateWavefront<10>(ground, values, q, resolution, bound);
+    case 11: return propagateWavefront<11>(ground, values, q, resolution, bound);
+    case 12: return propagateWavefront<12>(ground, values, q, resolution, bound);
+    case 13: return propagateWavefront<13>(ground, values, q, resolution, bound);
+    case 14: case 15: return propagateWavefront<14>(ground, values, q, resolution, bound);
+    }
+
+    std::vector<int> neighbors;
+    std::vector<float> sqr_distances;
+    for(size_t expansions = 0; !q.empty(); expansions++)
+    {
+        int i = q.front();
+        if(bound.reached(values, i, expansions)) return false;
+        q.pop();
+
+        ground.radiusSearch(ground.key(i), connectivity, neighbors, sqr_distances);
+
+        for(size_t n = 0; n < neighbors.size(); n++)
+        {
+            int j = neighbors[n];
+
+            // values are initially set to infinity.
+            // if j is finite it means it has already been labeled.
+            if(std::isfinite(values[j])) continue;
+
+            // otherwise, label it:
+            values[j] = values[i] + sqrt(sqr_distances[n]) * resolution;
+
+            // continue exploring neighbours:
+            q.push(j);
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Neighborhood::forEach() step collecting the ground neighbors of a voxel,
+ * with their distances in meters.
+ */
+struct NeighborCollector
+{
+    const MortonKeySet& ground;
+    std::vector<int>& indices;
+    std::vector<float>& lengths;
+    const float resolution;
+    octomap::OcTreeKey key;
+
+    NeighborCollector(const MortonKeySet& g, std::vector<int>& i, std::vector<float>& l, float res) : ground(g), indices(i), lengths(l), resolution(res) {}
+
+    bool operator()(int dx, int dy, int dz, float length)
+    {
+        const int x = key[0] + dx, y = key[1] + dy, z = key[2] + dz;
+        if(x < 0 || y < 0 || z < 0 || x > 0xFFFF || y > 0xFFFF || z > 0xFFFF) return true;
+        int j = ground.find(octomap::OcTreeKey(x, y, z));
+        if(j == -1) return true;
+        indices.push_back(j);
+        lengths.push_back(length * resolution);
+        return true;
+    }
+};
+
+
+template<int R2>
+void collectNeighbors(const MortonKeySet& ground, size_t i, double resolution, std::vector<int>& indices, std::vector<float>& lengths)
+{
+    NeighborCollector collect(ground, indices, lengths, resolution);
+    collect.key = ground.key(i);
+    Neighborhood<R2>::forEach(collect);
+}
+
+
+/**
+ * Ground neighbors of voxel i (other than itself), with their distances in
+ * meters, over the same neighborhood as propagateWavefront().
+ */
+void collectNeighbors(const MortonKeySet& ground, size_t i, double resolution, int neighborhood_r2, double connectivity, std::vector<int>& indices, std::vector<float>& lengths)
+{
+    indices.clear();
+    lengths.clear();
+    switch(neighborhood_r2)
+    {
+    case 1: collectNeighbors<1>(ground, i, resolution, indices, lengths); return;
+    case 2: collectNeighbors<2>(ground, i, resolution, indices, lengths); return;
+    case 3: collectNeighbors<3>(ground, i, resolution, indices, lengths); return;
+    case 4: collectNeighbors<4>(ground, i, resolution, indices, lengths); return;
+    case 5: collectNeighbors<5>(ground, i, resolution, indices, lengths); return;
+    case 6: case 7: collectNeighbors<6>(ground, i, resolution, indices, lengths); return;
+    case 8: collectNeighbors<8>(ground, i, resolution, indices, lengths); return;
+    case 9: collectNeighbors<9>(ground, i, resolution, indices, lengths); return;
+    case 10: collectNeighbors<10>(ground, i, resolution, indices, lengths); return;
+    case 11: collectNeighbors<11>(ground, i, resolution, indices, lengths); return;
+    case 12: collectNeighbors<12>(ground, i, resolution, indices, lengths); return;
+    case 13: collectNeighbors<13>(ground, i, resolution, indices, lengths); return;
+    case 14: case 15: collectNeighbors<14>(ground, i, resolution, indices, lengths); return;
+    }
+
+    ground.radiusSearch(ground.key(i), connectivity, indices, lengths);
+    size_t k = 0;
+    for(size_t n = 0; n < indices.size(); n++)
+    {
+        if(indices[n] == int(i)) continue;
+        indices[k] = indices[n];
+        lengths[k] = sqrt(lengths[n]) * resolution;
+        k++;
+    }
+    indices.resize(k);
+    lengths.resize(k);
+}
+
+
+/**
+ * Center of a voxel (key at maximum tree depth).
+ */
+inline octomap::point3d voxelCenter(const octomap::OcTreeKey& key, double resolution)
+{
+    return octomap::point3d((int(key[0]) - 32768 + 0.5) * resolution, (int(key[1]) - 32768 + 0.5) * resolution, (int(key[2]) - 32768 + 0.5) * resolution);
+}
+
+
+void normalizeIntensity(pcl::PointCloud<pcl::PointXYZI>& cloud)
+{
+    float imin = std::numeric_limits<float>::infinity();
+    float imax = -std::numeric_limits<float>::infinity();
+    for(pcl::PointCloud<pcl::PointXYZI>::iterator it = cloud.begin(); it != cloud.end(); ++it)
+    {
+        if(!std::isfinite(it->intensity)) continue;
+        imin = fmin(imin, it->intensity);
+        imax = fmax(imax, it->intensity);
+    }
+    const float eps = 0.01;
+    float d = imax - imin + eps;
+    for(pcl::PointCloud<pcl::PointXYZI>::iterator it = cloud.begin(); it != cloud.end(); ++it)
+    {
+        if(std::isfinite(it->intensity))
+            it->intensity = (it->intensity - imin) / d;
+        else
+            it->intensity = 1.0;
+    }
+}
+
+
+/**
+ * Ground cloud as published on ground_cloud_out: voxel centers, with the
+ * normalized navigation function as intensity.
+ */
+void makeGroundCloud(const MortonKeySet& ground, const std::vector<float>& values, double resolution, pcl::PointCloud<pcl::PointXYZI>& cloud)
+{
+    cloud.clear();
+    cloud.reserve(ground.size());
+    for(size_t i = 0; i < ground.size(); i++)
+    {
+        octomap::point3d p = voxelCenter(ground.key(i), resolution);
+        pcl::PointXYZI point;
+        point.x = p.x();
+        point.y = p.y();
+        point.z = p.z();
+        point.intensity = values[i];
+        cloud.push_back(point);
+    }
+    normalizeIntensity(cloud);
+}
+
+
+/**
+ * Octree level of detail of the voxels [begin, end) of a Morton ordered
+ * set, for visualization: a point per cell of 2^lod voxels a side (whose
+ * voxels are contiguous in Morton order), at the mean of its voxels, with
+ * the minimum of their values, if any, as intensity.
+ */
+void makeLodCloud(const MortonKeySet& voxels, const std::vector<float> *values, double resolution, unsigned lod, size_t begin, size_t end, pcl::PointCloud<pcl::PointXYZI>& cloud)
+{
+    const unsigned shift = 3 * lod;
+    for(size_t i = begin; i < end; )
+    {
+        const MortonKeySet::Code cell = voxels.code(i) >> shift;
+        double x = 0.0, y = 0.0, z = 0.0;
+        float value = std::numeric_limits<float>::infinity();
+        size_t n = 0;
+        for(; i < end && (voxels.code(i) >> shift) == cell; i++, n++)
+        {
+            octomap::point3d p = voxelCenter(voxels.key(i), resolution);
+            x += p.x();
+            y += p.y();
+            z += p.z();
+            if(values) value = std::min(value, (*values)[i]);
+        }
+        pcl::PointXYZI point;
+        point.x = x / n;
+        point.y = y / n;
+        point.z = z / n;
+        point.intensity = values ? value : 0.0f;
+        cloud.push_back(point);
+    }
+}
+
+
+/**
+ * Visualization tiles of a MarkerArray topic: marker id and hash of the
+ * content last sent (if sent), by tile (Morton code prefix).
+ */
+struct VisualizationTile
+{
+    int id;
+    size_t hash;
+    bool sent;
+    bool seen;
+};
+typedef boost::unordered_map<MortonKeySet::Code, VisualizationTile> VisualizationTileMap;
+
+
+/**
+ * Add to msg the markers of the tiles (cubes of 2^tile_level voxels) of
+ * voxels not sent yet or whose level of detail changed since they were,
+ * and the deletions of the tiles left empty. Values are
+ * normalized by max_value into a green (low) to red (high) color.
+ */
+void addVisualizationTiles(const MortonKeySet& voxels, const std::vector<float> *values, float max_value, double resolution, unsigned lod, unsigned tile_level,
+        const std::string& frame_id, const std::string& ns, VisualizationTileMap& tiles, int& next_id, visualization_msgs::MarkerArray& msg)
+{
+    for(VisualizationTileMap::iterator it = tiles.begin(); it != tiles.end(); ++it)
+        it->second.seen = false;
+
+    const unsigned shift = 3 * tile_level;
+    pcl::PointCloud<pcl::PointXYZI> cloud;
+    for(size_t begin = 0; begin < voxels.size(); )
+    {
+        const MortonKeySet::Code tile = voxels.code(begin) >> shift;
+        size_t end = begin;
+        while(end < voxels.size() && (voxels.code(end) >> shift) == tile) end++;
+
+        cloud.clear();
+        makeLodCloud(voxels, values, resolution, lod, begin, end, cloud);
+        begin = end;
+
+        // (colors quantized to 1/64, which is also what the hash sees)
+        std::vector<float> levels(cloud.size());
+        size_t hash = 0;
+        for(size_t i = 0; i < cloud.size(); i++)
+        {
+            levels[i] = std::isfinite(cloud[i].intensity) ? std::min(1.0f, floor(cloud[i].intensity / max_value * 64.0f) / 64.0f) : 1.0f;
+            boost::hash_combine(hash, int(floor(cloud[i].x / resolution)));
+            boost::hash_combine(hash, int(floor(cloud[i].y / resolution)));
+            boost::hash_combine(hash, int(floor(cloud[i].z / resolution)));
+            boost::hash_combine(hash, int(levels[i] * 64.0f));
+        }
+
+        VisualizationTileMap::iterator it = tiles.find(tile);
+        if(it == tiles.end())
+        {
+            VisualizationTile t;
+            t.id = next_id++;
+            t.sent = false;
+            it = tiles.insert(std::make_pair(tile, t)).first;
+        }
+        it->second.seen = true;
+        if(it->second.sent && it->second.hash == hash) continue;
+        it->second.hash = hash;
+        it->second.sent = true;
+
+        visualization_msgs::Marker marker;
+        marker.header.frame_id = frame_id;
+        marker.header.stamp = ros::Time::now();
+        marker.ns = ns;
+        marker.id = it->second.id;
+        marker.type = visualization_msgs::Marker::CUBE_LIST;
+        marker.action = visualization_msgs::Marker::ADD;
+        marker.pose.orientation.w = 1.0;
+        marker.scale.x = marker.scale.y = marker.scale.z = resolution * (1 << lod);
+        marker.color.a = 1.0;
+        for(size_t i = 0; i < cloud.size(); i++)
+        {
+            geometry_msgs::Point p;
+            p.x = cloud[i].x;
+            p.y = cloud[i].y;
+            p.z = cloud[i].z;
+            marker.points.push_back(p);
+            std_msgs::ColorRGBA c;
+            c.r = values ? levels[i] : 0.5;
+            c.g = values ? 1.0 - levels[i] : 0.5;
+            c.b = values ? 0.0 : 0.5;
+            c.a = 1.0;
+            marker.colors.push_back(c);
+        }
+        msg.markers.push_back(marker);
+    }
+
+    for(VisualizationTileMap::iterator it = tiles.begin(); it != tiles.end(); )
+    {
+        if(it->second.seen)
+        {
+            ++it;
+            continue;
+        }
+        visualization_msgs::Marker marker;
+        marker.header.frame_id = frame_id;
+        marker.header.stamp = ros::Time::now();
+        marker.ns = ns;
+        marker.id = it->second.id;
+        marker.action = visualization_msgs::Marker::DELETE;
+        msg.markers.push_back(marker);
+        it = tiles.erase(it);
+    }
+}
+
+
+/**
+ * Ground voxels of one map, shared read-only by the threads computing the
+ * navigation functions of clients.
+ */
+struct GroundSnapshot
+{
+    MortonKeySet ground;
+    double resolution;
+    ros::Time stamp;
+
+    /**
+     * Index of the ground voxel nearest to p, or -1.
+     */
+    int nearest(const octomap::point3d& p) const
+    {
+        octomap::OcTreeKey key;
+        for(int i = 0; i < 3; i++)
+        {
+            double k = floor(p(i) / resolution) + 32768;
+            if(k < 0 || k > 0xFFFF) return -1;
+            key[i] = k;
+        }
+        return ground.nearest(key);
+    }
+};
+
+
+/**
+ * Navigation functions for several clients (e.g. robots sharing the map),
+ * each with its own goal, computed by a pool of worker threads over a
+ * shared snapshot of the ground, and published on a topic per client.
+ *
+ * Requests are queued by goal voxel, so clients with the same goal
+ * pending at the same time are served by one computation. A new ground
+ * snapshot requeues the goals of all the clients.
+ */
+class NavigationFunctionServer
+{
+public:
+    NavigationFunctionServer(const ros::NodeHandle& nh, const std::string& frame_id, int num_threads, int neighborhood_r2, double connectivity);
+    ~NavigationFunctionServer();
+    void setGround(const boost::shared_ptr<const GroundSnapshot>& ground);
+    bool request(const std::string& client, const octomap::point3d& goal, octomap::point3d& reprojected_goal, std::string& topic);
+
+protected:
+    struct Client
+    {
+        octomap::point3d goal;
+        uint32_t sequence;
+        ros::Publisher pub;
+
+        Client() : sequence(0) {}
+    };
+
+    // clients are identified by name and request sequence, so that the
+    // ones which changed goal since being queued are skipped
+    typedef std::vector<std::pair<std::string, uint32_t> > ClientList;
+
+    struct Job
+    {
+        octomap::OcTreeKey goal_key;
+        ClientList clients;
+    };
+
+    int enqueue(const std::string& name, const Client& client);
+    bool isCurrent(const ClientList::value_type& c) const;
+    void run();
+    void computeField(const Job& job, const GroundSnapshot& ground);
+
+    ros::NodeHandle nh_;
+    std::string frame_id_;
+    int neighborhood_r2_;
+    double connectivity_;
+    ros::Publisher timing_pub_;
+    boost::mutex mutex_;
+    boost::condition_variable cond_;
+    bool stop_;
+    std::deque<Job> queue_;
+    std::map<std::string, Client> clients_;
+    boost::shared_ptr<const GroundSnapshot> ground_;
+    boost::thread_group threads_;
+};
+
+
+NavigationFunctionServer::NavigationFunctionServer(const ros::NodeHandle& nh, const std::string& frame_id, int num_threads, int neighborhood_r2, double connectivity)
+    : nh_(nh),
+      frame_id_(frame_id),
+      neighborhood_r2_(neighborhood_r2),
+      connectivity_(connectivity),
+      stop_(false)
+{
+    timing_pub_ = nh_.advertise<diagnostic_msgs::DiagnosticArray>("timing", 10, false);
+    for(int i = 0; i < num_threads; i++)
+        threads_.create_thread(boost::bind(&NavigationFunctionServer::run, this));
+}
+
+
+NavigationFunctionServer::~NavigationFunctionServer()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    threads_.join_all();
+}
+
+
+/**
+ * Queue the goal of a client (mutex_ must be held), joining a queued job
+ * with the same goal voxel if any. Returns the index of the goal voxel, or
+ * -1 if there is no ground (yet) to compute on.
+ */
+int NavigationFunctionServer::enqueue(const std::string& name, const Client& client)
+{
+    if(!ground_) return -1;
+    int goal_idx = ground_->nearest(client.goal);
+    if(goal_idx == -1) return -1;
+
+    const octomap::OcTreeKey goal_key = ground_->ground.key(goal_idx);
+    for(std::deque<Job>::iterator it = queue_.begin(); it != queue_.end(); ++it)
+    {
+        if(it->goal_key == goal_key)
+        {
+            it->clients.push_back(std::make_pair(name, client.sequence));
+            return goal_idx;
+        }
+    }
+
+    queue_.push_back(Job());
+    queue_.back().goal_key = goal_key;
+    queue_.back().clients.push_back(std::make_pair(name, client.sequence));
+    cond_.notify_one();
+    return goal_idx;
+}
+
+
+/**
+ * Replace the ground, and recompute the fields of all the clients on it.
+ */
+void NavigationFunctionServer::setGround(const boost::shared_ptr<const GroundSnapshot>& ground)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    ground_ = ground;
+    queue_.clear();
+    for(std::map<std::string, Client>::const_iterator it = clients_.begin(); it != clients_.end(); ++it)
+        enqueue(it->first, it->second);
+}
+
+
+/**
+ * Set the goal of a client, advertising its topic on the first request.
+ * Returns false if the client name is not valid.
+ */
+bool NavigationFunctionServer::request(const std::string& client, const octomap::point3d& goal, octomap::point3d& reprojected_goal, std::string& topic)
+{
+    std::string error;
+    if(client.empty() || client.find('/') != std::string::npos || !ros::names::validate(client, error))
+    {
+        ROS_ERROR("invalid navigation function client name '%s'", client.c_str());
+        return false;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    Client& c = clients_[client];
+    if(!c.pub)
+        c.pub = nh_.advertise<sensor_msgs::PointCloud2>("navfn_clients/" + client + "/ground_cloud", 1, true);
+    c.goal = goal;
+    c.sequence++;
+    topic = c.pub.getTopic();
+
+    int goal_idx = enqueue(client, c);
+    reprojected_goal = goal_idx == -1 ? goal : voxelCenter(ground_->ground.key(goal_idx), ground_->resolution);
+    return true;
+}
+
+
+bool NavigationFunctionServer::isCurrent(const ClientList::value_type& c) const
+{
+    std::map<std::string, Client>::const_iterator it = clients_.find(c.first);
+    return it != clients_.end() && it->second.sequence == c.second;
+}
+
+
+void NavigationFunctionServer::run()
+{
+    while(true)
+    {
+        Job job;
+        boost::shared_ptr<const GroundSnapshot> ground;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            while(!stop_ && queue_.empty())
+                cond_.wait(lock);
+            if(stop_) return;
+            job.goal_key = queue_.front().goal_key;
+            job.clients.swap(queue_.front().clients);
+            queue_.pop_front();
+            ground = ground_;
+
+            // skip the clients which changed goal meanwhile:
+            ClientList current;
+            for(ClientList::const_iterator it = job.clients.begin(); it != job.clients.end(); ++it)
+                if(isCurrent(*it)) current.push_back(*it);
+            if(current.empty()) continue;
+            job.clients.swap(current);
+        }
+        computeField(job, *ground);
+    }
+}
+
+
+void NavigationFunctionServer::computeField(const Job& job, const GroundSnapshot& ground)
+{
+    StageTiming timing("navigation_function_server");
+
+    // (jobs are queued on the snapshot they are computed on)
+    int goal_idx = ground.ground.find(job.goal_key);
+    if(goal_idx == -1) return;
+
+    std::vector<float> values(ground.ground.size(), std::numeric_limits<float>::infinity());
+    values[goal_idx] = 0.0;
+    std::queue<int> q;
+    q.push(goal_idx);
+    propagateWavefront(ground.ground, values, q, ground.resolution, neighborhood_r2_, connectivity_);
+    timing.mark("navfn");
+
+    pcl::PointCloud<pcl::PointXYZI> cloud;
+    makeGroundCloud(ground.ground, values, ground.resolution, cloud);
+    cloud.header.frame_id = frame_id_;
+    sensor_msgs::PointCloud2 msg;
+    pcl::toROSMsg(cloud, msg);
+    timing.mark("cloud");
+
+    std::vector<ros::Publisher> pubs;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        for(ClientList::const_iterator it = job.clients.begin(); it != job.clients.end(); ++it)
+            if(isCurrent(*it)) pubs.push_back(clients_[it->first].pub);
+    }
+    for(size_t i = 0; i < pubs.size(); i++)
+        pubs[i].publish(msg);
+
+    timing.setMapStamp(ground.stamp);
+    timing.add("clients", pubs.size());
+    timing.add("ground voxels", ground.ground.size());
+    timing.publish(timing_pub_);
+}
+
+
+class NavigationFunction;
+
+
+/**
+ * NavigationFunction::getGroundNeighbors() for ParallelRelaxation and
+ * IncrementalRelaxation.
+ */
+struct GroundNeighbors
+{
+    const NavigationFunction& navfn;
+
+    GroundNeighbors(const NavigationFunction& n) : navfn(n) {}
+
+    void operator()(size_t i, std::vector<int>& indices, std::vector<float>& lengths) const;
+};
+
+
+/**
+ * Heuristic for IncrementalRelaxation: distance in meters from a ground
+ * voxel to the robot's, or zero without one (scaled down a little, so
+ * that float rounding can't make it exceed a path length).
+ */
+struct RobotDistance
+{
+    const MortonKeySet *ground;
+    octomap::OcTreeKey robot;
+    float resolution;
+
+    RobotDistance() : ground(0), resolution(0.0f) {}
+
+    RobotDistance(const MortonKeySet& g, int robot_idx, double res) : ground(&g), resolution(robot_idx == -1 ? 0.0f : res)
+    {
+        if(robot_idx != -1) robot = g.key(robot_idx);
+    }
+
+    float operator()(size_t i) const
+    {
+        if(resolution == 0.0f) return 0.0f;
+        return 0.999f * sqrt(MortonKeySet::squaredDistance(ground->key(i), robot)) * resolution;
+    }
+};
+
+
 class NavigationFunction
 {
 protected:
@@ -69,58 +815,164 @@ protected:
     std::string frame_id_;
     std::string robot_frame_id_;
     ros::Subscriber octree_sub_;
+    ros::Subscriber octree_update_sub_;
     ros::Subscriber goal_point_sub_;
     ros::Subscriber goal_pose_sub_;
     ros::Publisher ground_pub_;
     ros::Publisher obstacles_pub_;
     ros::Publisher reprojected_point_goal_pub_;
     ros::Publisher reprojected_pose_goal_pub_;
+    ros::Publisher navfn_delta_pub_;
+    ros::Publisher timing_pub_;
     tf::TransformListener tf_listener_;    
     geometry_msgs::PoseStamped robot_pose_;
     geometry_msgs::PoseStamped goal_;
-    octomap::OcTree* octree_ptr_;
-    pcl::PointCloud<pcl::PointXYZI> ground_pcl_;
-    pcl::PointCloud<pcl::PointXYZ> obstacles_pcl_;
-    pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr ground_octree_ptr_;
-    pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>::Ptr obstacles_octree_ptr_;
+    OcTreeConstPtr octree_ptr_;
+    ros::Time map_stamp_;
+    bool incremental_updates_;
+    IncrementalOctomap incremental_map_;
+    // ground and obstacle voxels, as keys in Morton order; the value of a
+    // ground voxel is its distance to the goal
+    MortonKeySet unfiltered_ground_;
+    MortonVoxelMap<float> ground_;
+    MortonKeySet obstacles_;
+    // with surface_map, the ground is computed on surface_map_, and
+    // ground_surface_/surface_ground_ map indices between the two
+    bool use_surface_map_;
+    SurfaceMap surface_map_;
+    std::vector<int> ground_surface_;
+    std::vector<int> surface_ground_;
     bool treat_unknown_as_free_;
     double robot_height_;
     double robot_radius_;
     double max_superable_height_;
     double ground_voxel_connectivity_;
+    int neighborhood_r2_;
+    typedef boost::unordered_map<octomap::OcTreeKey, float, octomap::OcTreeKey::KeyHash> NavigationFunctionKeyMap;
+    NavigationFunctionKeyMap published_navfn_;
+    double published_navfn_resolution_;
+    uint32_t navfn_delta_sequence_;
+    int navfn_keyframe_interval_;
+    int navfn_updates_since_keyframe_;
+    double navfn_delta_tolerance_;
+    size_t num_reachable_;
+    int client_threads_;
+    bool anytime_;
+    double anytime_margin_;
+    double anytime_time_slice_;
+    std::queue<int> pending_wavefront_;
+    ros::WallTimer completion_timer_;
+    std::string navfn_engine_;
+    int navfn_threads_;
+    // (navfn_engine parallel) workers of the relaxation rounds
+    boost::scoped_ptr<WorkerPool> navfn_pool_;
+    size_t navfn_rounds_;
+    // (navfn_engine incremental) the field of the goal voxel
+    // field_goal_key_, repaired after the ground voxels in dirty_keys_ were
+    // added (or left pending) and those in removed_keys_ removed
+    IncrementalRelaxation<GroundNeighbors, RobotDistance> relaxation_;
+    bool field_valid_;
+    octomap::OcTreeKey field_goal_key_;
+    double field_resolution_;
+    std::vector<octomap::OcTreeKey> dirty_keys_;
+    std::vector<octomap::OcTreeKey> removed_keys_;
+    size_t navfn_expansions_;
+    // visualization streams, apart from the full resolution clouds that
+    // move_base_node uses
+    ros::Publisher ground_viz_pub_;
+    ros::Publisher obstacles_viz_pub_;
+    ros::Publisher viz_tiles_pub_;
+    ros::WallTimer viz_timer_;
+    double viz_rate_;
+    int viz_lod_;
+    bool viz_tiled_;
+    int viz_tile_level_;
+    bool viz_dirty_;
+    VisualizationTileMap ground_viz_tiles_;
+    VisualizationTileMap obstacles_viz_tiles_;
+    int next_viz_tile_id_;
+    Tracer tracer_;
+    boost::shared_ptr<NavigationFunctionServer> server_;
+    ros::ServiceServer compute_navfn_srv_;
 public:
-    NavigationFunction();
+    NavigationFunction(const ros::NodeHandle& nh = ros::NodeHandle(), const ros::NodeHandle& pnh = ros::NodeHandle("~"));
     ~NavigationFunction();
     void onOctomap(const octomap_msgs::Octomap::ConstPtr& msg);
+    void onOctomapUpdate(const octomap_path_planner::OctomapUpdate::ConstPtr& msg);
     void onGoal(const geometry_msgs::PointStamped::ConstPtr& msg);
     void onGoal(const geometry_msgs::PoseStamped::ConstPtr& msg);
-    void expandOcTree();
     bool isGround(const octomap::OcTreeKey& key);
     bool isObstacle(const octomap::OcTreeKey& key);
-    bool isNearObstacle(const pcl::PointXYZI& point);
+    bool isNearObstacle(const octomap::OcTreeKey& key);
     void filterInflatedRegionFromGround();
+    void classifyOccupiedVoxel(const octomap::OcTreeKey& key);
+    void classifyOccupiedLeaf(const octomap::OcTreeKey& index_key, unsigned depth, const octomap::OcTreeKey& min, const octomap::OcTreeKey& max);
     void computeGround();
+    void computeSurfaceGround();
+    void updateGround(const OctomapRegion& region);
     void projectGoalPositionToGround();
     void publishGroundCloud();
+    void publishVisualization();
+    void onVisualizationTimer(const ros::WallTimerEvent& event);
+    void onVisualizationTilesSubscribe(const ros::SingleSubscriberPublisher& pub);
+    void fillNavigationFunctionKeyframe(octomap_path_planner::NavigationFunctionDelta& msg);
+    void publishNavigationFunctionDelta();
+    void onNavigationFunctionDeltaSubscribe(const ros::SingleSubscriberPublisher& pub);
     int getGoalIndex();
-    void getNeighboringGroundPoints(int index, std::vector<int>& neighbors, double search_radius, bool exclude_already_labeled);
+    void getNeighboringGroundPoints(int index, std::vector<int>& neighbors, std::vector<float>& sqr_distances, double search_radius);
+    bool propagate(std::queue<int>& q, const WavefrontBound& bound);
+    bool propagateOnSurfaces(std::queue<int>& q, const WavefrontBound& bound);
+    void getGroundNeighbors(size_t i, std::vector<int>& indices, std::vector<float>& lengths) const;
+    void savePendingVoxels();
     void computeDistanceTransform();
+    void repairDistanceTransform(int goal_idx);
+    void onCompleteWavefront(const ros::WallTimerEvent& event);
+    void publishNavigationFunction();
+    int getRobotIndex();
+    void publishTiming(StageTiming& timing, const ros::Time& map_stamp);
     double getAverageIntensity(int index, double search_radius);
     void smoothIntensity(double search_radius);
-    void normalizeIntensity();
+    void updateClientGround(const ros::Time& map_stamp);
+    bool onComputeNavigationFunction(octomap_path_planner::ComputeNavigationFunction::Request& req, octomap_path_planner::ComputeNavigationFunction::Response& res);
 };
 
 
-NavigationFunction::NavigationFunction()
-    : pnh_("~"),
+NavigationFunction::NavigationFunction(const ros::NodeHandle& nh, const ros::NodeHandle& pnh)
+    : nh_(nh),
+      pnh_(pnh),
       frame_id_("/map"),
       robot_frame_id_("/base_link"),
-      octree_ptr_(0L),
+      incremental_updates_(false),
+      use_surface_map_(false),
       treat_unknown_as_free_(false),
       robot_height_(0.5),
       robot_radius_(0.5),
       max_superable_height_(0.2),
-      ground_voxel_connectivity_(1.8)
+      ground_voxel_connectivity_(1.8),
+      neighborhood_r2_(3),
+      published_navfn_resolution_(0.0),
+      navfn_delta_sequence_(0),
+      navfn_keyframe_interval_(10),
+      navfn_updates_since_keyframe_(0),
+      navfn_delta_tolerance_(1e-3),
+      num_reachable_(0),
+      client_threads_(0),
+      anytime_(false),
+      anytime_margin_(1.0),
+      anytime_time_slice_(0.01),
+      navfn_engine_("wavefront"),
+      navfn_threads_(boost::thread::hardware_concurrency()),
+      navfn_rounds_(0),
+      relaxation_(GroundNeighbors(*this), ground_.values()),
+      field_valid_(false),
+      field_resolution_(0.0),
+      navfn_expansions_(0),
+      viz_rate_(1.0),
+      viz_lod_(2),
+      viz_tiled_(false),
+      viz_tile_level_(5),
+      viz_dirty_(false),
+      next_viz_tile_id_(0)
 {
     pnh_.param("frame_id", frame_id_, frame_id_);
     pnh_.param("robot_frame_id", robot_frame_id_, robot_frame_id_);
@@ -129,32 +981,175 @@ NavigationFunction::NavigationFunction()
     pnh_.param("robot_radius", robot_radius_, robot_radius_);
     pnh_.param("max_superable_height", max_superable_height_, max_superable_height_);
     pnh_.param("ground_voxel_connectivity", ground_voxel_connectivity_, ground_voxel_connectivity_);
+    pnh_.param("navfn_keyframe_interval", navfn_keyframe_interval_, navfn_keyframe_interval_);
+    pnh_.param("navfn_delta_tolerance", navfn_delta_tolerance_, navfn_delta_tolerance_);
+    pnh_.param("incremental_updates", incremental_updates_, incremental_updates_);
+    pnh_.param("client_threads", client_threads_, client_threads_);
+    pnh_.param("surface_map", use_surface_map_, use_surface_map_);
+    pnh_.param("anytime", anytime_, anytime_);
+    pnh_.param("anytime_margin", anytime_margin_, anytime_margin_);
+    pnh_.param("anytime_time_slice", anytime_time_slice_, anytime_time_slice_);
+    pnh_.param("navfn_engine", navfn_engine_, navfn_engine_);
+    pnh_.param("navfn_threads", navfn_threads_, navfn_threads_);
+    pnh_.param("viz_rate", viz_rate_, viz_rate_);
+    pnh_.param("viz_lod", viz_lod_, viz_lod_);
+    pnh_.param("viz_tiled", viz_tiled_, viz_tiled_);
+    pnh_.param("viz_tile_level", viz_tile_level_, viz_tile_level_);
+    bool trace = false;
+    pnh_.param("trace", trace, trace);
+    tracer_.init(nh_, trace);
+
+    if(ground_voxel_connectivity_ < 1.0)
+    {
+        ROS_ERROR("invalid ground_voxel_connectivity %f (must be at least 1); using 1.8", ground_voxel_connectivity_);
+        ground_voxel_connectivity_ = 1.8;
+    }
+    // the wavefront uses a precompiled neighborhood if there is one for
+    // this radius, or else a radius search:
+    neighborhood_r2_ = neighborhoodR2(ground_voxel_connectivity_);
+    if(neighborhood_r2_ > 15)
+    {
+        ROS_WARN("ground_voxel_connectivity %f is larger than the precompiled neighborhoods; using radius search", ground_voxel_connectivity_);
+        neighborhood_r2_ = 0;
+    }
+
+    if(anytime_margin_ < 0.0)
+    {
+        ROS_ERROR("invalid anytime_margin %f (must be non-negative); using 1.0", anytime_margin_);
+        anytime_margin_ = 1.0;
+    }
+    if(anytime_time_slice_ <= 0.0)
+    {
+        ROS_ERROR("invalid anytime_time_slice %f (must be positive); using 0.01", anytime_time_slice_);
+        anytime_time_slice_ = 0.01;
+    }
+    if(navfn_engine_ != "wavefront" && navfn_engine_ != "parallel" && navfn_engine_ != "incremental")
+    {
+        ROS_ERROR("invalid navfn_engine '%s' (must be wavefront, parallel or incremental); using wavefront", navfn_engine_.c_str());
+        navfn_engine_ = "wavefront";
+    }
+    navfn_threads_ = std::max(1, navfn_threads_);
+    // (one thread solves the rounds by itself)
+    if(navfn_engine_ == "parallel")
+        navfn_pool_.reset(new WorkerPool(navfn_threads_ > 1 ? navfn_threads_ : 0));
+    if(anytime_ && navfn_engine_ == "parallel")
+        ROS_WARN("anytime has no effect with navfn_engine parallel, which computes the whole field at once");
+    completion_timer_ = nh_.createWallTimer(ros::WallDuration(anytime_time_slice_), &NavigationFunction::onCompleteWavefront, this, false, false);
+
+    if(viz_lod_ < 0 || viz_lod_ > 15)
+    {
+        ROS_ERROR("invalid viz_lod %d (must be 0 to 15); using 2", viz_lod_);
+        viz_lod_ = 2;
+    }
+    if(viz_tile_level_ < viz_lod_ || viz_tile_level_ > 16)
+    {
+        ROS_ERROR("invalid viz_tile_level %d (must be viz_lod to 16); using %d", viz_tile_level_, std::max(5, viz_lod_));
+        viz_tile_level_ = std::max(5, viz_lod_);
+    }
+    if(viz_rate_ > 0.0)
+        viz_timer_ = nh_.createWallTimer(ros::WallDuration(1.0 / viz_rate_), &NavigationFunction::onVisualizationTimer, this);
+
+    if(client_threads_ < 0)
+    {
+        ROS_ERROR("invalid client_threads %d (must be 0 to disable, or positive); disabling", client_threads_);
+        client_threads_ = 0;
+    }
+    if(client_threads_ > 0)
+    {
+        server_.reset(new NavigationFunctionServer(nh_, frame_id_, client_threads_, neighborhood_r2_, ground_voxel_connectivity_));
+        compute_navfn_srv_ = nh_.advertiseService("compute_navigation_function", &NavigationFunction::onComputeNavigationFunction, this);
+    }
+
     octree_sub_ = nh_.subscribe<octomap_msgs::Octomap>("octree_in", 1, &NavigationFunction::onOctomap, this);
+    if(incremental_updates_)
+        octree_update_sub_ = nh_.subscribe<octomap_path_planner::OctomapUpdate>("octree_update_in", 10, &NavigationFunction::onOctomapUpdate, this);
     goal_point_sub_ = nh_.subscribe<geometry_msgs::PointStamped>("goal_point_in", 1, &NavigationFunction::onGoal, this);
     goal_pose_sub_ = nh_.subscribe<geometry_msgs::PoseStamped>("goal_pose_in", 1, &NavigationFunction::onGoal, this);
     ground_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("ground_cloud_out", 1, true);
     obstacles_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("obstacles_cloud_out", 1, true);
+    ground_viz_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("ground_viz_out", 1, true);
+    obstacles_viz_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("obstacles_viz_out", 1, true);
+    if(viz_tiled_)
+        viz_tiles_pub_ = nh_.advertise<visualization_msgs::MarkerArray>("viz_tiles_out", 10,
+                boost::bind(&NavigationFunction::onVisualizationTilesSubscribe, this, _1));
     reprojected_point_goal_pub_ = nh_.advertise<geometry_msgs::PointStamped>("reprojected_point_goal", 1, true);
     reprojected_pose_goal_pub_ = nh_.advertise<geometry_msgs::PoseStamped>("reprojected_pose_goal", 1, true);
-    ground_pcl_.header.frame_id = frame_id_;
-    obstacles_pcl_.header.frame_id = frame_id_;
+    navfn_delta_pub_ = nh_.advertise<octomap_path_planner::NavigationFunctionDelta>("navfn_delta_out", 10,
+            boost::bind(&NavigationFunction::onNavigationFunctionDeltaSubscribe, this, _1));
+    timing_pub_ = nh_.advertise<diagnostic_msgs::DiagnosticArray>("timing", 10, false);
 }
 
 
 NavigationFunction::~NavigationFunction()
 {
-    if(octree_ptr_) delete octree_ptr_;
 }
 
 
+/**
+ * Full map callback.
+ *
+ * With incremental_updates, a full map only (re)synchronizes the map,
+ * which is then kept up to date by onOctomapUpdate(), and the full map
+ * topic is unsubscribed until updates are lost.
+ */
 void NavigationFunction::onOctomap(const octomap_msgs::Octomap::ConstPtr& msg)
 {
-    if(octree_ptr_) delete octree_ptr_;
-    octree_ptr_ = octomap_msgs::binaryMsgToMap(*msg);
+    StageTiming timing("navigation_function");
+
+    if(incremental_updates_)
+    {
+        OctomapRegion changed;
+        if(!incremental_map_.setFullMap(*msg, changed)) return;
+        octree_sub_.shutdown();
+        octree_sub_ = ros::Subscriber();
+        octree_ptr_ = incremental_map_.tree();
+    }
+    else
+    {
+        OcTreeConstPtr octree = OctomapStore::instance().get(msg);
+        if(!octree) return;
+        octree_ptr_ = octree;
+    }
+    map_stamp_ = msg->header.stamp;
+    timing.mark("map");
 
-    expandOcTree();
     computeGround();
+    timing.mark("ground");
+    updateClientGround(msg->header.stamp);
+    computeDistanceTransform();
+    timing.mark("navfn");
+    publishTiming(timing, msg->header.stamp);
+}
+
+
+/**
+ * Partial map update callback: merge the update, and reclassify only the
+ * changed region.
+ */
+void NavigationFunction::onOctomapUpdate(const octomap_path_planner::OctomapUpdate::ConstPtr& msg)
+{
+    StageTiming timing("navigation_function");
+    OctomapRegion changed;
+    if(!incremental_map_.applyUpdate(*msg, changed))
+    {
+        if(!octree_sub_)
+        {
+            ROS_WARN("octomap updates lost; resynchronizing from a full map");
+            octree_sub_ = nh_.subscribe<octomap_msgs::Octomap>("octree_in", 1, &NavigationFunction::onOctomap, this);
+        }
+        return;
+    }
+    if(changed.empty) return;
+
+    octree_ptr_ = incremental_map_.tree();
+    map_stamp_ = msg->header.stamp;
+    timing.mark("map");
+    updateGround(changed);
+    timing.mark("ground");
+    updateClientGround(msg->header.stamp);
     computeDistanceTransform();
+    timing.mark("navfn");
+    publishTiming(timing, msg->header.stamp);
 }
 
 
@@ -184,7 +1179,10 @@ void NavigationFunction::onGoal(const geometry_msgs::PointStamped::ConstPtr& msg
         return;
     }
 
+    ros::WallTime start = ros::WallTime::now();
     computeDistanceTransform();
+    tracer_.add("navigation_function/goal navfn", start, ros::WallTime::now(), map_stamp_, goal_.header.stamp);
+    tracer_.flush();
 
     msg2.point.x = goal_.pose.position.x;
     msg2.point.y = goal_.pose.position.y;
@@ -210,48 +1208,15 @@ void NavigationFunction::onGoal(const geometry_msgs::PoseStamped::ConstPtr& msg)
         return;
     }
 
+    ros::WallTime start = ros::WallTime::now();
     computeDistanceTransform();
+    tracer_.add("navigation_function/goal navfn", start, ros::WallTime::now(), map_stamp_, goal_.header.stamp);
+    tracer_.flush();
 
     reprojected_pose_goal_pub_.publish(goal_);
 }
 
 
-void NavigationFunction::expandOcTree()
-{
-    if(!octree_ptr_) return;
-
-    unsigned int maxDepth = octree_ptr_->getTreeDepth();
-
-    // expand collapsed occupied nodes until all occupied leaves are at maximum depth
-    std::vector<octomap::OcTreeNode*> collapsed_occ_nodes;
-
-    size_t initial_size = octree_ptr_->size();
-    size_t num_rounds = 0;
-    size_t expanded_nodes = 0;
-
-    do
-    {
-        collapsed_occ_nodes.clear();
-        for(octomap::OcTree::iterator it = octree_ptr_->begin(); it != octree_ptr_->end(); ++it)
-        {
-            if(octree_ptr_->isNodeOccupied(*it) && it.getDepth() < maxDepth)
-            {
-                collapsed_occ_nodes.push_back(&(*it));
-            }
-        }
-        for(std::vector<octomap::OcTreeNode*>::iterator it = collapsed_occ_nodes.begin(); it != collapsed_occ_nodes.end(); ++it)
-        {
-            (*it)->expandNode();
-        }
-
-        expanded_nodes += collapsed_occ_nodes.size();
-        num_rounds++;
-    } while(collapsed_occ_nodes.size() > 0);
-
-    //ROS_INFO("received octree of %ld nodes; expanded %ld nodes in %ld rounds.", initial_size, expanded_nodes, num_rounds);
-}
-
-
 bool NavigationFunction::isGround(const octomap::OcTreeKey& key)
 {
     octomap::OcTreeNode *node = octree_ptr_->search(key);
@@ -310,32 +1275,62 @@ bool NavigationFunction::isObstacle(const octomap::OcTreeKey& key)
 }
 
 
-bool NavigationFunction::isNearObstacle(const pcl::PointXYZI& point)
+bool NavigationFunction::isNearObstacle(const octomap::OcTreeKey& key)
 {
-    std::vector<int> pointIdx2;
-    std::vector<float> pointDistSq2;
-    pcl::PointXYZ p;
-    p.x = point.x;
-    p.y = point.y;
-    p.z = point.z;
-    int num_points = obstacles_octree_ptr_->nearestKSearch(p, 1, pointIdx2, pointDistSq2);
-    return num_points >= 1 && pointDistSq2[0] < (robot_radius_ * robot_radius_);
+    return obstacles_.isAnyCloserThan(key, robot_radius_ / octree_ptr_->getResolution());
 }
 
 
 void NavigationFunction::filterInflatedRegionFromGround()
 {
-    for(int i = 0; i < ground_pcl_.size(); )
+    ground_.clear();
+    ground_.reserve(unfiltered_ground_.size());
+    for(size_t i = 0; i < unfiltered_ground_.size(); i++)
     {
-        if(isNearObstacle(ground_pcl_[i]))
+        octomap::OcTreeKey k = unfiltered_ground_.key(i);
+        if(!isNearObstacle(k))
+            ground_.push_back(k, std::numeric_limits<float>::infinity());
+    }
+    ground_.sort();
+}
+
+
+void NavigationFunction::classifyOccupiedVoxel(const octomap::OcTreeKey& key)
+{
+    if(isGround(key))
+        unfiltered_ground_.push_back(key);
+    else if(isObstacle(key))
+        obstacles_.push_back(key);
+}
+
+
+/**
+ * Classify the voxels of an occupied leaf that fall in the columns
+ * [min, max] (only x and y of the keys are used).
+ *
+ * A collapsed leaf is classified voxel by voxel as if it was expanded to
+ * the maximum depth (the tree can be shared read-only, so it can't be
+ * expanded in place).
+ */
+void NavigationFunction::classifyOccupiedLeaf(const octomap::OcTreeKey& index_key, unsigned depth, const octomap::OcTreeKey& min, const octomap::OcTreeKey& max)
+{
+    const unsigned s = 1 << (octree_ptr_->getTreeDepth() - depth);
+    const unsigned x0 = std::max<unsigned>(index_key[0], min[0]), x1 = std::min<unsigned>(index_key[0] + s - 1, max[0]);
+    const unsigned y0 = std::max<unsigned>(index_key[1], min[1]), y1 = std::min<unsigned>(index_key[1] + s - 1, max[1]);
+    octomap::OcTreeKey k;
+    for(unsigned z = index_key[2]; z < index_key[2] + s; z++)
+    {
+        for(unsigned y = y0; y <= y1; y++)
         {
-            std::swap(*(ground_pcl_.begin() + i), ground_pcl_.back());
-            ground_pcl_.points.pop_back();
+            for(unsigned x = x0; x <= x1; x++)
+            {
+                k[0] = x;
+                k[1] = y;
+                k[2] = z;
+                classifyOccupiedVoxel(k);
+            }
         }
-        else i++;
     }
-    ground_pcl_.width = ground_pcl_.points.size();
-    ground_pcl_.height = 1;
 }
 
 
@@ -343,117 +1338,504 @@ void NavigationFunction::computeGround()
 {
     if(!octree_ptr_) return;
 
-    ground_pcl_.clear();
-    obstacles_pcl_.clear();
+    // (for the repair, the field moves along to the new ground)
+    const bool repair = navfn_engine_ == "incremental" && field_valid_;
+    MortonVoxelMap<float> previous;
+    if(repair)
+    {
+        savePendingVoxels();
+        previous = ground_;
+    }
 
-    for(octomap::OcTree::leaf_iterator it = octree_ptr_->begin(); it != octree_ptr_->end(); ++it)
+    if(use_surface_map_)
     {
-        if(!octree_ptr_->isNodeOccupied(*it)) continue;
+        computeSurfaceGround();
+    }
+    else
+    {
+        unfiltered_ground_.clear();
+        obstacles_.clear();
 
-        if(isGround(it.getKey()))
-        {
-            pcl::PointXYZI point;
-            point.x = it.getX();
-            point.y = it.getY();
-            point.z = it.getZ();
-            point.intensity = std::numeric_limits<float>::infinity();
-            ground_pcl_.push_back(point);
-        }
-        else if(isObstacle(it.getKey()))
+        const octomap::key_type key_max = (1 << octree_ptr_->getTreeDepth()) - 1;
+        const octomap::OcTreeKey min(0, 0, 0), max(key_max, key_max, key_max);
+
+        for(octomap::OcTree::leaf_iterator it = octree_ptr_->begin(); it != octree_ptr_->end(); ++it)
         {
-            pcl::PointXYZ point;
-            point.x = it.getX();
-            point.y = it.getY();
-            point.z = it.getZ();
-            obstacles_pcl_.push_back(point);
+            if(!octree_ptr_->isNodeOccupied(*it)) continue;
+            classifyOccupiedLeaf(it.getIndexKey(), it.getDepth(), min, max);
         }
+
+        unfiltered_ground_.sort();
+        obstacles_.sort();
+
+        filterInflatedRegionFromGround();
+    }
+
+    if(repair)
+        carryValues(previous, ground_, AllColumns(), dirty_keys_, removed_keys_);
+}
+
+
+/**
+ * Compute ground and obstacles through a multi-level surface map (for the
+ * surface_map mode): same classification and inflation, but per column.
+ */
+void NavigationFunction::computeSurfaceGround()
+{
+    const double res = octree_ptr_->getResolution();
+    surface_map_.build(*octree_ptr_, robot_height_, max_superable_height_, treat_unknown_as_free_);
+    surface_map_.inflate(robot_radius_ / res);
+
+    unfiltered_ground_.clear();
+    ground_.clear();
+    obstacles_.clear();
+    for(size_t i = 0; i < surface_map_.size(); i++)
+        if(surface_map_.isTraversable(i))
+            ground_.push_back(surface_map_.key(i), std::numeric_limits<float>::infinity());
+    ground_.sort();
+    surface_map_.getObstacles(obstacles_);
+
+    ground_surface_.resize(ground_.size());
+    surface_ground_.assign(surface_map_.size(), -1);
+    for(size_t i = 0; i < ground_.size(); i++)
+    {
+        ground_surface_[i] = surface_map_.find(ground_.key(i));
+        surface_ground_[ground_surface_[i]] = i;
+    }
+}
+
+
+/**
+ * Update ground and obstacles for a changed region of the map.
+ *
+ * A voxel is classified by looking only at its own column, so only the
+ * columns of the region are reclassified, and the inflated region is
+ * recomputed only within robot_radius of them. The new voxels are merged
+ * into the sorted sets.
+ */
+void NavigationFunction::updateGround(const OctomapRegion& region)
+{
+    // (the surface map is rebuilt as a whole)
+    if(region.full || (use_surface_map_ && !region.empty))
+    {
+        computeGround();
+        return;
+    }
+    if(region.empty || !octree_ptr_) return;
+
+    const octomap::key_type key_max = (1 << octree_ptr_->getTreeDepth()) - 1;
+    const octomap::OcTreeKey min(region.min[0], region.min[1], 0), max(region.max[0], region.max[1], key_max);
+
+    const InColumns in_region(min, max);
+    unfiltered_ground_.removeIf(in_region);
+    obstacles_.removeIf(in_region);
+
+    for(octomap::OcTree::leaf_bbx_iterator it = octree_ptr_->begin_leafs_bbx(min, max); it != octree_ptr_->end_leafs_bbx(); ++it)
+    {
+        if(!octree_ptr_->isNodeOccupied(*it)) continue;
+        classifyOccupiedLeaf(it.getIndexKey(), it.getDepth(), min, max);
     }
 
+    unfiltered_ground_.sort();
+    obstacles_.sort();
+
     double res = octree_ptr_->getResolution();
 
-    obstacles_octree_ptr_ = pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>::Ptr(new pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>(res));
-    obstacles_octree_ptr_->setInputCloud(obstacles_pcl_.makeShared());
-    obstacles_octree_ptr_->addPointsFromInputCloud();
+    const int r = ceil(robot_radius_ / res);
+    octomap::OcTreeKey inflated_min(min), inflated_max(max);
+    for(int a = 0; a < 2; a++)
+    {
+        inflated_min[a] = std::max(0, min[a] - r);
+        inflated_max[a] = std::min<int>(key_max, max[a] + r);
+    }
+    const InColumns in_inflated(inflated_min, inflated_max);
+
+    // (for the repair, the field moves along to the new ground)
+    const bool repair = navfn_engine_ == "incremental" && field_valid_;
+    MortonVoxelMap<float> previous;
+    if(repair)
+    {
+        savePendingVoxels();
+        for(size_t i = 0; i < ground_.size(); i++)
+            if(in_inflated(ground_.key(i)))
+                previous.push_back(ground_.key(i), ground_.value(i));
+        previous.sort();
+    }
 
-    filterInflatedRegionFromGround();
+    ground_.removeIf(in_inflated);
+    for(size_t i = 0; i < unfiltered_ground_.size(); i++)
+    {
+        octomap::OcTreeKey k = unfiltered_ground_.key(i);
+        if(in_inflated(k) && !isNearObstacle(k))
+            ground_.push_back(k, std::numeric_limits<float>::infinity());
+    }
+    ground_.sort();
 
-    ground_octree_ptr_ = pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>::Ptr(new pcl::octree::OctreePointCloudSearch<pcl::PointXYZI>(res));
-    ground_octree_ptr_->setInputCloud(ground_pcl_.makeShared());
-    ground_octree_ptr_->addPointsFromInputCloud();
+    if(repair)
+        carryValues(previous, ground_, in_inflated, dirty_keys_, removed_keys_);
 }
 
 
 void NavigationFunction::projectGoalPositionToGround()
 {
-    pcl::PointXYZI goal;
-    goal.x = goal_.pose.position.x;
-    goal.y = goal_.pose.position.y;
-    goal.z = goal_.pose.position.z;
-    std::vector<int> pointIdx;
-    std::vector<float> pointDistSq;
-    if(ground_octree_ptr_->nearestKSearch(goal, 1, pointIdx, pointDistSq) < 1)
+    int i = getGoalIndex();
+    if(i == -1)
     {
         ROS_ERROR("Failed to project goal position to ground pcl");
         return;
     }
-    int i = pointIdx[0];
-    goal_.pose.position.x = ground_pcl_[i].x;
-    goal_.pose.position.y = ground_pcl_[i].y;
-    goal_.pose.position.z = ground_pcl_[i].z;
+    octomap::point3d p = octree_ptr_->keyToCoord(ground_.key(i));
+    goal_.pose.position.x = p.x();
+    goal_.pose.position.y = p.y();
+    goal_.pose.position.z = p.z();
 }
 
 
+/**
+ * Publish ground (with the normalized navigation function as intensity) and
+ * obstacles as point clouds; this is the only place where voxel coordinates
+ * are computed.
+ */
 void NavigationFunction::publishGroundCloud()
 {
     if(ground_pub_.getNumSubscribers() > 0)
     {
+        pcl::PointCloud<pcl::PointXYZI> cloud;
+        makeGroundCloud(ground_, ground_.values(), octree_ptr_->getResolution(), cloud);
+        cloud.header.frame_id = frame_id_;
+
         sensor_msgs::PointCloud2 msg;
-        pcl::toROSMsg(ground_pcl_, msg);
+        pcl::toROSMsg(cloud, msg);
+        msg.header.stamp = map_stamp_;
         ground_pub_.publish(msg);
     }
 
     if(obstacles_pub_.getNumSubscribers() > 0)
     {
+        pcl::PointCloud<pcl::PointXYZ> cloud;
+        cloud.header.frame_id = frame_id_;
+        cloud.reserve(obstacles_.size());
+        for(size_t i = 0; i < obstacles_.size(); i++)
+        {
+            octomap::point3d p = octree_ptr_->keyToCoord(obstacles_.key(i));
+            cloud.push_back(pcl::PointXYZ(p.x(), p.y(), p.z()));
+        }
+
         sensor_msgs::PointCloud2 msg;
-        pcl::toROSMsg(obstacles_pcl_, msg);
+        pcl::toROSMsg(cloud, msg);
         obstacles_pub_.publish(msg);
     }
 }
 
 
-int NavigationFunction::getGoalIndex()
+/**
+ * Fill msg with the whole last published navigation function.
+ */
+void NavigationFunction::fillNavigationFunctionKeyframe(octomap_path_planner::NavigationFunctionDelta& msg)
 {
-    // find goal index in ground pcl:
-    std::vector<int> pointIdx;
-    std::vector<float> pointDistSq;
-    pcl::PointXYZI goal;
-    goal.x = goal_.pose.position.x;
-    goal.y = goal_.pose.position.y;
-    goal.z = goal_.pose.position.z;
-    if(ground_octree_ptr_->nearestKSearch(goal, 1, pointIdx, pointDistSq) < 1)
+    msg.header.frame_id = frame_id_;
+    msg.header.stamp = map_stamp_;
+    msg.sequence = navfn_delta_sequence_;
+    msg.keyframe = true;
+    msg.resolution = published_navfn_resolution_;
+    msg.updated_keys.clear();
+    msg.updated_values.clear();
+    msg.removed_keys.clear();
+    msg.updated_keys.reserve(3 * published_navfn_.size());
+    msg.updated_values.reserve(published_navfn_.size());
+    for(NavigationFunctionKeyMap::iterator it = published_navfn_.begin(); it != published_navfn_.end(); ++it)
     {
-        return -1;
+        for(int k = 0; k < 3; k++)
+            msg.updated_keys.push_back(it->first[k]);
+        msg.updated_values.push_back(it->second);
+    }
+}
+
+
+/**
+ * Publish the voxels whose value changed since the last publication.
+ *
+ * Deltas carry unnormalized distances (normalization, done only on the
+ * published ground cloud, would change every value on each update).
+ * A keyframe is sent every navfn_keyframe_interval_ updates, or whenever
+ * the delta would not be smaller than the whole field.
+ */
+void NavigationFunction::publishNavigationFunctionDelta()
+{
+    if(navfn_delta_pub_.getNumSubscribers() == 0)
+    {
+        // nobody is tracking the field: start over with a keyframe next time
+        published_navfn_.clear();
+        return;
+    }
+
+    NavigationFunctionKeyMap current;
+    current.rehash(ground_.size());
+    for(size_t i = 0; i < ground_.size(); i++)
+    {
+        current[ground_.key(i)] = ground_.value(i);
+    }
+
+    octomap_path_planner::NavigationFunctionDelta msg;
+    msg.header.frame_id = frame_id_;
+    msg.header.stamp = map_stamp_;
+    msg.sequence = ++navfn_delta_sequence_;
+    msg.resolution = octree_ptr_->getResolution();
+    msg.keyframe = published_navfn_.empty()
+        || published_navfn_resolution_ != msg.resolution
+        || navfn_updates_since_keyframe_ + 1 >= navfn_keyframe_interval_;
+
+    if(!msg.keyframe)
+    {
+        for(NavigationFunctionKeyMap::iterator it = current.begin(); it != current.end(); ++it)
+        {
+            NavigationFunctionKeyMap::iterator old = published_navfn_.find(it->first);
+            // (inf - inf is NaN, so unreachable voxels that stay unreachable compare equal)
+            if(old == published_navfn_.end() || fabs(old->second - it->second) > navfn_delta_tolerance_)
+            {
+                for(int k = 0; k < 3; k++)
+                    msg.updated_keys.push_back(it->first[k]);
+                msg.updated_values.push_back(it->second);
+            }
+        }
+        for(NavigationFunctionKeyMap::iterator it = published_navfn_.begin(); it != published_navfn_.end(); ++it)
+        {
+            if(current.find(it->first) == current.end())
+            {
+                for(int k = 0; k < 3; k++)
+                    msg.removed_keys.push_back(it->first[k]);
+            }
+        }
+        msg.keyframe = msg.updated_values.size() + msg.removed_keys.size() / 3 >= current.size();
+    }
+
+    published_navfn_.swap(current);
+    published_navfn_resolution_ = msg.resolution;
+
+    if(msg.keyframe)
+    {
+        fillNavigationFunctionKeyframe(msg);
+        navfn_updates_since_keyframe_ = 0;
     }
     else
     {
-        return pointIdx[0];
+        navfn_updates_since_keyframe_++;
     }
+
+    navfn_delta_pub_.publish(msg);
 }
 
 
-void NavigationFunction::getNeighboringGroundPoints(int index, std::vector<int>& neighbors, double search_radius, bool exclude_already_labeled)
+/**
+ * Publish the visualization streams, decimated to viz_lod octree levels
+ * above the voxels: the whole ground and obstacles on ground_viz_out and
+ * obstacles_viz_out, and with viz_tiled the tiles that changed on
+ * viz_tiles_out.
+ */
+void NavigationFunction::publishVisualization()
 {
-    neighbors.clear();
-    std::vector<float> pointDistSq;
-    ground_octree_ptr_->radiusSearch(ground_pcl_[index], search_radius, neighbors, pointDistSq);
+    if(!octree_ptr_) return;
+    const double res = octree_ptr_->getResolution();
+
+    if(ground_viz_pub_.getNumSubscribers() > 0)
+    {
+        pcl::PointCloud<pcl::PointXYZI> cloud;
+        makeLodCloud(ground_, &ground_.values(), res, viz_lod_, 0, ground_.size(), cloud);
+        normalizeIntensity(cloud);
+        cloud.header.frame_id = frame_id_;
+
+        sensor_msgs::PointCloud2 msg;
+        pcl::toROSMsg(cloud, msg);
+        ground_viz_pub_.publish(msg);
+    }
+
+    if(obstacles_viz_pub_.getNumSubscribers() > 0)
+    {
+        pcl::PointCloud<pcl::PointXYZI> cloud;
+        makeLodCloud(obstacles_, 0, res, viz_lod_, 0, obstacles_.size(), cloud);
+        cloud.header.frame_id = frame_id_;
+
+        sensor_msgs::PointCloud2 msg;
+        pcl::toROSMsg(cloud, msg);
+        obstacles_viz_pub_.publish(msg);
+    }
+
+    if(viz_tiled_ && viz_tiles_pub_.getNumSubscribers() > 0)
+    {
+        float max_value = 0.0f;
+        for(size_t i = 0; i < ground_.size(); i++)
+            if(std::isfinite(ground_.value(i))) max_value = std::max(max_value, ground_.value(i));
+
+        visualization_msgs::MarkerArray msg;
+        addVisualizationTiles(ground_, &ground_.values(), max_value + 0.01f, res, viz_lod_, viz_tile_level_, frame_id_, "ground", ground_viz_tiles_, next_viz_tile_id_, msg);
+        addVisualizationTiles(obstacles_, 0, 1.0f, res, viz_lod_, viz_tile_level_, frame_id_, "obstacles", obstacles_viz_tiles_, next_viz_tile_id_, msg);
+        if(!msg.markers.empty())
+            viz_tiles_pub_.publish(msg);
+    }
+}
+
+
+/**
+ * Visualization at viz_rate, if something changed.
+ */
+void NavigationFunction::onVisualizationTimer(const ros::WallTimerEvent& event)
+{
+    if(!viz_dirty_) return;
+    viz_dirty_ = false;
+    publishVisualization();
+}
+
+
+/**
+ * A new tiles subscriber has none of them: send them all again.
+ */
+void NavigationFunction::onVisualizationTilesSubscribe(const ros::SingleSubscriberPublisher& pub)
+{
+    for(VisualizationTileMap::iterator it = ground_viz_tiles_.begin(); it != ground_viz_tiles_.end(); ++it)
+        it->second.sent = false;
+    for(VisualizationTileMap::iterator it = obstacles_viz_tiles_.begin(); it != obstacles_viz_tiles_.end(); ++it)
+        it->second.sent = false;
+    viz_dirty_ = true;
+}
+
+
+/**
+ * Send a keyframe to newly connected subscribers, so they don't have to wait
+ * for the next periodic one.
+ */
+void NavigationFunction::onNavigationFunctionDeltaSubscribe(const ros::SingleSubscriberPublisher& pub)
+{
+    if(published_navfn_.empty()) return;
+
+    octomap_path_planner::NavigationFunctionDelta msg;
+    fillNavigationFunctionKeyframe(msg);
+    pub.publish(msg);
+}
+
+
+int NavigationFunction::getGoalIndex()
+{
+    // find goal index in ground voxels (the nearest one):
+    if(!octree_ptr_ || ground_.empty()) return -1;
+    octomap::OcTreeKey key;
+    if(!octree_ptr_->coordToKeyChecked(goal_.pose.position.x, goal_.pose.position.y, goal_.pose.position.z, key))
+        return -1;
+    return ground_.nearest(key);
+}
+
+
+/**
+ * Ground voxels within search_radius (in meters) of a ground voxel, with
+ * their squared distances in voxels.
+ */
+void NavigationFunction::getNeighboringGroundPoints(int index, std::vector<int>& neighbors, std::vector<float>& sqr_distances, double search_radius)
+{
+    ground_.radiusSearch(ground_.key(index), search_radius / octree_ptr_->getResolution(), neighbors, sqr_distances);
+}
+
+
+bool NavigationFunction::propagate(std::queue<int>& q, const WavefrontBound& bound)
+{
+    if(use_surface_map_)
+        return propagateOnSurfaces(q, bound);
+    return propagateWavefront(ground_, ground_.values(), q, octree_ptr_->getResolution(), neighborhood_r2_, ground_voxel_connectivity_, bound);
+}
+
+
+/**
+ * Wavefront on the surface map: neighbors are the surfaces within
+ * ground_voxel_connectivity in the xy plane, and no more than
+ * max_superable_height above or below.
+ */
+bool NavigationFunction::propagateOnSurfaces(std::queue<int>& q, const WavefrontBound& bound)
+{
+    const double res = octree_ptr_->getResolution();
+    const int max_step = floor(max_superable_height_ / res + 1e-6);
+    std::vector<float>& values = ground_.values();
+    std::vector<int> neighbors;
+    std::vector<float> sqr_distances;
+    for(size_t expansions = 0; !q.empty(); expansions++)
+    {
+        int i = q.front();
+        if(bound.reached(values, i, expansions)) return false;
+        q.pop();
+
+        surface_map_.neighbors(ground_surface_[i], ground_voxel_connectivity_, max_step, neighbors, sqr_distances);
+        for(size_t n = 0; n < neighbors.size(); n++)
+        {
+            int j = surface_ground_[neighbors[n]];
+            if(j == -1 || std::isfinite(values[j])) continue;
+            values[j] = values[i] + sqrt(sqr_distances[n]) * res;
+            q.push(j);
+        }
+    }
+    return true;
 }
 
 
+/**
+ * Ground neighbors of ground voxel i, with their distances in meters, as
+ * seen by the wavefront (on the surface map, or the voxel neighborhood).
+ */
+void NavigationFunction::getGroundNeighbors(size_t i, std::vector<int>& indices, std::vector<float>& lengths) const
+{
+    const double res = octree_ptr_->getResolution();
+    if(!use_surface_map_)
+    {
+        collectNeighbors(ground_, i, res, neighborhood_r2_, ground_voxel_connectivity_, indices, lengths);
+        return;
+    }
+
+    const int max_step = floor(max_superable_height_ / res + 1e-6);
+    surface_map_.neighbors(ground_surface_[i], ground_voxel_connectivity_, max_step, indices, lengths);
+    size_t k = 0;
+    for(size_t n = 0; n < indices.size(); n++)
+    {
+        const int j = surface_ground_[indices[n]];
+        if(j == -1) continue;
+        indices[k] = j;
+        lengths[k] = sqrt(lengths[n]) * res;
+        k++;
+    }
+    indices.resize(k);
+    lengths.resize(k);
+}
+
+
+void GroundNeighbors::operator()(size_t i, std::vector<int>& indices, std::vector<float>& lengths) const
+{
+    navfn.getGroundNeighbors(i, indices, lengths);
+}
+
+
+/**
+ * Compute the navigation function to the goal.
+ *
+ * With anytime, the wavefront stops once the robot's voxel plus
+ * anytime_margin is labeled and that partial field is published right
+ * away; the rest is labeled in time slices by onCompleteWavefront(), until
+ * a new goal or map restarts the computation here.
+ *
+ * With navfn_engine parallel, the field is solved instead by
+ * ParallelRelaxation on a pool of navfn_threads threads (created once),
+ * in tiles of 4096 ground voxels and bands of 16 voxels: distances are
+ * then those of the shortest paths over the neighborhood (a wavefront
+ * keeps the first path reaching a voxel, which can be slightly longer).
+ *
+ * With navfn_engine incremental, the field has the same shortest path
+ * distances, but is repaired from the previous one, see
+ * repairDistanceTransform().
+ */
 void NavigationFunction::computeDistanceTransform()
 {
-    if(ground_pcl_.size() == 0)
+    num_reachable_ = 0;
+    pending_wavefront_ = std::queue<int>();
+    completion_timer_.stop();
+
+    if(ground_.empty())
     {
-        ROS_INFO("skip computing distance transform because ground_pcl_ is empty");
+        ROS_INFO("skip computing distance transform because ground is empty");
+        field_valid_ = false;
         return;
     }
 
@@ -462,45 +1844,205 @@ void NavigationFunction::computeDistanceTransform()
     if(goal_idx == -1)
     {
         ROS_ERROR("unable to find goal in ground pcl");
+        field_valid_ = false;
+        return;
+    }
+
+    if(navfn_engine_ == "incremental")
+    {
+        repairDistanceTransform(goal_idx);
         return;
     }
 
-    double search_radius = ground_voxel_connectivity_ * octree_ptr_->getResolution();
+    const double res = octree_ptr_->getResolution();
 
-    // distance to goal is zero (stored in the intensity channel):
-    ground_pcl_[goal_idx].intensity = 0.0;
+    // values hold the field of the previous run:
+    ground_.fill(std::numeric_limits<float>::infinity());
 
-    std::queue<int> q;
-    q.push(goal_idx);
-    while(!q.empty())
+    // distance to goal is zero:
+    ground_.value(goal_idx) = 0.0;
+
+    if(navfn_engine_ == "parallel")
     {
-        int i = q.front();
-        q.pop();
+        GroundNeighbors neighbors(*this);
+        ParallelRelaxation<GroundNeighbors> relaxation(neighbors, ground_.size(), ground_.values(), 16 * res);
+        navfn_rounds_ = relaxation.run(goal_idx, *navfn_pool_);
+    }
+    else
+    {
+        WavefrontBound bound;
+        if(anytime_)
+        {
+            bound.stop_idx = getRobotIndex();
+            bound.stop_margin = anytime_margin_;
+        }
 
-        std::vector<int> neighbors;
-        getNeighboringGroundPoints(i, neighbors, search_radius, true);
+        // (what a bounded wavefront leaves queued is completed later)
+        pending_wavefront_.push(goal_idx);
+        if(!propagate(pending_wavefront_, bound))
+            completion_timer_.start();
+    }
 
-        for(std::vector<int>::iterator it = neighbors.begin(); it != neighbors.end(); it++)
-        {
-            int j = *it;
+    publishNavigationFunction();
+}
 
-            // intensity value are initially set to infinity.
-            // if i is finite it means it has already been labeled.
-            if(std::isfinite(ground_pcl_[j].intensity)) continue;
 
-            // otherwise, label it:
-            ground_pcl_[j].intensity = ground_pcl_[i].intensity +
-                dist(ground_pcl_[j], ground_pcl_[i]);
+/**
+ * Navigation function by the incremental engine: if the field in ground_
+ * is for the same goal voxel, only the voxels made inconsistent by the
+ * ground changes since are expanded again (LPA*), those nearest to the
+ * robot first, otherwise the field is computed anew the same way, from
+ * the goal alone.
+ *
+ * With anytime, the repair stops as in D* Lite once the value of the
+ * robot's voxel is final, and that of the voxels up to anytime_margin
+ * beyond it (on the way to the robot); the field is published right away,
+ * with the values of the previous field elsewhere, and the repair is
+ * completed in time slices by onCompleteWavefront().
+ */
+void NavigationFunction::repairDistanceTransform(int goal_idx)
+{
+    const double res = octree_ptr_->getResolution();
+    const octomap::OcTreeKey goal_key = ground_.key(goal_idx);
+    const int robot_idx = getRobotIndex();
+    const RobotDistance heuristic(ground_, robot_idx, res);
+    const size_t expansions = relaxation_.expansions();
 
-            // continue exploring neighbours:
-            q.push(j);
+    if(field_valid_ && goal_key == field_goal_key_ && res == field_resolution_)
+    {
+        // voxels next to a removed one are rechecked, within the reach of
+        // the neighborhood (including the steps on the surface map):
+        double radius = ground_voxel_connectivity_;
+        if(use_surface_map_)
+        {
+            const int max_step = floor(max_superable_height_ / res + 1e-6);
+            radius = sqrt(radius * radius + max_step * max_step);
+        }
+        std::vector<int> dirty, indices;
+        std::vector<float> sqr_distances;
+        for(size_t k = 0; k < dirty_keys_.size(); k++)
+        {
+            const int i = ground_.find(dirty_keys_[k]);
+            if(i != -1) dirty.push_back(i);
         }
+        for(size_t k = 0; k < removed_keys_.size(); k++)
+        {
+            ground_.radiusSearch(removed_keys_[k], radius, indices, sqr_distances);
+            dirty.insert(dirty.end(), indices.begin(), indices.end());
+        }
+        relaxation_.update(goal_idx, dirty, heuristic);
+    }
+    else
+    {
+        relaxation_.reset(goal_idx, heuristic);
+        field_goal_key_ = goal_key;
+        field_resolution_ = res;
+        field_valid_ = true;
+    }
+    dirty_keys_.clear();
+    removed_keys_.clear();
+
+    if(anytime_ && robot_idx != -1)
+        relaxation_.run(robot_idx, anytime_margin_);
+    else
+        relaxation_.run();
+    navfn_expansions_ = relaxation_.expansions() - expansions;
+    if(!relaxation_.done())
+        completion_timer_.start();
+
+    publishNavigationFunction();
+}
+
+
+/**
+ * Before the ground voxels change, keep the keys of those the repair left
+ * pending, to repair them after.
+ */
+void NavigationFunction::savePendingVoxels()
+{
+    std::vector<int> pending;
+    relaxation_.takePending(pending);
+    for(size_t k = 0; k < pending.size(); k++)
+        dirty_keys_.push_back(ground_.key(pending[k]));
+}
+
+
+/**
+ * Continue a partial wavefront (or repair) for anytime_time_slice, and
+ * publish the field once complete.
+ */
+void NavigationFunction::onCompleteWavefront(const ros::WallTimerEvent& event)
+{
+    const bool repair = navfn_engine_ == "incremental";
+    if((repair ? relaxation_.done() : pending_wavefront_.empty()) || !octree_ptr_)
+    {
+        completion_timer_.stop();
+        return;
     }
 
-    //smoothIntensity(search_radius);
-    normalizeIntensity();
+    const ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration(anytime_time_slice_);
+    WavefrontBound bound;
+    bound.max_expansions = 1024;
+    bool complete = false;
+    while(!complete && ros::WallTime::now() < deadline)
+        complete = repair ? relaxation_.run(-1, 0.0f, bound.max_expansions) : propagate(pending_wavefront_, bound);
+    if(!complete) return;
+
+    completion_timer_.stop();
+    publishNavigationFunction();
+}
+
+
+void NavigationFunction::publishNavigationFunction()
+{
+    num_reachable_ = 0;
+    for(size_t i = 0; i < ground_.size(); i++)
+        if(std::isfinite(ground_.value(i))) num_reachable_++;
 
+    publishNavigationFunctionDelta();
     publishGroundCloud();
+    viz_dirty_ = true;
+}
+
+
+/**
+ * Index of the ground voxel nearest to the robot, or -1.
+ */
+int NavigationFunction::getRobotIndex()
+{
+    try
+    {
+        geometry_msgs::PoseStamped robot_pose_local;
+        robot_pose_local.header.frame_id = robot_frame_id_;
+        robot_pose_local.pose.orientation.w = 1.0;
+        tf_listener_.transformPose(frame_id_, robot_pose_local, robot_pose_);
+    }
+    catch(tf::TransformException& ex)
+    {
+        ROS_WARN("Failed to lookup robot position, computing the whole navigation function: %s", ex.what());
+        return -1;
+    }
+
+    octomap::OcTreeKey key;
+    if(!octree_ptr_->coordToKeyChecked(robot_pose_.pose.position.x, robot_pose_.pose.position.y, robot_pose_.pose.position.z, key))
+        return -1;
+    return ground_.nearest(key);
+}
+
+
+void NavigationFunction::publishTiming(StageTiming& timing, const ros::Time& map_stamp)
+{
+    timing.setMapStamp(map_stamp);
+    timing.add("ground voxels", ground_.size());
+    timing.add("obstacle voxels", obstacles_.size());
+    timing.add("reachable voxels", num_reachable_);
+    if(navfn_engine_ == "parallel")
+        timing.add("navfn rounds", navfn_rounds_);
+    if(navfn_engine_ == "incremental")
+        timing.add("navfn expansions", navfn_expansions_);
+    timing.publish(timing_pub_);
+    tracer_.add(timing, map_stamp, goal_.header.stamp);
+    tracer_.flush();
 }
 
 
@@ -508,14 +2050,14 @@ double NavigationFunction::getAverageIntensity(int index, double search_radius)
 {
     std::vector<int> pointIdx;
     std::vector<float> pointDistSq;
-    ground_octree_ptr_->radiusSearch(ground_pcl_[index], search_radius, pointIdx, pointDistSq);
+    getNeighboringGroundPoints(index, pointIdx, pointDistSq, search_radius);
 
     if(pointIdx.size() == 0) return std::numeric_limits<float>::infinity();
 
     double i = 0.0;
     for(std::vector<int>::iterator it = pointIdx.begin(); it != pointIdx.end(); ++it)
     {
-        i += ground_pcl_[*it].intensity;
+        i += ground_.value(*it);
     }
     i /= (double)pointIdx.size();
     return i;
@@ -525,39 +2067,86 @@ double NavigationFunction::getAverageIntensity(int index, double search_radius)
 void NavigationFunction::smoothIntensity(double search_radius)
 {
     std::vector<double> smoothed_intensity;
-    smoothed_intensity.resize(ground_pcl_.size());
-    for(size_t i = 0; i < ground_pcl_.size(); i++)
+    smoothed_intensity.resize(ground_.size());
+    for(size_t i = 0; i < ground_.size(); i++)
     {
         smoothed_intensity[i] = getAverageIntensity(i, search_radius);
     }
-    for(size_t i = 0; i < ground_pcl_.size(); i++)
+    for(size_t i = 0; i < ground_.size(); i++)
     {
-        ground_pcl_[i] = smoothed_intensity[i];
+        ground_.value(i) = smoothed_intensity[i];
     }
 }
 
 
-void NavigationFunction::normalizeIntensity()
+/**
+ * Give the navigation function server a snapshot of the new ground.
+ */
+void NavigationFunction::updateClientGround(const ros::Time& map_stamp)
 {
-    float imin = std::numeric_limits<float>::infinity();
-    float imax = -std::numeric_limits<float>::infinity();
-    for(pcl::PointCloud<pcl::PointXYZI>::iterator it = ground_pcl_.begin(); it != ground_pcl_.end(); ++it)
+    if(!server_ || !octree_ptr_) return;
+
+    boost::shared_ptr<GroundSnapshot> snapshot(new GroundSnapshot);
+    snapshot->ground = ground_;
+    snapshot->resolution = octree_ptr_->getResolution();
+    snapshot->stamp = map_stamp;
+    server_->setGround(snapshot);
+}
+
+
+bool NavigationFunction::onComputeNavigationFunction(octomap_path_planner::ComputeNavigationFunction::Request& req, octomap_path_planner::ComputeNavigationFunction::Response& res)
+{
+    res.accepted = false;
+
+    geometry_msgs::PointStamped goal;
+    try
     {
-        if(!std::isfinite(it->intensity)) continue;
-        imin = fmin(imin, it->intensity);
-        imax = fmax(imax, it->intensity);
+        tf_listener_.transformPoint(frame_id_, req.goal, goal);
     }
-    const float eps = 0.01;
-    float d = imax - imin + eps;
-    for(pcl::PointCloud<pcl::PointXYZI>::iterator it = ground_pcl_.begin(); it != ground_pcl_.end(); ++it)
+    catch(tf::TransformException& ex)
     {
-        if(std::isfinite(it->intensity))
-            it->intensity = (it->intensity - imin) / d;
-        else
-            it->intensity = 1.0;
+        ROS_ERROR("Failed to transform goal of client '%s': %s", req.client.c_str(), ex.what());
+        return true;
     }
+
+    octomap::point3d reprojected;
+    if(!server_->request(req.client, octomap::point3d(goal.point.x, goal.point.y, goal.point.z), reprojected, res.topic))
+        return true;
+
+    res.accepted = true;
+    res.reprojected_goal.header = goal.header;
+    res.reprojected_goal.point.x = reprojected.x();
+    res.reprojected_goal.point.y = reprojected.y();
+    res.reprojected_goal.point.z = reprojected.z();
+    ROS_INFO("navigation function of client '%s' to (%f, %f, %f) on %s", req.client.c_str(),
+            reprojected.x(), reprojected.y(), reprojected.z(), res.topic.c_str());
+    return true;
+}
+
+
+#ifdef OCTOMAP_PATH_PLANNER_NODELET
+
+namespace octomap_path_planner
+{
+    /**
+     * Nodelet version, sharing decoded maps with the other planner nodelets
+     * in the same manager through OctomapStore.
+     */
+    class NavigationFunctionNodelet : public nodelet::Nodelet
+    {
+    protected:
+        boost::shared_ptr<NavigationFunction> navfn_;
+
+        virtual void onInit()
+        {
+            navfn_.reset(new NavigationFunction(getNodeHandle(), getPrivateNodeHandle()));
+        }
+    };
 }
 
+PLUGINLIB_EXPORT_CLASS(octomap_path_planner::NavigationFunctionNodelet, nodelet::Nodelet)
+
+#else
 
 int main(int argc, char **argv)
 {
@@ -569,3 +2158,4 @@ int main(int argc, char **argv)
     return 0;
 }
 
+#endif // OCTOMAP_PATH_PLANNER_NODELET
@@ -4,11 +4,20 @@
 #include <vector>
 #include <queue>
 #include <cstdlib>
+#include <cstdio>
+#include <new>
 #include <cassert>
 #include <limits>
+#include <functional>
 
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/random.hpp>
 #include <boost/random/uniform_real.hpp>
 #include <boost/random/normal_distribution.hpp>
@@ -17,6 +26,8 @@
 #include <geometry_msgs/Point.h>
 #include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/Vector3.h>
+#include <std_msgs/Float32MultiArray.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <tf/transform_listener.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <nav_msgs/Path.h>
@@ -31,275 +42,1693 @@
 #include <pcl/point_types.h>
 #include <pcl/features/normal_3d.h>
 #include <pcl/features/boundary.h>
-#include <pcl/segmentation/extract_clusters.h>
-#include <pcl/filters/extract_indices.h>
 #include <pcl/filters/passthrough.h>
+#include <pcl/common/io.h>
 
 #include <pcl_conversions/pcl_conversions.h>
 
+#ifdef OCTOMAP_PATH_PLANNER_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
+#include <octomap_path_planner/octomap_store.h>
+#include <octomap_path_planner/incremental_octomap.h>
+#include <octomap_path_planner/neighborhood.h>
+#include <octomap_path_planner/stage_timing.h>
+#include <octomap_path_planner/tracer.h>
+#include <octomap_path_planner/worker_pool.h>
+
+#if __cplusplus >= 201103L
+#define NBV_THROW_BAD_ALLOC
+#define NBV_NOTHROW noexcept
+#define NBV_THREAD_LOCAL thread_local
+#else
+#define NBV_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define NBV_NOTHROW throw()
+#define NBV_THREAD_LOCAL __thread
+#endif
+
+/**
+ * Heap allocation counters, used to report the allocations made by each
+ * next best view computation. Replacing operator new costs every
+ * allocation of the process, so they are only counted when built with
+ * the NBV_COUNT_ALLOCATIONS CMake option, and only in the standalone node
+ * (a nodelet can't replace operator new). They are per thread, so that
+ * allocations of other threads (roscpp's) are not charged to the
+ * computation; the frontier threads add theirs to frontier_thread_*
+ * after each block.
+ */
+static NBV_THREAD_LOCAL size_t thread_allocations = 0;
+static NBV_THREAD_LOCAL size_t thread_allocated_bytes = 0;
+static boost::atomic<size_t> frontier_thread_allocations(0);
+static boost::atomic<size_t> frontier_thread_allocated_bytes(0);
+
+#ifdef NBV_COUNT_ALLOCATIONS
+
+void * operator new(std::size_t size) NBV_THROW_BAD_ALLOC
+{
+    thread_allocations++;
+    thread_allocated_bytes += size;
+    void *p = std::malloc(size ? size : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) NBV_NOTHROW
+{
+    std::free(p);
+}
+
+#endif // NBV_COUNT_ALLOCATIONS
+
+
+/**
+ * Work of a frontier thread: take blocks of [0, n) until there are none
+ * left, and add the allocations made (if counted) to those of the
+ * computation.
+ */
+static void runBlocks(const boost::function<void (size_t, size_t)>& work, size_t n, size_t block_size, boost::atomic<size_t>& next)
+{
+#ifdef NBV_COUNT_ALLOCATIONS
+    const size_t allocations = thread_allocations, bytes = thread_allocated_bytes;
+#endif
+    for(size_t begin = block_size * next++; begin < n; begin = block_size * next++)
+        work(begin, std::min(n, begin + block_size));
+#ifdef NBV_COUNT_ALLOCATIONS
+    frontier_thread_allocations.fetch_add(thread_allocations - allocations, boost::memory_order_relaxed);
+    frontier_thread_allocated_bytes.fetch_add(thread_allocated_bytes - bytes, boost::memory_order_relaxed);
+#endif
+}
+
+
+/**
+ * Wall time and heap allocations of the stages of a computation.
+ */
+class StageStats : public StageTiming
+{
+public:
+    StageStats(const std::string& name)
+        : StageTiming(name),
+          start_allocations_(countedAllocations()), start_bytes_(countedAllocatedBytes())
+    {
+    }
+
+    void mark(const char *stage)
+    {
+        ros::WallTime last = last_;
+        StageTiming::mark(stage);
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s%s %.1f", stages_.empty() ? "" : ", ", stage, (last_ - last).toSec() * 1e3);
+        stages_ += buf;
+    }
+
+    // (of the thread the stats belong to, and of the frontier threads)
+    size_t allocations() const {return countedAllocations() - start_allocations_;}
+    size_t allocatedBytes() const {return countedAllocatedBytes() - start_bytes_;}
+    const std::string& stages() const {return stages_;}
+
+protected:
+    static size_t countedAllocations() {return thread_allocations + frontier_thread_allocations;}
+    static size_t countedAllocatedBytes() {return thread_allocated_bytes + frontier_thread_allocated_bytes;}
+
+    size_t start_allocations_;
+    size_t start_bytes_;
+    std::string stages_;
+};
+
+
 class NextBestView
 {
 public:
-    NextBestView();
+    NextBestView(const ros::NodeHandle& nh = ros::NodeHandle(), const ros::NodeHandle& private_nh = ros::NodeHandle("~"));
     ~NextBestView();
-    bool isNearVoid(const octomap::point3d& p1, const unsigned char depth, const double res);
-    void computeNextBestViews();
+    octomap::OcTreeNode * findLeaf(const octomap::OcTreeKey& key, octomap::OcTreeKey& leaf_key, unsigned& leaf_depth);
+    void addNeighborLeafs(const octomap::OcTreeKey& key, unsigned depth, octomap::KeySet& leafs);
+    size_t updateFrontier();
+    size_t updateFrontier(const octomap::KeySet& old_leafs, const OctomapRegion& region);
+    void estimateNormals(const pcl::PointCloud<pcl::PointXYZ>& cloud, const pcl::KdTreeFLANN<pcl::PointXYZ>& tree, pcl::PointCloud<pcl::Normal>& normals, std::vector<char>& valid);
+    void extractClusters(const pcl::PointCloud<pcl::PointXYZ>& cloud, const pcl::PointCloud<pcl::Normal>& normals, const std::vector<char>& valid, const pcl::KdTreeFLANN<pcl::PointXYZ>& tree, std::vector<pcl::PointIndices>& clusters);
+    bool computeNextBestViews(StageStats& stats);
+    bool isCancelled() const;
+    bool hasPendingMap();
+    bool applyMaps(const octomap_msgs::Octomap::ConstPtr& map, const std::vector<octomap_path_planner::OctomapUpdate::ConstPtr>& updates);
+    void processMap(const octomap_msgs::Octomap::ConstPtr& map, const std::vector<octomap_path_planner::OctomapUpdate::ConstPtr>& updates);
+    void requestFullMap();
+    void worker();
     void onOctomap(const octomap_msgs::Octomap::ConstPtr& m);
+    void onOctomapUpdate(const octomap_path_planner::OctomapUpdate::ConstPtr& m);
 protected:
+    struct LeafState
+    {
+        unsigned char depth;
+        bool occupied;
+
+        bool operator==(const LeafState& o) const {return depth == o.depth && occupied == o.occupied;}
+        bool operator!=(const LeafState& o) const {return !(*this == o);}
+    };
+
+    // leafs are identified by their index (lower corner) key, which
+    // together with the depth identifies also pruned leafs:
+    typedef boost::unordered_map<octomap::OcTreeKey, LeafState, octomap::OcTreeKey::KeyHash> LeafStateMap;
+    typedef std::vector<std::pair<octomap::OcTreeKey, LeafState> > LeafList;
+
+    // known volume (in voxels) of each coarse cell:
+    typedef boost::unordered_map<octomap::OcTreeKey, uint64_t, octomap::OcTreeKey::KeyHash> CoarseVolumeMap;
+
+    struct KeyOffset
+    {
+        int d[3];
+    };
+
+    /**
+     * Small cache of the last leafs found, as neighbor lookups of nearby
+     * voxels mostly hit the same few (often pruned) leafs.
+     */
+    class LeafCache
+    {
+    public:
+        static const int size = 4;
+
+        LeafCache() : next_(0), used_(0) {}
+
+        bool contains(const octomap::OcTreeKey& k) const
+        {
+            for(int i = 0; i < used_; i++)
+            {
+                // (unsigned wrap-around also rejects keys below the leaf)
+                if(unsigned(k[0] - key_[i][0]) < span_[i] && unsigned(k[1] - key_[i][1]) < span_[i] && unsigned(k[2] - key_[i][2]) < span_[i])
+                    return true;
+            }
+            return false;
+        }
+
+        void insert(const octomap::OcTreeKey& leaf_key, unsigned span)
+        {
+            key_[next_] = leaf_key;
+            span_[next_] = span;
+            next_ = (next_ + 1) % size;
+            if(used_ < size) used_++;
+        }
+
+    protected:
+        octomap::OcTreeKey key_[size];
+        unsigned span_[size];
+        int next_;
+        int used_;
+    };
+
+    /**
+     * Frontier test of one leaf, for Neighborhood::forEach(): stops at the
+     * first neighbor in unknown space (or outside the key range).
+     */
+    struct VoidProbe
+    {
+        NextBestView& nbv;
+        LeafCache& cache;
+        const octomap::OcTreeKey& key;
+        const unsigned tree_depth;
+        const int s;
+
+        VoidProbe(NextBestView& n, LeafCache& c, const octomap::OcTreeKey& k, unsigned depth)
+            : nbv(n), cache(c), key(k), tree_depth(n.octree_ptr_->getTreeDepth()), s(1 << (tree_depth - depth)) {}
+
+        bool operator()(int dx, int dy, int dz, float length)
+        {
+            const int d[3] = {dx, dy, dz};
+            octomap::OcTreeKey k, leaf_key;
+            unsigned leaf_depth;
+            for(int i = 0; i < 3; i++)
+            {
+                int c = d[i] < 0 ? key[i] - 1 : d[i] > 0 ? key[i] + s : key[i] + s / 2;
+                if(c < 0 || c > 0xFFFF) return false;
+                k[i] = c;
+            }
+            if(cache.contains(k)) return true;
+            if(!nbv.findLeaf(k, leaf_key, leaf_depth)) return false;
+            cache.insert(leaf_key, 1 << (tree_depth - leaf_depth));
+            return true;
+        }
+    };
+
+    static bool compareLeafKeys(const LeafList::value_type& a, const LeafList::value_type& b);
+    /**
+     * Concurrent union-find: roots only ever get linked to a root with a
+     * lower index, using CAS, and finds do path halving.
+     */
+    class DisjointSets
+    {
+    public:
+        DisjointSets(size_t n) : parent_(new boost::atomic<int>[n])
+        {
+            for(size_t i = 0; i < n; i++) parent_[i] = i;
+        }
+
+        int find(int x)
+        {
+            while(true)
+            {
+                int p = parent_[x].load(boost::memory_order_relaxed);
+                if(p == x) return x;
+                int gp = parent_[p].load(boost::memory_order_relaxed);
+                if(p != gp) parent_[x].compare_exchange_weak(p, gp, boost::memory_order_relaxed);
+                x = gp;
+            }
+        }
+
+        void unite(int a, int b)
+        {
+            while(true)
+            {
+                a = find(a);
+                b = find(b);
+                if(a == b) return;
+                if(a < b) std::swap(a, b);
+                int expected = a;
+                if(parent_[a].compare_exchange_strong(expected, b)) return;
+            }
+        }
+
+    protected:
+        boost::scoped_array<boost::atomic<int> > parent_;
+    };
+
+    typedef boost::unordered_map<octomap::OcTreeKey, int, octomap::OcTreeKey::KeyHash> KeyIndexMap;
+
+    // rays are cached by origin cell (at ray_cache_depth) and quantized
+    // world direction, so they are shared between nearby candidates:
+    struct RayCacheKey
+    {
+        octomap::OcTreeKey origin;
+        int azimuth;
+        int elevation;
+
+        bool operator==(const RayCacheKey& o) const {return origin == o.origin && azimuth == o.azimuth && elevation == o.elevation;}
+    };
+
+    struct RayCacheKeyHash
+    {
+        size_t operator()(const RayCacheKey& k) const
+        {
+            return octomap::OcTreeKey::KeyHash()(k.origin) + 1447 * k.azimuth + 345637 * k.elevation;
+        }
+    };
+
+    typedef boost::unordered_map<RayCacheKey, std::vector<octomap::OcTreeKey>, RayCacheKeyHash> RayCache;
+
+    bool isNearVoid(const octomap::OcTreeKey& key, unsigned depth, LeafCache& cache);
+    void checkFrontierLeafs(const LeafList& leafs, size_t begin, size_t end, std::vector<char>& is_frontier);
+    void checkFrontierLeafs(const LeafList& leafs, std::vector<char>& is_frontier);
+    void forEachBlock(size_t n, size_t min_block_size, const boost::function<void (size_t, size_t)>& work);
+    bool isCoarseCellKnown(const octomap::OcTreeKey& cell_key, const CoarseVolumeMap& volume);
+    void computeCoarseCandidates(const CoarseVolumeMap& volume, const octomap::KeySet& cells, octomap::KeySet& candidates);
+    void addCoarseVolume(const octomap::OcTreeKey& key, unsigned depth, bool add);
+    size_t recheckFrontier(const std::vector<std::pair<octomap::OcTreeKey, unsigned> >& changed, const std::vector<std::pair<octomap::OcTreeKey, unsigned> >& removed);
+    bool isInCoarseCandidate(const LeafList::value_type& leaf, const octomap::KeySet& candidates) const;
+    void collectCoarseCandidateLeafs(LeafList& leafs);
+    void uniteAdjacentLeafs(const LeafList& leafs, const KeyIndexMap& index, bool has_pruned_leafs, const pcl::PointCloud<pcl::Normal>& normals, const std::vector<char>& valid, size_t begin, size_t end, DisjointSets& sets);
+    void extractVoxelClusters(const LeafList& leafs, const pcl::PointCloud<pcl::Normal>& normals, const std::vector<char>& valid, std::vector<pcl::PointIndices>& clusters);
+    void selectLargestClusters(std::vector<pcl::PointIndices>& clusters);
+    void castRay(const octomap::point3d& origin, const octomap::point3d& direction, octomap::KeyRay& ray, std::vector<octomap::OcTreeKey>& unknown);
+    void scoreCandidates(const std::vector<geometry_msgs::Pose>& poses, const std::vector<size_t>& order, size_t begin, size_t end, std::vector<double>& gains);
+    void scoreCandidates(const std::vector<geometry_msgs::Pose>& poses, std::vector<double>& gains);
+
     std::string frame_id_;
     std::string robot_frame_id_;
     int num_clusters_;
-    int min_computation_interval_;
+    double min_computation_interval_;
+    double min_frontier_change_;
     double normal_search_radius_;
     int min_pts_per_cluster_;
     double eps_angle_;
     double tolerance_;
     double boundary_angle_threshold_;
+    std::string clustering_;
+    bool cluster_merge_normals_;
+    int frontier_depth_;
+    int frontier_coarse_depth_;
+    int frontier_neighborhood_;
+    int frontier_threads_;
+    boost::scoped_ptr<WorkerPool> frontier_pool_;
+    std::vector<KeyOffset> neighbor_offsets_;
+    bool score_candidates_;
+    double sensor_horizontal_fov_;
+    double sensor_vertical_fov_;
+    int sensor_horizontal_rays_;
+    int sensor_vertical_rays_;
+    double sensor_range_;
+    int ray_cache_depth_;
+    double min_information_gain_;
     ros::NodeHandle nh_;
     ros::NodeHandle private_node_handle_;
-    octomap::OcTree *octree_ptr_;
+    OcTreeConstPtr octree_ptr_;
+    bool incremental_updates_;
+    IncrementalOctomap incremental_map_;
+    LeafStateMap leaf_state_;
+    CoarseVolumeMap coarse_volume_;
+    octomap::KeySet frontier_;
     ros::Time last_computation_time_;
+    ros::Time map_stamp_;
+    size_t frontier_changes_;
+    bool have_results_;
+    // the frontier changed, but too soon after the last computation
+    bool deferred_;
+    boost::thread worker_thread_;
+    boost::mutex map_mutex_;
+    boost::condition_variable map_cond_;
+    octomap_msgs::Octomap::ConstPtr pending_map_;
+    std::vector<octomap_path_planner::OctomapUpdate::ConstPtr> pending_updates_;
+    bool shutdown_;
+    boost::atomic<bool> computing_;
+    boost::atomic<bool> cancel_;
     ros::Publisher void_frontier_pub_;
     ros::Publisher posearray_pub_;
+    ros::Publisher gains_pub_;
+    ros::Publisher timing_pub_;
+    Tracer tracer_;
     std::vector<ros::Publisher> cluster_pub_;
     ros::Subscriber octree_sub_;
+    ros::Subscriber octree_update_sub_;
 };
 
 
-NextBestView::NextBestView() :
+NextBestView::NextBestView(const ros::NodeHandle& nh, const ros::NodeHandle& private_nh) :
     frame_id_("/map"),
     robot_frame_id_("/base_link"),
     num_clusters_(3),
-    min_computation_interval_(5 /*seconds*/),
+    min_computation_interval_(1.0 /*seconds*/),
+    min_frontier_change_(0.05),
     normal_search_radius_(0.4),
     min_pts_per_cluster_(5),
     eps_angle_(0.25),
     tolerance_(0.3),
     boundary_angle_threshold_(2.5),
-    private_node_handle_("~"),
-    octree_ptr_(0L)
+    clustering_("euclidean"),
+    cluster_merge_normals_(true),
+    frontier_depth_(16),
+    frontier_coarse_depth_(0),
+    frontier_neighborhood_(26),
+    frontier_threads_(boost::thread::hardware_concurrency()),
+    score_candidates_(true),
+    sensor_horizontal_fov_(1.0),
+    sensor_vertical_fov_(0.75),
+    sensor_horizontal_rays_(16),
+    sensor_vertical_rays_(12),
+    sensor_range_(3.0),
+    ray_cache_depth_(14),
+    min_information_gain_(0.0),
+    nh_(nh),
+    private_node_handle_(private_nh),
+    incremental_updates_(false),
+    frontier_changes_(0),
+    have_results_(false),
+    deferred_(false),
+    shutdown_(false),
+    computing_(false),
+    cancel_(false)
 {
     private_node_handle_.param("frame_id", frame_id_, frame_id_);
     private_node_handle_.param("robot_frame_id", robot_frame_id_, robot_frame_id_);
     private_node_handle_.param("num_clusters", num_clusters_, num_clusters_);
     private_node_handle_.param("min_computation_interval", min_computation_interval_, min_computation_interval_);
+    private_node_handle_.param("min_frontier_change", min_frontier_change_, min_frontier_change_);
     private_node_handle_.param("normal_search_radius", normal_search_radius_, normal_search_radius_);
     private_node_handle_.param("min_pts_per_cluster", min_pts_per_cluster_, min_pts_per_cluster_);
     private_node_handle_.param("eps_angle", eps_angle_, eps_angle_);
     private_node_handle_.param("tolerance", tolerance_, tolerance_);
     private_node_handle_.param("boundary_angle_threshold", boundary_angle_threshold_, boundary_angle_threshold_);
+    private_node_handle_.param("clustering", clustering_, clustering_);
+    private_node_handle_.param("cluster_merge_normals", cluster_merge_normals_, cluster_merge_normals_);
+    private_node_handle_.param("frontier_depth", frontier_depth_, frontier_depth_);
+    private_node_handle_.param("frontier_coarse_depth", frontier_coarse_depth_, frontier_coarse_depth_);
+    private_node_handle_.param("frontier_neighborhood", frontier_neighborhood_, frontier_neighborhood_);
+    private_node_handle_.param("frontier_threads", frontier_threads_, frontier_threads_);
+    private_node_handle_.param("score_candidates", score_candidates_, score_candidates_);
+    private_node_handle_.param("sensor_horizontal_fov", sensor_horizontal_fov_, sensor_horizontal_fov_);
+    private_node_handle_.param("sensor_vertical_fov", sensor_vertical_fov_, sensor_vertical_fov_);
+    private_node_handle_.param("sensor_horizontal_rays", sensor_horizontal_rays_, sensor_horizontal_rays_);
+    private_node_handle_.param("sensor_vertical_rays", sensor_vertical_rays_, sensor_vertical_rays_);
+    private_node_handle_.param("sensor_range", sensor_range_, sensor_range_);
+    private_node_handle_.param("ray_cache_depth", ray_cache_depth_, ray_cache_depth_);
+    private_node_handle_.param("min_information_gain", min_information_gain_, min_information_gain_);
+    private_node_handle_.param("incremental_updates", incremental_updates_, incremental_updates_);
+
+    if(frontier_neighborhood_ != 6 && frontier_neighborhood_ != 18 && frontier_neighborhood_ != 26)
+    {
+        ROS_ERROR("invalid frontier_neighborhood %d (must be 6, 18 or 26); using 26", frontier_neighborhood_);
+        frontier_neighborhood_ = 26;
+    }
+    frontier_threads_ = std::max(1, frontier_threads_);
+    // (one thread does the work by itself)
+    frontier_pool_.reset(new WorkerPool(frontier_threads_ > 1 ? frontier_threads_ : 0));
+    frontier_depth_ = std::max(1, std::min(16, frontier_depth_));
+    if(frontier_coarse_depth_ < 0 || frontier_coarse_depth_ >= frontier_depth_)
+    {
+        ROS_ERROR("invalid frontier_coarse_depth %d (must be 0 to disable, or less than frontier_depth %d); disabling", frontier_coarse_depth_, frontier_depth_);
+        frontier_coarse_depth_ = 0;
+    }
+    sensor_horizontal_rays_ = std::max(1, sensor_horizontal_rays_);
+    sensor_vertical_rays_ = std::max(1, sensor_vertical_rays_);
+    ray_cache_depth_ = std::max(1, std::min(16, ray_cache_depth_));
+
+    if(clustering_ != "euclidean" && clustering_ != "voxel")
+    {
+        ROS_ERROR("invalid clustering '%s' (must be 'euclidean' or 'voxel'); using 'euclidean'", clustering_.c_str());
+        clustering_ = "euclidean";
+    }
+
+    // 6: faces, 18: faces and edges, 26: faces, edges and corners
+    const int max_nonzero = frontier_neighborhood_ == 6 ? 1 : frontier_neighborhood_ == 18 ? 2 : 3;
+    for(int dz = -1; dz <= 1; dz++)
+    {
+        for(int dy = -1; dy <= 1; dy++)
+        {
+            for(int dx = -1; dx <= 1; dx++)
+            {
+                int nonzero = abs(dx) + abs(dy) + abs(dz);
+                if(nonzero == 0 || nonzero > max_nonzero) continue;
+                KeyOffset o;
+                o.d[0] = dx;
+                o.d[1] = dy;
+                o.d[2] = dz;
+                neighbor_offsets_.push_back(o);
+            }
+        }
+    }
 
     octree_sub_ = nh_.subscribe<octomap_msgs::Octomap>("octree_in", 1, &NextBestView::onOctomap, this);
+    if(incremental_updates_)
+        octree_update_sub_ = nh_.subscribe<octomap_path_planner::OctomapUpdate>("octree_update_in", 10, &NextBestView::onOctomapUpdate, this);
     void_frontier_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("void_frontier", 1, false);
     posearray_pub_ = nh_.advertise<geometry_msgs::PoseArray>("poses", 1, false);
+    gains_pub_ = nh_.advertise<std_msgs::Float32MultiArray>("pose_gains", 1, false);
+    timing_pub_ = nh_.advertise<diagnostic_msgs::DiagnosticArray>("timing", 10, false);
+    bool trace = false;
+    private_node_handle_.param("trace", trace, trace);
+    tracer_.init(nh_, trace);
     for(int i = 0; i < num_clusters_; i++)
     {
         std::stringstream ss; ss << "cluster_pcl_" << (i+1);
         cluster_pub_.push_back(nh_.advertise<sensor_msgs::PointCloud2>(ss.str(), 1, false));
     }
+
+    worker_thread_ = boost::thread(&NextBestView::worker, this);
 }
 
 
 NextBestView::~NextBestView()
 {
-    if(octree_ptr_) delete octree_ptr_;
+    {
+        boost::mutex::scoped_lock lock(map_mutex_);
+        shutdown_ = true;
+    }
+    cancel_ = true;
+    map_cond_.notify_one();
+    worker_thread_.join();
+}
+
+
+/**
+ * Find the leaf (at most at frontier_depth) containing the given key.
+ * Returns the leaf node, and its index key and depth, or NULL if the key
+ * falls in unknown space.
+ */
+octomap::OcTreeNode * NextBestView::findLeaf(const octomap::OcTreeKey& key, octomap::OcTreeKey& leaf_key, unsigned& leaf_depth)
+{
+    const unsigned tree_depth = octree_ptr_->getTreeDepth();
+    octomap::OcTreeNode *node = octree_ptr_->getRoot();
+    if(!node) return 0L;
+    unsigned depth = 0;
+    while(depth < (unsigned)frontier_depth_ && node->hasChildren())
+    {
+        unsigned pos = tree_depth - 1 - depth;
+        unsigned i = ((key[0] >> pos) & 1) | (((key[1] >> pos) & 1) << 1) | (((key[2] >> pos) & 1) << 2);
+        if(!node->childExists(i)) return 0L;
+        node = node->getChild(i);
+        depth++;
+    }
+    const octomap::key_type mask = 0xFFFF << (tree_depth - depth);
+    leaf_key = octomap::OcTreeKey(key[0] & mask, key[1] & mask, key[2] & mask);
+    leaf_depth = depth;
+    return node;
 }
 
 
 /**
- * Check if a point is near the unknown space (by 1 voxel).
- * Note: this assumes the point is contained by a cell in the octree.
+ * Add to leafs the leafs touching the node identified by the given index
+ * key and depth, i.e. the leafs containing the voxels of its outer shell.
  */
-bool NextBestView::isNearVoid(const octomap::point3d& p1, const unsigned char depth, const double res)
+void NextBestView::addNeighborLeafs(const octomap::OcTreeKey& key, unsigned depth, octomap::KeySet& leafs)
 {
-    for(int dz = 0; dz <= 0; dz += 2)
+    const int s = 1 << (octree_ptr_->getTreeDepth() - depth);
+    octomap::OcTreeKey k, leaf_key;
+    unsigned leaf_depth;
+    for(int z = -1; z <= s; z++)
     {
-        for(int dy = -1; dy <= 1; dy += 2)
+        if(key[2] + z < 0 || key[2] + z > 0xFFFF) continue;
+        for(int y = -1; y <= s; y++)
         {
-            for(int dx = -1; dx <= 1; dx += 2)
+            if(key[1] + y < 0 || key[1] + y > 0xFFFF) continue;
+            // skip the interior of the node:
+            const bool inner = z >= 0 && z < s && y >= 0 && y < s;
+            for(int x = -1; x <= s; x += (inner && x == -1) ? s + 1 : 1)
             {
-                octomap::OcTreeNode *pNode = octree_ptr_->search(p1.x() + res * dx, p1.y() + res * dy, p1.z() + res * dz, depth);
-                if(!pNode) return true;
+                if(key[0] + x < 0 || key[0] + x > 0xFFFF) continue;
+                k[0] = key[0] + x;
+                k[1] = key[1] + y;
+                k[2] = key[2] + z;
+                if(findLeaf(k, leaf_key, leaf_depth))
+                    leafs.insert(leaf_key);
             }
         }
     }
-    return false;
 }
 
 
-static bool compareClusters(pcl::PointIndices c1, pcl::PointIndices c2)
+/**
+ * Check if a leaf (given by index key and depth) is near the unknown
+ * space, i.e. if any of its neighbors in the frontier_neighborhood is
+ * unknown. For pruned leafs, neighbors are probed at the center of the
+ * adjacent faces, edges and corners.
+ *
+ * The neighborhood is unrolled at compile time; frontier_neighborhood
+ * picks one of the three instances.
+ */
+bool NextBestView::isNearVoid(const octomap::OcTreeKey& key, unsigned depth, LeafCache& cache)
 {
-    return (c1.indices.size() < c2.indices.size());
+    VoidProbe probe(*this, cache, key, depth);
+    switch(frontier_neighborhood_)
+    {
+    case 6: return !Neighborhood<1>::forEach(probe);
+    case 18: return !Neighborhood<2>::forEach(probe);
+    default: return !Neighborhood<3>::forEach(probe);
+    }
+}
+
+
+void NextBestView::checkFrontierLeafs(const LeafList& leafs, size_t begin, size_t end, std::vector<char>& is_frontier)
+{
+    LeafCache cache;
+    for(size_t i = begin; i < end; i++)
+        is_frontier[i] = !leafs[i].second.occupied && isNearVoid(leafs[i].first, leafs[i].second.depth, cache);
+}
+
+
+/**
+ * Run work(begin, end) over [0, n) split in contiguous blocks of at least
+ * min_block_size, one per thread of the frontier_threads worker pool.
+ */
+void NextBestView::forEachBlock(size_t n, size_t min_block_size, const boost::function<void (size_t, size_t)>& work)
+{
+    size_t num_threads = std::min<size_t>(frontier_pool_->size(), (n + min_block_size - 1) / min_block_size);
+    if(num_threads <= 1)
+    {
+        work(0, n);
+        return;
+    }
+
+    const size_t block_size = (n + num_threads - 1) / num_threads;
+    boost::atomic<size_t> next(0);
+    frontier_pool_->run(boost::bind(&runBlocks, boost::cref(work), n, block_size, boost::ref(next)), num_threads);
 }
 
 
 /**
- * Compute void frontier points (leaf points in free space adjacent to unknown space)
+ * Run the frontier test on a list of leafs, splitting it in contiguous
+ * blocks (which keeps the leaf cache effective) across frontier_threads.
  */
-void NextBestView::computeNextBestViews()
+void NextBestView::checkFrontierLeafs(const LeafList& leafs, std::vector<char>& is_frontier)
 {
-    const unsigned char depth = 16;
-    const double res = octree_ptr_->getResolution();
+    is_frontier.resize(leafs.size());
+    forEachBlock(leafs.size(), 4096, boost::bind(&NextBestView::checkFrontierLeafs, this, boost::cref(leafs), _1, _2, boost::ref(is_frontier)));
+}
+
 
-    // compute void frontier:
-    octomap::point3d_list pl;
-    for(octomap::OcTree::leaf_iterator it = octree_ptr_->begin_leafs(depth); it != octree_ptr_->end_leafs(); it++)
+/**
+ * Check if a coarse cell (at frontier_coarse_depth) is entirely known,
+ * from the state of its node: missing (unknown), a leaf (known), or an
+ * inner node, known if its leafs fill the known volume of the cell.
+ */
+bool NextBestView::isCoarseCellKnown(const octomap::OcTreeKey& cell_key, const CoarseVolumeMap& volume)
+{
+    const octomap::OcTreeNode *node = octree_ptr_->search(cell_key, frontier_coarse_depth_);
+    if(!node) return false;
+    if(!node->hasChildren()) return true;
+    const unsigned tree_depth = octree_ptr_->getTreeDepth();
+    CoarseVolumeMap::const_iterator it = volume.find(cell_key);
+    return it != volume.end() && it->second == (uint64_t(1) << (3 * (tree_depth - frontier_coarse_depth_)));
+}
+
+
+/**
+ * Coarse cells (of the given ones) that can contain frontier leafs: a leaf
+ * can only be near unknown space if its coarse cell or one of the 26
+ * neighboring coarse cells is not entirely known.
+ */
+void NextBestView::computeCoarseCandidates(const CoarseVolumeMap& volume, const octomap::KeySet& cells, octomap::KeySet& candidates)
+{
+    const int cs = 1 << (octree_ptr_->getTreeDepth() - frontier_coarse_depth_);
+    octomap::KeySet unknown_cells, known_cells;
+    for(octomap::KeySet::const_iterator it = cells.begin(); it != cells.end(); ++it)
     {
-        if(octree_ptr_->isNodeOccupied(*it))
+        const octomap::OcTreeKey& key = *it;
+        bool candidate = false;
+        for(int dz = -1; dz <= 1 && !candidate; dz++)
+        {
+            for(int dy = -1; dy <= 1 && !candidate; dy++)
+            {
+                for(int dx = -1; dx <= 1 && !candidate; dx++)
+                {
+                    int x = key[0] + dx * cs, y = key[1] + dy * cs, z = key[2] + dz * cs;
+                    if(x < 0 || y < 0 || z < 0 || x > 0xFFFF || y > 0xFFFF || z > 0xFFFF)
+                    {
+                        candidate = true;
+                        break;
+                    }
+                    octomap::OcTreeKey cell(x, y, z);
+                    if(known_cells.count(cell)) continue;
+                    if(unknown_cells.count(cell) || !isCoarseCellKnown(cell, volume))
+                    {
+                        unknown_cells.insert(cell);
+                        candidate = true;
+                    }
+                    else
+                    {
+                        known_cells.insert(cell);
+                    }
+                }
+            }
+        }
+        if(candidate)
+            candidates.insert(key);
+    }
+}
+
+
+bool NextBestView::isInCoarseCandidate(const LeafList::value_type& leaf, const octomap::KeySet& candidates) const
+{
+    // leafs larger than a coarse cell are always checked:
+    if(leaf.second.depth < frontier_coarse_depth_)
+        return true;
+    const octomap::key_type mask = 0xFFFF << (octree_ptr_->getTreeDepth() - frontier_coarse_depth_);
+    return candidates.count(octomap::OcTreeKey(leaf.first[0] & mask, leaf.first[1] & mask, leaf.first[2] & mask)) > 0;
+}
+
+
+bool NextBestView::compareLeafKeys(const LeafList::value_type& a, const LeafList::value_type& b)
+{
+    if(a.first[2] != b.first[2]) return a.first[2] < b.first[2];
+    if(a.first[1] != b.first[1]) return a.first[1] < b.first[1];
+    return a.first[0] < b.first[0];
+}
+
+
+void NextBestView::addCoarseVolume(const octomap::OcTreeKey& key, unsigned depth, bool add)
+{
+    if(frontier_coarse_depth_ == 0 || depth < (unsigned)frontier_coarse_depth_) return;
+    const unsigned tree_depth = octree_ptr_->getTreeDepth();
+    const octomap::key_type coarse_mask = 0xFFFF << (tree_depth - frontier_coarse_depth_);
+    const octomap::OcTreeKey cell_key(key[0] & coarse_mask, key[1] & coarse_mask, key[2] & coarse_mask);
+    const uint64_t volume = uint64_t(1) << (3 * (tree_depth - depth));
+    if(add)
+    {
+        coarse_volume_[cell_key] += volume;
+    }
+    else
+    {
+        CoarseVolumeMap::iterator it = coarse_volume_.find(cell_key);
+        if(it == coarse_volume_.end()) return;
+        it->second -= volume;
+        if(it->second == 0) coarse_volume_.erase(it);
+    }
+}
+
+
+/**
+ * Collect the leafs of the coarse cells that can contain frontier leafs
+ * (and the leafs larger than a coarse cell), in tree order: the cells are
+ * found by iterating the tree down to frontier_coarse_depth only, and
+ * their leafs by iterating inside the candidate cells only.
+ */
+void NextBestView::collectCoarseCandidateLeafs(LeafList& leafs)
+{
+    const unsigned tree_depth = octree_ptr_->getTreeDepth();
+    const octomap::key_type cs = 1 << (tree_depth - frontier_coarse_depth_);
+    std::vector<octomap::OcTreeKey> cell_order;
+    octomap::KeySet cells, candidates;
+    for(octomap::OcTree::leaf_iterator it = octree_ptr_->begin_leafs(frontier_coarse_depth_); it != octree_ptr_->end_leafs(); ++it)
+    {
+        const octomap::OcTreeKey key = it.getIndexKey();
+        cell_order.push_back(key);
+        // (larger leafs are not cells, and are always checked)
+        if(it.getDepth() == (unsigned)frontier_coarse_depth_)
+            cells.insert(key);
+    }
+    computeCoarseCandidates(coarse_volume_, cells, candidates);
+
+    for(size_t i = 0; i < cell_order.size(); i++)
+    {
+        const octomap::OcTreeKey& key = cell_order[i];
+        if(!cells.count(key))
+        {
+            leafs.push_back(*leaf_state_.find(key));
             continue;
+        }
+        if(!candidates.count(key)) continue;
+        const octomap::OcTreeKey max(key[0] + cs - 1, key[1] + cs - 1, key[2] + cs - 1);
+        for(octomap::OcTree::leaf_bbx_iterator it = octree_ptr_->begin_leafs_bbx(key, max, frontier_depth_); it != octree_ptr_->end_leafs_bbx(); ++it)
+            leafs.push_back(*leaf_state_.find(it.getIndexKey()));
+    }
+}
+
+
+/**
+ * Update the persistent frontier set for a new map.
+ *
+ * The leafs of the new map are diffed against the ones of the previous
+ * map; only leafs whose state (occupancy or size) changed, or that
+ * appeared or disappeared, and the leafs touching them are rechecked.
+ *
+ * Returns the number of leafs that entered or left the frontier.
+ *
+ * Leafs are taken at frontier_depth. If frontier_coarse_depth is set, the
+ * known volume of the coarse cells at that depth is accumulated along, and
+ * leafs in coarse cells that are surrounded by known space are not
+ * checked (coarse-to-fine).
+ */
+size_t NextBestView::updateFrontier()
+{
+    size_t frontier_changes = 0;
+    LeafStateMap new_state;
+    new_state.reserve(leaf_state_.size());
+    std::vector<std::pair<octomap::OcTreeKey, unsigned> > changed, removed;
+    size_t matched = 0;
+
+    coarse_volume_.clear();
+
+    for(octomap::OcTree::leaf_iterator it = octree_ptr_->begin_leafs(frontier_depth_); it != octree_ptr_->end_leafs(); ++it)
+    {
+        const octomap::OcTreeKey key = it.getIndexKey();
+        LeafState state;
+        state.depth = it.getDepth();
+        state.occupied = octree_ptr_->isNodeOccupied(*it);
+        new_state[key] = state;
+        addCoarseVolume(key, state.depth, true);
+
+        LeafStateMap::const_iterator old = leaf_state_.find(key);
+        if(old != leaf_state_.end())
+        {
+            matched++;
+            if(old->second == state) continue;
+        }
+        changed.push_back(std::make_pair(key, state.depth));
+    }
+
+    if(matched < leaf_state_.size())
+    {
+        for(LeafStateMap::const_iterator it = leaf_state_.begin(); it != leaf_state_.end(); ++it)
+        {
+            if(new_state.find(it->first) == new_state.end())
+            {
+                removed.push_back(std::make_pair(it->first, it->second.depth));
+                frontier_changes += frontier_.erase(it->first);
+            }
+        }
+    }
+
+    leaf_state_.swap(new_state);
+
+    return frontier_changes + recheckFrontier(changed, removed);
+}
+
+
+/**
+ * Update the persistent frontier set after partial map updates.
+ *
+ * Only the leafs in the changed region are diffed: old_leafs are the
+ * leafs that overlapped the updated boxes before merging the updates
+ * (the only ones that can have disappeared).
+ */
+size_t NextBestView::updateFrontier(const octomap::KeySet& old_leafs, const OctomapRegion& region)
+{
+    if(region.full) return updateFrontier();
+    if(region.empty) return 0;
+
+    size_t frontier_changes = 0;
+    std::vector<std::pair<octomap::OcTreeKey, unsigned> > changed, removed;
+    octomap::KeySet current;
+
+    for(octomap::OcTree::leaf_bbx_iterator it = octree_ptr_->begin_leafs_bbx(region.min, region.max, frontier_depth_); it != octree_ptr_->end_leafs_bbx(); ++it)
+    {
+        const octomap::OcTreeKey key = it.getIndexKey();
+        LeafState state;
+        state.depth = it.getDepth();
+        state.occupied = octree_ptr_->isNodeOccupied(*it);
+        current.insert(key);
+
+        LeafStateMap::iterator old = leaf_state_.find(key);
+        if(old != leaf_state_.end())
+        {
+            if(old->second == state) continue;
+            addCoarseVolume(key, old->second.depth, false);
+            old->second = state;
+        }
+        else
+        {
+            leaf_state_[key] = state;
+        }
+        addCoarseVolume(key, state.depth, true);
+        changed.push_back(std::make_pair(key, state.depth));
+    }
+
+    for(octomap::KeySet::const_iterator it = old_leafs.begin(); it != old_leafs.end(); ++it)
+    {
+        if(current.count(*it)) continue;
+        LeafStateMap::iterator old = leaf_state_.find(*it);
+        if(old == leaf_state_.end()) continue;
+        removed.push_back(std::make_pair(old->first, old->second.depth));
+        addCoarseVolume(old->first, old->second.depth, false);
+        frontier_changes += frontier_.erase(old->first);
+        leaf_state_.erase(old);
+    }
+
+    return frontier_changes + recheckFrontier(changed, removed);
+}
+
+
+/**
+ * Recheck the changed leafs and the leafs touching changed or removed
+ * leafs, updating the frontier set. Returns the number of leafs that
+ * entered or left the frontier.
+ */
+size_t NextBestView::recheckFrontier(const std::vector<std::pair<octomap::OcTreeKey, unsigned> >& changed, const std::vector<std::pair<octomap::OcTreeKey, unsigned> >& removed)
+{
+    size_t frontier_changes = 0;
+    LeafList recheck;
+
+    size_t skipped = 0;
+    bool refined = false;
+    if(2 * (changed.size() + removed.size()) > leaf_state_.size())
+    {
+        // most of the map changed (e.g. first map): a full rebuild is
+        // cheaper; take leafs in tree order, which is spatially coherent
+        frontier_changes += frontier_.size();
+        frontier_.clear();
+        if(frontier_coarse_depth_ > 0)
+        {
+            collectCoarseCandidateLeafs(recheck);
+            skipped = leaf_state_.size() - recheck.size();
+            refined = true;
+        }
+        else
+        {
+            recheck.reserve(leaf_state_.size());
+            for(octomap::OcTree::leaf_iterator it = octree_ptr_->begin_leafs(frontier_depth_); it != octree_ptr_->end_leafs(); ++it)
+                recheck.push_back(*leaf_state_.find(it.getIndexKey()));
+        }
+    }
+    else
+    {
+        octomap::KeySet dirty;
+        for(size_t i = 0; i < changed.size(); i++)
+        {
+            dirty.insert(changed[i].first);
+            addNeighborLeafs(changed[i].first, changed[i].second, dirty);
+        }
+        for(size_t i = 0; i < removed.size(); i++)
+            addNeighborLeafs(removed[i].first, removed[i].second, dirty);
+
+        recheck.reserve(dirty.size());
+        for(octomap::KeySet::const_iterator it = dirty.begin(); it != dirty.end(); ++it)
+        {
+            LeafStateMap::const_iterator st = leaf_state_.find(*it);
+            if(st != leaf_state_.end())
+                recheck.push_back(*st);
+        }
+        // sort by key so that blocks are spatially coherent:
+        std::sort(recheck.begin(), recheck.end(), compareLeafKeys);
+    }
+
+    if(frontier_coarse_depth_ > 0 && !refined)
+    {
+        // only the coarse cells of the leafs to recheck are needed:
+        const octomap::key_type mask = 0xFFFF << (octree_ptr_->getTreeDepth() - frontier_coarse_depth_);
+        octomap::KeySet cells, candidates;
+        for(size_t i = 0; i < recheck.size(); i++)
+        {
+            const octomap::OcTreeKey& key = recheck[i].first;
+            if(recheck[i].second.depth >= frontier_coarse_depth_)
+                cells.insert(octomap::OcTreeKey(key[0] & mask, key[1] & mask, key[2] & mask));
+        }
+        computeCoarseCandidates(coarse_volume_, cells, candidates);
+        LeafList refined;
+        refined.reserve(recheck.size());
+        for(size_t i = 0; i < recheck.size(); i++)
+        {
+            if(isInCoarseCandidate(recheck[i], candidates))
+                refined.push_back(recheck[i]);
+            else
+                frontier_changes += frontier_.erase(recheck[i].first);
+        }
+        skipped = recheck.size() - refined.size();
+        recheck.swap(refined);
+    }
+
+    std::vector<char> is_frontier;
+    checkFrontierLeafs(recheck, is_frontier);
+    for(size_t i = 0; i < recheck.size(); i++)
+    {
+        if(is_frontier[i])
+            frontier_changes += frontier_.insert(recheck[i].first).second;
+        else
+            frontier_changes += frontier_.erase(recheck[i].first);
+    }
+
+    ROS_DEBUG("frontier update: %ld leafs, %ld changed, %ld removed, %ld rechecked (%ld skipped by coarse cells), %ld frontier leafs (%ld changed)",
+            leaf_state_.size(), changed.size(), removed.size(), recheck.size(), skipped, frontier_.size(), frontier_changes);
+
+    return frontier_changes;
+}
+
+
+/**
+ * Keep only the num_clusters_ largest clusters, sorted by decreasing size,
+ * with a partial selection on the sizes (indices are moved, not copied).
+ */
+void NextBestView::selectLargestClusters(std::vector<pcl::PointIndices>& clusters)
+{
+    std::vector<std::pair<size_t, size_t> > by_size(clusters.size());
+    for(size_t i = 0; i < clusters.size(); i++)
+        by_size[i] = std::make_pair(clusters[i].indices.size(), i);
+    const size_t k = std::min(clusters.size(), (size_t)num_clusters_);
+    std::partial_sort(by_size.begin(), by_size.begin() + k, by_size.end(), std::greater<std::pair<size_t, size_t> >());
+
+    std::vector<pcl::PointIndices> largest(k);
+    for(size_t i = 0; i < k; i++)
+        largest[i].indices.swap(clusters[by_size[i].second].indices);
+    clusters.swap(largest);
+}
+
+
+/**
+ * Union adjacent frontier leafs in [begin, end) (adjacency is by key, in
+ * the frontier_neighborhood). If cluster_merge_normals is set, only leafs
+ * whose normals differ by less than eps_angle are merged.
+ */
+void NextBestView::uniteAdjacentLeafs(const LeafList& leafs, const KeyIndexMap& index, bool has_pruned_leafs, const pcl::PointCloud<pcl::Normal>& normals, const std::vector<char>& valid, size_t begin, size_t end, DisjointSets& sets)
+{
+    const unsigned tree_depth = octree_ptr_->getTreeDepth();
+    octomap::OcTreeKey k, leaf_key;
+    unsigned leaf_depth;
+    for(size_t i = begin; i < end; i++)
+    {
+        if(!valid[i]) continue;
+        const octomap::OcTreeKey& key = leafs[i].first;
+        const int s = 1 << (tree_depth - leafs[i].second.depth);
+        for(std::vector<KeyOffset>::const_iterator o = neighbor_offsets_.begin(); o != neighbor_offsets_.end(); ++o)
+        {
+            bool outside = false;
+            for(int d = 0; d < 3; d++)
+            {
+                int c = o->d[d] < 0 ? key[d] - 1 : o->d[d] > 0 ? key[d] + s : key[d] + s / 2;
+                if(c < 0 || c > 0xFFFF) outside = true;
+                k[d] = c;
+            }
+            if(outside) continue;
 
-        if(isNearVoid(it.getCoordinate(), depth, res))
-            pl.push_back(it.getCoordinate());
+            KeyIndexMap::const_iterator it = index.find(k);
+            if(it == index.end() && has_pruned_leafs && findLeaf(k, leaf_key, leaf_depth) && leaf_depth < tree_depth)
+                it = index.find(leaf_key);
+            if(it == index.end()) continue;
+
+            const int j = it->second;
+            if(!valid[j]) continue;
+            if(cluster_merge_normals_)
+            {
+                double dot_p = normals[i].normal_x * normals[j].normal_x +
+                    normals[i].normal_y * normals[j].normal_y +
+                    normals[i].normal_z * normals[j].normal_z;
+                if(fabs(acos(std::max(-1.0, std::min(1.0, dot_p)))) >= eps_angle_)
+                    continue;
+            }
+            sets.unite(i, j);
+        }
+    }
+}
+
+
+/**
+ * Cluster the frontier leafs by voxel connectivity, with a parallel
+ * union-find over the leafs, and return (as indices into leafs) only the
+ * num_clusters_ largest clusters with at least min_pts_per_cluster points.
+ */
+void NextBestView::extractVoxelClusters(const LeafList& leafs, const pcl::PointCloud<pcl::Normal>& normals, const std::vector<char>& valid, std::vector<pcl::PointIndices>& clusters)
+{
+    const size_t n = leafs.size();
+    const unsigned tree_depth = octree_ptr_->getTreeDepth();
+
+    KeyIndexMap index;
+    index.reserve(n);
+    bool has_pruned_leafs = false;
+    for(size_t i = 0; i < n; i++)
+    {
+        index[leafs[i].first] = i;
+        if(leafs[i].second.depth < tree_depth) has_pruned_leafs = true;
+    }
+
+    DisjointSets sets(n);
+    forEachBlock(n, 4096, boost::bind(&NextBestView::uniteAdjacentLeafs, this, boost::cref(leafs), boost::cref(index), has_pruned_leafs, boost::cref(normals), boost::cref(valid), _1, _2, boost::ref(sets)));
+
+    // cluster sizes, and partial selection of the largest ones:
+    std::vector<int> root(n), size(n, 0);
+    for(size_t i = 0; i < n; i++)
+    {
+        if(!valid[i]) continue;
+        root[i] = sets.find(i);
+        size[root[i]]++;
+    }
+    std::vector<std::pair<int, int> > by_size;
+    for(size_t i = 0; i < n; i++)
+        if(size[i] >= min_pts_per_cluster_)
+            by_size.push_back(std::make_pair(size[i], i));
+    const size_t k = std::min(by_size.size(), (size_t)num_clusters_);
+    std::partial_sort(by_size.begin(), by_size.begin() + k, by_size.end(), std::greater<std::pair<int, int> >());
+
+    std::vector<int> slot(n, -1);
+    clusters.resize(k);
+    for(size_t c = 0; c < k; c++)
+    {
+        slot[by_size[c].second] = c;
+        clusters[c].indices.reserve(by_size[c].first);
+    }
+    for(size_t i = 0; i < n; i++)
+        if(valid[i] && slot[root[i]] >= 0)
+            clusters[slot[root[i]]].indices.push_back(i);
+}
+
+
+/**
+ * Estimate normals of the frontier points (flipped towards the origin, as
+ * pcl::NormalEstimation does) using the shared index. Points with too few
+ * neighbors get NaN normals and are marked invalid.
+ */
+void NextBestView::estimateNormals(const pcl::PointCloud<pcl::PointXYZ>& cloud, const pcl::KdTreeFLANN<pcl::PointXYZ>& tree, pcl::PointCloud<pcl::Normal>& normals, std::vector<char>& valid)
+{
+    normals.resize(cloud.size());
+    valid.assign(cloud.size(), 0);
+    std::vector<int> nn_indices;
+    std::vector<float> nn_dists;
+    Eigen::Vector4f plane;
+    float curvature;
+    for(size_t i = 0; i < cloud.size(); i++)
+    {
+        pcl::Normal& n = normals[i];
+        if(tree.radiusSearch(cloud[i], normal_search_radius_, nn_indices, nn_dists) == 0 ||
+                !pcl::computePointNormal(cloud, nn_indices, plane, curvature))
+        {
+            n.normal_x = n.normal_y = n.normal_z = n.curvature = std::numeric_limits<float>::quiet_NaN();
+            continue;
+        }
+        n.normal_x = plane[0];
+        n.normal_y = plane[1];
+        n.normal_z = plane[2];
+        n.curvature = curvature;
+        pcl::flipNormalTowardsViewpoint(cloud[i], 0.0f, 0.0f, 0.0f, n.normal_x, n.normal_y, n.normal_z);
+        valid[i] = 1;
     }
-    if(!pl.size())
+}
+
+
+/**
+ * Decompose the valid frontier points into clusters based on the euclidean
+ * distance between points, and the angle between their normal and the one
+ * of the cluster seed (as pcl::extractEuclideanClusters), using the shared
+ * index. Clusters are returned as indices into the frontier cloud.
+ */
+void NextBestView::extractClusters(const pcl::PointCloud<pcl::PointXYZ>& cloud, const pcl::PointCloud<pcl::Normal>& normals, const std::vector<char>& valid, const pcl::KdTreeFLANN<pcl::PointXYZ>& tree, std::vector<pcl::PointIndices>& clusters)
+{
+    std::vector<char> processed(cloud.size(), 0);
+    std::vector<int> seed_queue;
+    std::vector<int> nn_indices;
+    std::vector<float> nn_dists;
+    for(size_t i = 0; i < cloud.size(); i++)
     {
-        ROS_ERROR("Found no frontier points at depth %d!", depth);
+        if(!valid[i] || processed[i]) continue;
+
+        seed_queue.clear();
+        seed_queue.push_back(i);
+        processed[i] = 1;
+        for(size_t sq = 0; sq < seed_queue.size(); sq++)
+        {
+            if(!tree.radiusSearch(cloud[seed_queue[sq]], tolerance_, nn_indices, nn_dists))
+                continue;
+            for(size_t j = 0; j < nn_indices.size(); j++)
+            {
+                int k = nn_indices[j];
+                if(!valid[k] || processed[k]) continue;
+                double dot_p = normals[i].normal_x * normals[k].normal_x +
+                    normals[i].normal_y * normals[k].normal_y +
+                    normals[i].normal_z * normals[k].normal_z;
+                if(fabs(acos(std::max(-1.0, std::min(1.0, dot_p)))) < eps_angle_)
+                {
+                    processed[k] = 1;
+                    seed_queue.push_back(k);
+                }
+            }
+        }
+
+        if(seed_queue.size() >= (size_t)min_pts_per_cluster_)
+        {
+            clusters.push_back(pcl::PointIndices());
+            clusters.back().indices = seed_queue;
+            std::sort(clusters.back().indices.begin(), clusters.back().indices.end());
+        }
+    }
+}
+
+
+/**
+ * Cast a ray from origin along direction for sensor_range, and collect the
+ * unknown voxels it traverses before hitting an occupied voxel.
+ */
+void NextBestView::castRay(const octomap::point3d& origin, const octomap::point3d& direction, octomap::KeyRay& ray, std::vector<octomap::OcTreeKey>& unknown)
+{
+    unknown.clear();
+    if(!octree_ptr_->computeRayKeys(origin, origin + direction * sensor_range_, ray))
         return;
+    for(octomap::KeyRay::iterator it = ray.begin(); it != ray.end(); ++it)
+    {
+        octomap::OcTreeNode *node = octree_ptr_->search(*it);
+        if(!node)
+            unknown.push_back(*it);
+        else if(octree_ptr_->isNodeOccupied(node))
+            break;
     }
+}
+
+
+/**
+ * Compute the information gain (number of distinct unknown voxels seen by
+ * the sensor frustum) of the candidates order[begin..end).
+ *
+ * The sensor looks along the x axis of the candidate pose. Ray directions
+ * are quantized to the angular step of the frustum, and origins to the
+ * cells at ray_cache_depth, so that rays are cached and shared between
+ * nearby candidates of the same block.
+ */
+void NextBestView::scoreCandidates(const std::vector<geometry_msgs::Pose>& poses, const std::vector<size_t>& order, size_t begin, size_t end, std::vector<double>& gains)
+{
+    const double h_step = sensor_horizontal_rays_ > 1 ? sensor_horizontal_fov_ / (sensor_horizontal_rays_ - 1) : sensor_horizontal_fov_;
+    const double v_step = sensor_vertical_rays_ > 1 ? sensor_vertical_fov_ / (sensor_vertical_rays_ - 1) : sensor_vertical_fov_;
+    const double step = std::max(1e-3, std::min(h_step, v_step));
 
-    pcl::PointCloud<pcl::PointXYZ> border_pcl;
-    border_pcl.resize(pl.size());
-    border_pcl.header.frame_id = frame_id_;
-    size_t i = 0;
-    for(octomap::point3d_list::iterator it = pl.begin(); it != pl.end(); ++it)
+    RayCache cache;
+    octomap::KeyRay ray;
+    octomap::KeySet seen;
+    std::vector<octomap::OcTreeKey> unknown;
+
+    for(size_t c = begin; c < end && !isCancelled(); c++)
+    {
+        const size_t i = order[c];
+        const geometry_msgs::Pose& pose = poses[i];
+        gains[i] = 0.0;
+
+        octomap::OcTreeKey origin_key;
+        if(!octree_ptr_->coordToKeyChecked(octomap::point3d(pose.position.x, pose.position.y, pose.position.z), origin_key))
+            continue;
+        RayCacheKey cache_key;
+        cache_key.origin = octree_ptr_->adjustKeyAtDepth(origin_key, ray_cache_depth_);
+        const octomap::point3d origin = octree_ptr_->keyToCoord(cache_key.origin, ray_cache_depth_);
+
+        tf::Quaternion q;
+        tf::quaternionMsgToTF(pose.orientation, q);
+
+        seen.clear();
+        for(int v = 0; v < sensor_vertical_rays_; v++)
+        {
+            double el = sensor_vertical_rays_ > 1 ? -0.5 * sensor_vertical_fov_ + v * v_step : 0.0;
+            for(int h = 0; h < sensor_horizontal_rays_; h++)
+            {
+                double az = sensor_horizontal_rays_ > 1 ? -0.5 * sensor_horizontal_fov_ + h * h_step : 0.0;
+                tf::Vector3 d = tf::quatRotate(q, tf::Vector3(cos(el) * cos(az), cos(el) * sin(az), sin(el)));
+
+                // quantize the world direction:
+                cache_key.azimuth = (int)floor(atan2(d.y(), d.x()) / step + 0.5);
+                cache_key.elevation = (int)floor(asin(std::max(-1.0, std::min(1.0, (double)d.z()))) / step + 0.5);
+
+                RayCache::iterator it = cache.find(cache_key);
+                if(it == cache.end())
+                {
+                    double qaz = cache_key.azimuth * step, qel = cache_key.elevation * step;
+                    octomap::point3d direction(cos(qel) * cos(qaz), cos(qel) * sin(qaz), sin(qel));
+                    castRay(origin, direction, ray, unknown);
+                    it = cache.insert(std::make_pair(cache_key, unknown)).first;
+                }
+                seen.insert(it->second.begin(), it->second.end());
+            }
+        }
+        gains[i] = seen.size();
+    }
+}
+
+
+static bool compareKeyedCandidates(const std::pair<octomap::OcTreeKey, size_t>& a, const std::pair<octomap::OcTreeKey, size_t>& b)
+{
+    if(a.first[2] != b.first[2]) return a.first[2] < b.first[2];
+    if(a.first[1] != b.first[1]) return a.first[1] < b.first[1];
+    return a.first[0] < b.first[0];
+}
+
+
+/**
+ * Score all the candidates, in spatially ordered blocks across
+ * frontier_threads (each with its own ray cache).
+ */
+void NextBestView::scoreCandidates(const std::vector<geometry_msgs::Pose>& poses, std::vector<double>& gains)
+{
+    gains.assign(poses.size(), 0.0);
+
+    std::vector<std::pair<octomap::OcTreeKey, size_t> > keyed(poses.size());
+    for(size_t i = 0; i < poses.size(); i++)
     {
-        border_pcl[i].x = it->x();
-        border_pcl[i].y = it->y();
-        border_pcl[i].z = it->z();
-        i++;
+        keyed[i].first = octree_ptr_->coordToKey(poses[i].position.x, poses[i].position.y, poses[i].position.z);
+        keyed[i].second = i;
     }
+    std::sort(keyed.begin(), keyed.end(), compareKeyedCandidates);
+    std::vector<size_t> order(poses.size());
+    for(size_t i = 0; i < poses.size(); i++)
+        order[i] = keyed[i].second;
+
+    forEachBlock(poses.size(), 16, boost::bind(static_cast<void (NextBestView::*)(const std::vector<geometry_msgs::Pose>&, const std::vector<size_t>&, size_t, size_t, std::vector<double>&)>(&NextBestView::scoreCandidates),
+                this, boost::cref(poses), boost::cref(order), _1, _2, boost::ref(gains)));
+}
 
-    sensor_msgs::PointCloud2 void_frontier_msg;
-    pcl::toROSMsg(border_pcl, void_frontier_msg);
-    void_frontier_pub_.publish(void_frontier_msg);
+
+/**
+ * Compute next best views from the void frontier points (leaf points in
+ * free space adjacent to unknown space)
+ *
+ * The frontier cloud and its normals are stored once, and a single
+ * spatial index over them serves normal estimation, clustering and
+ * boundary search; clusters are views (indices) into the frontier cloud.
+ *
+ * Returns false if cancelled by a newer map (checked between stages).
+ * Stage times are added to stats.
+ */
+bool NextBestView::computeNextBestViews(StageStats& stats)
+{
+    const double boundary_search_radius = 0.5;
+
+    // void frontier is maintained incrementally by updateFrontier():
+    pcl::PointCloud<pcl::PointXYZ>::Ptr border_pcl(new pcl::PointCloud<pcl::PointXYZ>);
+    border_pcl->header.frame_id = frame_id_;
+    border_pcl->reserve(frontier_.size());
+    LeafList frontier_leafs;
+    frontier_leafs.reserve(frontier_.size());
+    for(octomap::KeySet::const_iterator it = frontier_.begin(); it != frontier_.end(); ++it)
+    {
+        frontier_leafs.push_back(*leaf_state_.find(*it));
+        octomap::point3d p = octree_ptr_->keyToCoord(*it, frontier_leafs.back().second.depth);
+        border_pcl->push_back(pcl::PointXYZ(p.x(), p.y(), p.z()));
+    }
+    border_pcl->width = border_pcl->size();
+    border_pcl->height = 1;
+    if(border_pcl->empty())
+    {
+        ROS_ERROR("Found no frontier points at depth %d!", frontier_depth_);
+        return true;
+    }
+    stats.mark("cloud");
+
+    if(void_frontier_pub_.getNumSubscribers() > 0)
+    {
+        sensor_msgs::PointCloud2 void_frontier_msg;
+        pcl::toROSMsg(*border_pcl, void_frontier_msg);
+        void_frontier_msg.header.stamp = map_stamp_;
+        void_frontier_pub_.publish(void_frontier_msg);
+    }
+
+    // the only spatial index:
+    pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr tree = boost::make_shared<pcl::KdTreeFLANN<pcl::PointXYZ> >();
+    tree->setInputCloud(border_pcl);
+    stats.mark("index");
+    if(isCancelled()) return false;
 
     // estimate normals:
-    pcl::PointCloud<pcl::Normal> border_normals;
-    pcl::NormalEstimation<pcl::PointXYZ, pcl::Normal> norm_estim;
-    pcl::search::KdTree<pcl::PointXYZ>::Ptr tree = boost::make_shared<pcl::search::KdTree<pcl::PointXYZ> > ();
-    tree->setInputCloud(boost::make_shared<pcl::PointCloud<pcl::PointXYZ> > (border_pcl));
-    norm_estim.setSearchMethod(tree);
-    norm_estim.setInputCloud(boost::make_shared<pcl::PointCloud<pcl::PointXYZ> > (border_pcl));
-    norm_estim.setRadiusSearch(normal_search_radius_);
-    norm_estim.compute(border_normals);
-
-    // filter NaNs:
-    pcl::PointIndices nan_indices;
-    for (unsigned int i = 0; i < border_normals.points.size(); i++) {
-        if (isnan(border_normals.points[i].normal[0]))
-            nan_indices.indices.push_back(i);
-    }
-    pcl::ExtractIndices<pcl::PointXYZ> extract;
-    extract.setInputCloud(boost::make_shared<pcl::PointCloud<pcl::PointXYZ> >(border_pcl));
-    extract.setIndices(boost::make_shared<const pcl::PointIndices>(nan_indices));
-    extract.setNegative(true);
-    extract.filter(border_pcl);
-    pcl::ExtractIndices<pcl::Normal> nextract;
-    nextract.setInputCloud(boost::make_shared<pcl::PointCloud<pcl::Normal> >(border_normals));
-    nextract.setIndices(boost::make_shared<const pcl::PointIndices>(nan_indices));
-    nextract.setNegative(true);
-    nextract.filter(border_normals);
-
-    // tree object used for search
-    pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr tree2 = boost::make_shared<pcl::KdTreeFLANN<pcl::PointXYZ> >();
-    tree2->setInputCloud(boost::make_shared<pcl::PointCloud<pcl::PointXYZ> >(border_pcl));
-    // Decompose a region of space into clusters based on the euclidean distance between points, and the normal
-    std::vector<pcl::PointIndices> clusters;
-    pcl::extractEuclideanClusters<pcl::PointXYZ, pcl::Normal>(border_pcl, border_normals, tolerance_, tree2, clusters, eps_angle_, min_pts_per_cluster_);
+    pcl::PointCloud<pcl::Normal>::Ptr border_normals(new pcl::PointCloud<pcl::Normal>);
+    std::vector<char> valid;
+    estimateNormals(*border_pcl, *tree, *border_normals, valid);
+    stats.mark("normals");
+    if(isCancelled()) return false;
 
-    if(clusters.size() > 0)
+    std::vector<pcl::PointIndices> clusters;
+    if(clustering_ == "voxel")
+    {
+        extractVoxelClusters(frontier_leafs, *border_normals, valid, clusters);
+    }
+    else
     {
-        std::sort(clusters.begin(), clusters.end(), compareClusters);
-        std::vector<pcl::PointCloud<pcl::PointXYZ> > cluster_clouds;
-        cluster_clouds.reserve(num_clusters_);
+        extractClusters(*border_pcl, *border_normals, valid, *tree, clusters);
+        selectLargestClusters(clusters);
+    }
+    stats.mark("clusters");
+    if(isCancelled()) return false;
 
-        geometry_msgs::PoseArray nbv_pose_array;
+    geometry_msgs::PoseArray nbv_pose_array;
 
-        for(unsigned int nc = 0; nc < clusters.size(); nc++) {
-            if(nc == num_clusters_)
-                break;
+    // boundary points of a cluster only consider neighbors in the same cluster:
+    std::vector<int> cluster_label(border_pcl->size(), -1);
+    for(size_t nc = 0; nc < clusters.size(); nc++)
+        for(size_t j = 0; j < clusters[nc].indices.size(); j++)
+            cluster_label[clusters[nc].indices[j]] = nc;
 
-            // extract a cluster:
-            pcl::PointCloud<pcl::PointXYZ> cluster_pcl;
-            cluster_pcl.header = border_pcl.header;
-            extract.setInputCloud(boost::make_shared<pcl::PointCloud<pcl::PointXYZ> >(border_pcl));
-            extract.setIndices(boost::make_shared<const pcl::PointIndices>(clusters.back()));
-            extract.setNegative(false);
-            extract.filter(cluster_pcl);
-            // extract normals of cluster:
-            pcl::PointCloud<pcl::Normal> cluster_normals;
-            cluster_normals.header = border_pcl.header;
-            nextract.setInputCloud(boost::make_shared<pcl::PointCloud<pcl::Normal> >(border_normals));
-            nextract.setIndices(boost::make_shared<const pcl::PointIndices>(clusters.back()));
-            nextract.setNegative(false);
-            nextract.filter(cluster_normals);
-            // find boundary points of cluster:
-            pcl::search::KdTree<pcl::PointXYZ>::Ptr tree3 = boost::make_shared<pcl::search::KdTree<pcl::PointXYZ> >();
-            tree3->setInputCloud(boost::make_shared<pcl::PointCloud<pcl::PointXYZ> >(cluster_pcl));
-            pcl::PointCloud<pcl::Boundary> boundary_pcl;
-            pcl::BoundaryEstimation<pcl::PointXYZ, pcl::Normal, pcl::Boundary> be;
-            be.setSearchMethod(tree3);
-            be.setInputCloud(boost::make_shared<pcl::PointCloud<pcl::PointXYZ> >(cluster_pcl));
-            be.setInputNormals(boost::make_shared<pcl::PointCloud<pcl::Normal> >(cluster_normals));
-            be.setRadiusSearch(0.5);
-            be.setAngleThreshold(boundary_angle_threshold_);
-            be.compute(boundary_pcl);
+    pcl::BoundaryEstimation<pcl::PointXYZ, pcl::Normal, pcl::Boundary> be;
+    std::vector<int> nn_indices, cluster_nn_indices;
+    std::vector<float> nn_dists;
+    Eigen::Vector4f u = Eigen::Vector4f::Zero(), v = Eigen::Vector4f::Zero();
+    for(size_t nc = 0; nc < clusters.size(); nc++)
+    {
+        for(size_t j = 0; j < clusters[nc].indices.size(); j++)
+        {
+            const int i = clusters[nc].indices[j];
+            tree->radiusSearch((*border_pcl)[i], boundary_search_radius, nn_indices, nn_dists);
+            cluster_nn_indices.clear();
+            for(size_t k = 0; k < nn_indices.size(); k++)
+                if(cluster_label[nn_indices[k]] == (int)nc)
+                    cluster_nn_indices.push_back(nn_indices[k]);
+            if(cluster_nn_indices.empty())
+                continue;
+
+            const pcl::Normal& normal = (*border_normals)[i];
+            be.getCoordinateSystemOnPlane(normal, u, v);
+            if(!be.isBoundaryPoint(*border_pcl, i, cluster_nn_indices, u, v, boundary_angle_threshold_))
+                continue;
 
             geometry_msgs::Pose nbv_pose;
-            for (unsigned int i = 0; i < boundary_pcl.points.size(); ++i) {
-                if (boundary_pcl.points[i].boundary_point) {
-                    nbv_pose.position.x = cluster_pcl.points[i].x;
-                    nbv_pose.position.y = cluster_pcl.points[i].y;
-                    nbv_pose.position.z = cluster_pcl.points[i].z;
-                    tf::Vector3 axis(0, -cluster_normals.points[i].normal[2],
-                            cluster_normals.points[i].normal[1]);
-                    tf::Quaternion quat(axis, axis.length());
-                    geometry_msgs::Quaternion quat_msg;
-                    tf::quaternionTFToMsg(quat, quat_msg);
-                    nbv_pose.orientation = quat_msg;
-                    nbv_pose_array.poses.push_back(nbv_pose);
-                }
-            }
+            nbv_pose.position.x = (*border_pcl)[i].x;
+            nbv_pose.position.y = (*border_pcl)[i].y;
+            nbv_pose.position.z = (*border_pcl)[i].z;
+            tf::Vector3 axis(0, -normal.normal_z, normal.normal_y);
+            tf::Quaternion quat(axis, axis.length());
+            tf::quaternionTFToMsg(quat, nbv_pose.orientation);
+            nbv_pose_array.poses.push_back(nbv_pose);
+        }
+    }
+    stats.mark("boundary");
+    if(isCancelled()) return false;
+
+    // rank candidates by information gain:
+    std_msgs::Float32MultiArray gains_msg;
+    if(score_candidates_ && !nbv_pose_array.poses.empty())
+    {
+        std::vector<double> gains;
+        scoreCandidates(nbv_pose_array.poses, gains);
 
-            cluster_clouds.push_back(cluster_pcl);
+        std::vector<std::pair<double, size_t> > ranked;
+        for(size_t i = 0; i < gains.size(); i++)
+            if(gains[i] >= min_information_gain_)
+                ranked.push_back(std::make_pair(gains[i], i));
+        std::sort(ranked.begin(), ranked.end(), std::greater<std::pair<double, size_t> >());
 
-            // pop the just used cluster from indices:
-            clusters.pop_back();
+        std::vector<geometry_msgs::Pose> ranked_poses(ranked.size());
+        gains_msg.data.resize(ranked.size());
+        for(size_t i = 0; i < ranked.size(); i++)
+        {
+            ranked_poses[i] = nbv_pose_array.poses[ranked[i].second];
+            gains_msg.data[i] = ranked[i].first;
         }
+        nbv_pose_array.poses.swap(ranked_poses);
+        stats.mark("scoring");
+        if(isCancelled()) return false;
+    }
 
+    if(!clusters.empty())
+    {
         // visualize pose array:
-        nbv_pose_array.header.frame_id = border_pcl.header.frame_id;
-        nbv_pose_array.header.stamp = ros::Time::now();
+        nbv_pose_array.header.frame_id = border_pcl->header.frame_id;
+        nbv_pose_array.header.stamp = map_stamp_;
         posearray_pub_.publish(nbv_pose_array);
+        if(score_candidates_)
+            gains_pub_.publish(gains_msg);
 
-        // visualize cluster pcls:
-        for(int i = 0; i < num_clusters_; i++)
+        // visualize cluster pcls (the only copies of cluster points):
+        for(size_t i = 0; i < clusters.size(); i++)
         {
+            if(cluster_pub_[i].getNumSubscribers() == 0)
+                continue;
+            pcl::PointCloud<pcl::PointXYZ> cluster_pcl;
+            pcl::copyPointCloud(*border_pcl, clusters[i].indices, cluster_pcl);
+            cluster_pcl.header = border_pcl->header;
             sensor_msgs::PointCloud2 cluster_pcl_msg;
-            pcl::toROSMsg(cluster_clouds[i], cluster_pcl_msg);
+            pcl::toROSMsg(cluster_pcl, cluster_pcl_msg);
+            cluster_pcl_msg.header.stamp = map_stamp_;
             cluster_pub_[i].publish(cluster_pcl_msg);
         }
     }
+    stats.mark("publish");
+    stats.add("frontier points", border_pcl->size());
+    stats.add("clusters", clusters.size());
+    stats.add("poses", nbv_pose_array.poses.size());
+
+#ifdef NBV_COUNT_ALLOCATIONS
+    ROS_INFO("computed %ld next best views from %ld frontier points in %ld clusters: %.1f ms (%s), %ld allocations (%ld bytes); map age %.3f s",
+            nbv_pose_array.poses.size(), border_pcl->size(), clusters.size(), stats.totalTime() * 1e3,
+            stats.stages().c_str(), stats.allocations(), stats.allocatedBytes(), (ros::Time::now() - map_stamp_).toSec());
+#else
+    ROS_INFO("computed %ld next best views from %ld frontier points in %ld clusters: %.1f ms (%s); map age %.3f s",
+            nbv_pose_array.poses.size(), border_pcl->size(), clusters.size(), stats.totalTime() * 1e3,
+            stats.stages().c_str(), (ros::Time::now() - map_stamp_).toSec());
+#endif
+    return true;
+}
+
+
+bool NextBestView::isCancelled() const
+{
+    return cancel_.load(boost::memory_order_relaxed);
+}
+
+
+bool NextBestView::hasPendingMap()
+{
+    boost::mutex::scoped_lock lock(map_mutex_);
+    return pending_map_.get() != 0 || !pending_updates_.empty();
+}
+
+
+/**
+ * Resubscribe to full maps, after updates were lost.
+ */
+void NextBestView::requestFullMap()
+{
+    boost::mutex::scoped_lock lock(map_mutex_);
+    if(octree_sub_) return;
+    ROS_WARN("octomap updates lost; resynchronizing from a full map");
+    octree_sub_ = nh_.subscribe<octomap_msgs::Octomap>("octree_in", 1, &NextBestView::onOctomap, this);
+}
+
+
+/**
+ * Apply a full map and/or partial updates (in this order) to the map and
+ * to the frontier. Returns false if nothing changed.
+ *
+ * For updates, the leafs overlapping each updated box are collected
+ * before merging it, so that the frontier diff is limited to the changed
+ * region.
+ */
+bool NextBestView::applyMaps(const octomap_msgs::Octomap::ConstPtr& map, const std::vector<octomap_path_planner::OctomapUpdate::ConstPtr>& updates)
+{
+    bool applied = false;
+
+    if(map)
+    {
+        OcTreeConstPtr octree;
+        OctomapRegion changed;
+        if(!incremental_updates_)
+            octree = OctomapStore::instance().get(map);
+        else if(incremental_map_.setFullMap(*map, changed))
+            octree = incremental_map_.tree();
+        if(octree)
+        {
+            octree_ptr_ = octree;
+            map_stamp_ = map->header.stamp;
+            frontier_changes_ += updateFrontier();
+            applied = true;
+        }
+    }
+
+    octomap::KeySet old_leafs;
+    OctomapRegion changed;
+    for(size_t i = 0; i < updates.size(); i++)
+    {
+        boost::shared_ptr<octomap::OcTree> tree = incremental_map_.tree();
+        octomap::OcTreeKey min, max;
+        if(incremental_map_.isSynchronized() && incremental_map_.getUpdateBounds(*updates[i], min, max))
+        {
+            for(octomap::OcTree::leaf_bbx_iterator it = tree->begin_leafs_bbx(min, max, frontier_depth_); it != tree->end_leafs_bbx(); ++it)
+                old_leafs.insert(it.getIndexKey());
+        }
+        if(!incremental_map_.applyUpdate(*updates[i], changed))
+        {
+            requestFullMap();
+            break;
+        }
+        if(updates[i]->header.stamp > map_stamp_)
+            map_stamp_ = updates[i]->header.stamp;
+    }
+
+    if(changed.empty) return applied;
+
+    octree_ptr_ = incremental_map_.tree();
+    frontier_changes_ += updateFrontier(old_leafs, changed);
+    return true;
+}
+
+
+/**
+ * Apply maps to the frontier, and compute next best views if the frontier
+ * changed enough since the last computation (by min_frontier_change, as a
+ * fraction of the frontier size), at most once per min_computation_interval,
+ * and no newer map is already waiting.
+ *
+ * A computation that is due too soon is deferred: the worker calls this
+ * again without maps once the interval has elapsed.
+ */
+void NextBestView::processMap(const octomap_msgs::Octomap::ConstPtr& map, const std::vector<octomap_path_planner::OctomapUpdate::ConstPtr>& updates)
+{
+    StageStats stats("next_best_view");
+    const bool applied = (map || !updates.empty()) && applyMaps(map, updates);
+    if(!applied && !deferred_) return;
+    stats.mark("frontier");
+    stats.setMapStamp(map_stamp_);
+    stats.add("frontier leafs", frontier_.size());
+
+    const bool frontier_changed = !have_results_ || (frontier_changes_ > 0 && frontier_changes_ >= min_frontier_change_ * frontier_.size());
+    const bool interval_elapsed = !((last_computation_time_ + ros::Duration(min_computation_interval_)) > ros::Time::now());
+    deferred_ = frontier_changed && !interval_elapsed;
+
+    if(frontier_changed && interval_elapsed)
+    {
+        // a map arriving from now on cancels this computation:
+        computing_ = true;
+        cancel_ = false;
+        if(!hasPendingMap())
+        {
+            if(computeNextBestViews(stats))
+            {
+                last_computation_time_ = ros::Time::now();
+                frontier_changes_ = 0;
+                have_results_ = true;
+            }
+            else
+            {
+                ROS_DEBUG("next best view computation cancelled by a newer map");
+            }
+        }
+        computing_ = false;
+    }
+
+    stats.publish(timing_pub_);
+    tracer_.add(stats, map_stamp_);
+    tracer_.flush();
+}
+
+
+/**
+ * Background worker: always processes the latest received map, and all
+ * the updates received since the last run, or a deferred computation.
+ */
+void NextBestView::worker()
+{
+    while(true)
+    {
+        octomap_msgs::Octomap::ConstPtr map;
+        std::vector<octomap_path_planner::OctomapUpdate::ConstPtr> updates;
+        {
+            boost::mutex::scoped_lock lock(map_mutex_);
+            while(!pending_map_ && pending_updates_.empty() && !shutdown_)
+            {
+                if(!deferred_)
+                {
+                    map_cond_.wait(lock);
+                    continue;
+                }
+                // run the deferred computation on the current map when due:
+                double wait = (last_computation_time_ + ros::Duration(min_computation_interval_) - ros::Time::now()).toSec();
+                if(wait <= 0.0) break;
+                map_cond_.timed_wait(lock, boost::posix_time::microseconds((int64_t)(wait * 1e6) + 1));
+            }
+            if(shutdown_) return;
+            map.swap(pending_map_);
+            updates.swap(pending_updates_);
+        }
+        processMap(map, updates);
+    }
 }
 
 
 /**
  * Octomap callback.
  *
- * It will skip if trying to compute poses more frequently than min_goal_interval.
+ * Hands the map over to the worker, replacing any map not yet processed,
+ * and cancels a computation running on an older map.
  */
 void NextBestView::onOctomap(const octomap_msgs::Octomap::ConstPtr& map)
 {
-    if((last_computation_time_ + ros::Duration(min_computation_interval_, 0)) > ros::Time::now())
-        return;
+    {
+        boost::mutex::scoped_lock lock(map_mutex_);
+        pending_map_ = map;
+        // with incremental_updates, a full map is only needed to
+        // (re)synchronize:
+        if(incremental_updates_)
+        {
+            octree_sub_.shutdown();
+            octree_sub_ = ros::Subscriber();
+        }
+    }
+    if(computing_) cancel_ = true;
+    map_cond_.notify_one();
+}
+
 
-    if(octree_ptr_) delete octree_ptr_;
-    octree_ptr_ = octomap_msgs::binaryMsgToMap(*map);
+/**
+ * Partial map update callback: queues the update for the worker (which
+ * owns the map), and cancels a computation running on an older map.
+ */
+void NextBestView::onOctomapUpdate(const octomap_path_planner::OctomapUpdate::ConstPtr& update)
+{
+    {
+        boost::mutex::scoped_lock lock(map_mutex_);
+        pending_updates_.push_back(update);
+    }
+    if(computing_) cancel_ = true;
+    map_cond_.notify_one();
+}
+
+
+#ifdef OCTOMAP_PATH_PLANNER_NODELET
 
-    last_computation_time_ = ros::Time::now();
-    computeNextBestViews();
+namespace octomap_path_planner
+{
+    /**
+     * Nodelet version, sharing decoded maps with the other planner nodelets
+     * in the same manager through OctomapStore.
+     */
+    class NextBestViewNodelet : public nodelet::Nodelet
+    {
+    protected:
+        boost::shared_ptr<NextBestView> nbv_;
+
+        virtual void onInit()
+        {
+            nbv_.reset(new NextBestView(getNodeHandle(), getPrivateNodeHandle()));
+        }
+    };
 }
 
+PLUGINLIB_EXPORT_CLASS(octomap_path_planner::NextBestViewNodelet, nodelet::Nodelet)
+
+#else
 
 int main(int argc, char **argv)
 {
@@ -310,3 +1739,5 @@ int main(int argc, char **argv)
 
     return 0;
 }
+
+#endif // OCTOMAP_PATH_PLANNER_NODELET
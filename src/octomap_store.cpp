@@ -0,0 +1,64 @@
+#include <octomap_msgs/conversions.h>
+
+#include <octomap_path_planner/octomap_store.h>
+
+
+OctomapStore::OctomapStore()
+    : last_seq_(0), num_decoded_(0), num_shared_(0)
+{
+}
+
+
+OctomapStore& OctomapStore::instance()
+{
+    static OctomapStore store;
+    return store;
+}
+
+
+/**
+ * A revision is the same message object (as delivered to all subscribers
+ * in a process), or a message with the same frame, stamp and sequence.
+ */
+bool OctomapStore::isSameRevision(const octomap_msgs::Octomap::ConstPtr& msg) const
+{
+    octomap_msgs::Octomap::ConstPtr last_msg = last_msg_.lock();
+    if(last_msg == msg) return true;
+    return msg->header.seq == last_seq_ && msg->header.stamp == last_stamp_ && msg->header.frame_id == last_frame_id_;
+}
+
+
+/**
+ * Get the decoded tree for a map message, decoding it only if no consumer
+ * holds the tree of the same revision anymore. Returns NULL if the
+ * message can't be decoded.
+ */
+OcTreeConstPtr OctomapStore::get(const octomap_msgs::Octomap::ConstPtr& msg)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if(isSameRevision(msg))
+    {
+        OcTreeConstPtr tree = last_tree_.lock();
+        if(tree)
+        {
+            num_shared_++;
+            return tree;
+        }
+    }
+
+    OcTreeConstPtr tree(octomap_msgs::binaryMsgToMap(*msg));
+    if(!tree)
+    {
+        ROS_ERROR("failed to decode octomap");
+        return tree;
+    }
+    num_decoded_++;
+
+    last_msg_ = msg;
+    last_frame_id_ = msg->header.frame_id;
+    last_stamp_ = msg->header.stamp;
+    last_seq_ = msg->header.seq;
+    last_tree_ = tree;
+    return tree;
+}
@@ -0,0 +1,229 @@
+#include <cmath>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+
+#include <ros/ros.h>
+#include <octomap/octomap.h>
+#include <octomap/OcTree.h>
+#include <octomap_msgs/Octomap.h>
+#include <octomap_msgs/conversions.h>
+
+#include <octomap_path_planner/OctomapUpdate.h>
+#include <octomap_path_planner/incremental_octomap.h>
+
+
+/**
+ * Turns the full maps of a mapper that publishes only full maps (such as
+ * octomap_server's octomap_binary) into OctomapUpdate messages for the
+ * nodes run with ~incremental_updates: each map is compared with the
+ * previous one, and the bounding box of the leafs that differ is
+ * published together with the part of the new map inside it.
+ *
+ * The nodes still synchronize from the full maps (octree_in), so they
+ * must receive the same maps as the relay. Several separate changes are
+ * covered by one box, which then also contains unchanged space between
+ * them; maps without any change publish nothing. If the resolution of the
+ * maps changes, a sequence number is skipped so that the nodes
+ * resynchronize.
+ */
+class OctomapUpdateRelay
+{
+public:
+    OctomapUpdateRelay();
+    void onOctomap(const octomap_msgs::Octomap::ConstPtr& msg);
+
+protected:
+    void diffNode(const octomap::OcTree& a, const octomap::OcTreeNode *na, const octomap::OcTree& b, const octomap::OcTreeNode *nb, const octomap::OcTreeKey& key, unsigned depth, OctomapRegion& changed);
+    void copyNode(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src);
+    void copyBox(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src, const octomap::OcTreeKey& key, unsigned depth, unsigned tree_depth, const octomap::OcTreeKey& min, const octomap::OcTreeKey& max);
+
+    ros::NodeHandle nh_;
+    ros::NodeHandle pnh_;
+    ros::Subscriber octree_sub_;
+    ros::Publisher update_pub_;
+    int queue_size_;
+    boost::shared_ptr<octomap::OcTree> previous_;
+    uint32_t sequence_;
+};
+
+
+OctomapUpdateRelay::OctomapUpdateRelay()
+    : pnh_("~"),
+      queue_size_(10),
+      sequence_(0)
+{
+    // a map dropped here would make the next update miss the changes that
+    // were undone since, for nodes that synchronized from that map
+    pnh_.param("queue_size", queue_size_, queue_size_);
+    if(queue_size_ < 1)
+    {
+        ROS_ERROR("queue_size must be positive; using 10");
+        queue_size_ = 10;
+    }
+
+    octree_sub_ = nh_.subscribe<octomap_msgs::Octomap>("octree_in", queue_size_, &OctomapUpdateRelay::onOctomap, this);
+    update_pub_ = nh_.advertise<octomap_path_planner::OctomapUpdate>("octree_update_out", queue_size_, false);
+}
+
+
+/**
+ * Add the keys of the parts of node na of tree a and node nb of tree b (at
+ * depth, with index key key; NULL if unknown) that differ to changed.
+ */
+void OctomapUpdateRelay::diffNode(const octomap::OcTree& a, const octomap::OcTreeNode *na, const octomap::OcTree& b, const octomap::OcTreeNode *nb, const octomap::OcTreeKey& key, unsigned depth, OctomapRegion& changed)
+{
+    if(!na && !nb) return;
+
+    const unsigned span = 1 << (a.getTreeDepth() - depth);
+    const octomap::OcTreeKey key_max(key[0] + span - 1, key[1] + span - 1, key[2] + span - 1);
+
+    // a pruned leaf and its expanded equivalent also count as changed,
+    // which is harmless: the update just covers more than needed
+    if(!na || !nb || na->hasChildren() != nb->hasChildren())
+    {
+        changed.add(key, key_max);
+        return;
+    }
+
+    if(!na->hasChildren())
+    {
+        if(a.isNodeOccupied(na) != b.isNodeOccupied(nb))
+            changed.add(key, key_max);
+        return;
+    }
+
+    const unsigned child_span = span / 2;
+    for(unsigned i = 0; i < 8; i++)
+    {
+        octomap::OcTreeKey ck;
+        for(int k = 0; k < 3; k++)
+            ck[k] = key[k] + ((i & (1 << k)) ? child_span : 0);
+        diffNode(a, na->childExists(i) ? na->getChild(i) : 0, b, nb->childExists(i) ? nb->getChild(i) : 0, ck, depth + 1, changed);
+    }
+}
+
+
+void OctomapUpdateRelay::copyNode(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src)
+{
+    dst->setLogOdds(src->getLogOdds());
+    if(!src->hasChildren()) return;
+    for(unsigned i = 0; i < 8; i++)
+    {
+        if(!src->childExists(i)) continue;
+        dst->createChild(i);
+        copyNode(dst->getChild(i), src->getChild(i));
+    }
+}
+
+
+/**
+ * Copy the children of src (a node at depth, with index key key) that
+ * overlap the box [min, max] to dst. Leafs straddling the box are copied
+ * whole: the receiver only uses the part of the update inside the box.
+ */
+void OctomapUpdateRelay::copyBox(octomap::OcTreeNode *dst, const octomap::OcTreeNode *src, const octomap::OcTreeKey& key, unsigned depth, unsigned tree_depth, const octomap::OcTreeKey& min, const octomap::OcTreeKey& max)
+{
+    dst->setLogOdds(src->getLogOdds());
+    const unsigned child_span = 1 << (tree_depth - depth - 1);
+
+    for(unsigned i = 0; i < 8; i++)
+    {
+        if(!src->childExists(i)) continue;
+
+        octomap::OcTreeKey ck;
+        bool overlaps = true, inside = true;
+        for(int a = 0; a < 3; a++)
+        {
+            ck[a] = key[a] + ((i & (1 << a)) ? child_span : 0);
+            const unsigned ck_max = ck[a] + child_span - 1;
+            if(ck_max < min[a] || ck[a] > max[a]) overlaps = false;
+            if(ck[a] < min[a] || ck_max > max[a]) inside = false;
+        }
+        if(!overlaps) continue;
+
+        const octomap::OcTreeNode *src_child = src->getChild(i);
+        dst->createChild(i);
+        if(inside || !src_child->hasChildren())
+            copyNode(dst->getChild(i), src_child);
+        else
+            copyBox(dst->getChild(i), src_child, ck, depth + 1, tree_depth, min, max);
+    }
+}
+
+
+void OctomapUpdateRelay::onOctomap(const octomap_msgs::Octomap::ConstPtr& msg)
+{
+    boost::shared_ptr<octomap::OcTree> tree(octomap_msgs::binaryMsgToMap(*msg));
+    if(!tree)
+    {
+        ROS_ERROR("failed to decode octomap");
+        return;
+    }
+
+    boost::shared_ptr<octomap::OcTree> previous = previous_;
+    previous_ = tree;
+
+    if(!previous) return;
+
+    if(previous->getResolution() != tree->getResolution() || previous->getTreeDepth() != tree->getTreeDepth())
+    {
+        ROS_WARN("octomap resolution changed; the nodes will resynchronize from a full map");
+        sequence_++;
+        return;
+    }
+
+    OctomapRegion changed;
+    diffNode(*previous, previous->getRoot(), *tree, tree->getRoot(), octomap::OcTreeKey(0, 0, 0), 0, changed);
+    if(changed.empty) return;
+
+    // the box of the changed keys, as the centers of its corner voxels
+    const octomap::OcTreeKey& min = changed.min;
+    const octomap::OcTreeKey& max = changed.max;
+    const double resolution = tree->getResolution();
+    const double max_val = 1 << (tree->getTreeDepth() - 1);
+
+    octomap_path_planner::OctomapUpdate update;
+    update.header = msg->header;
+    update.sequence = ++sequence_;
+    update.bbx_min.x = (min[0] - max_val + 0.5) * resolution;
+    update.bbx_min.y = (min[1] - max_val + 0.5) * resolution;
+    update.bbx_min.z = (min[2] - max_val + 0.5) * resolution;
+    update.bbx_max.x = (max[0] - max_val + 0.5) * resolution;
+    update.bbx_max.y = (max[1] - max_val + 0.5) * resolution;
+    update.bbx_max.z = (max[2] - max_val + 0.5) * resolution;
+
+    octomap::OcTree box(resolution);
+    if(tree->getRoot())
+    {
+        // create the root through a voxel in the box, and drop the path
+        // to it again
+        box.updateNode(min, 0.0f);
+        octomap::OcTreeNode *root = box.getRoot();
+        for(unsigned i = 0; i < 8; i++)
+            if(root->childExists(i)) root->deleteChild(i);
+        copyBox(root, tree->getRoot(), octomap::OcTreeKey(0, 0, 0), 0, tree->getTreeDepth(), min, max);
+    }
+    if(!octomap_msgs::binaryMapToMsg(box, update.octomap))
+    {
+        ROS_ERROR("failed to encode octomap update");
+        sequence_++;
+        return;
+    }
+    update.octomap.header = msg->header;
+
+    ROS_DEBUG("octomap update %u: [%.2f %.2f %.2f] - [%.2f %.2f %.2f]", update.sequence,
+            update.bbx_min.x, update.bbx_min.y, update.bbx_min.z, update.bbx_max.x, update.bbx_max.y, update.bbx_max.z);
+    update_pub_.publish(update);
+}
+
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "octomap_update_relay");
+
+    OctomapUpdateRelay relay;
+    ros::spin();
+
+    return 0;
+}
@@ -0,0 +1,580 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+
+#include <ros/ros.h>
+#include <ros/master.h>
+#include <ros/network.h>
+#include <XmlRpc.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+
+#include <octomap/octomap.h>
+#include <octomap_msgs/Octomap.h>
+#include <octomap_msgs/conversions.h>
+
+
+/**
+ * End-to-end performance regression benchmark of the planner nodes.
+ *
+ * Feeds a set of maps (recorded octomap files, or built-in synthetic
+ * scenes, from a single room floor up to a multi-floor site) to the
+ * running navigation_function and next_best_view nodes (see
+ * launch/benchmark.launch), collects the per-stage wall times and result
+ * sizes they publish on their timing topic, and the peak memory of their
+ * processes, and compares them against a baseline file with tolerances.
+ * The peak memory is that of the whole benchmark (metric all/NODE/peak_kb),
+ * since a process' high-water mark can't be attributed to one map; to
+ * measure it for one map, run the benchmark on that map alone.
+ * The exit status is non-zero on regressions, so it can be used as a
+ * regression gate.
+ *
+ * Each run starts from an empty map, so that the nodes process every map
+ * from scratch; stage times are the median over the runs.
+ *
+ * Run as a rostest (test/benchmark.test), it also writes the comparison
+ * as a JUnit result file, one test case per baseline metric.
+ */
+struct BenchmarkOptions
+{
+    std::vector<std::string> maps;
+    std::vector<std::string> nodes;
+    std::string frame_id;
+    int runs;
+    double timeout;
+    std::string baseline_file;
+    std::string write_baseline_file;
+    std::string result_file;
+    double time_tolerance;
+    double time_slack;
+    double memory_tolerance;
+    double count_tolerance;
+
+    BenchmarkOptions()
+        : frame_id("/map"),
+          runs(3),
+          timeout(300.0),
+          time_tolerance(0.25),
+          time_slack(1.0),
+          memory_tolerance(0.10),
+          count_tolerance(0.01)
+    {
+    }
+};
+
+// metric name -> value; names end in _ms (stage time), _kb (peak memory),
+// or are result sizes (counts)
+typedef std::map<std::string, double> Metrics;
+
+
+/**
+ * Synthetic scene: levels of rooms (walls with a doorway in the middle of
+ * each side) with floor and ceiling slabs and free space in between. The
+ * last row of rooms of each level is left unobserved, so that there is a
+ * frontier to explore.
+ */
+static boost::shared_ptr<octomap::OcTree> makeSyntheticScene(const std::string& name)
+{
+    double size, resolution = 0.1, level_height = 2.0, room_size = 5.0, door_width = 1.0;
+    int levels;
+    if(name == "small") {size = 10.0; levels = 1;}
+    else if(name == "medium") {size = 20.0; levels = 2;}
+    else if(name == "large") {size = 40.0; levels = 3;}
+    else return boost::shared_ptr<octomap::OcTree>();
+
+    boost::shared_ptr<octomap::OcTree> tree(new octomap::OcTree(resolution));
+    const int n = (int)(size / resolution), nz = (int)(level_height / resolution);
+    const int room = (int)(room_size / resolution), door = (int)(door_width / resolution);
+    const int door_min = (room - door) / 2, door_max = (room + door) / 2;
+
+    for(int l = 0; l < levels; l++)
+    {
+        for(int y = 0; y < n - room; y++)
+        {
+            for(int x = 0; x < n; x++)
+            {
+                const bool wall = (x % room == 0 && (y % room < door_min || y % room >= door_max))
+                    || (y % room == 0 && (x % room < door_min || x % room >= door_max));
+                for(int z = 0; z < nz; z++)
+                {
+                    const bool occupied = z == 0 || z == nz - 1 || wall;
+                    octomap::point3d p((x + 0.5) * resolution - 0.5 * size, (y + 0.5) * resolution - 0.5 * size, l * level_height + (z + 0.5) * resolution);
+                    tree->updateNode(p, occupied, true);
+                }
+            }
+        }
+    }
+
+    tree->updateInnerOccupancy();
+    tree->prune();
+    return tree;
+}
+
+
+/**
+ * Load a map: "synthetic:NAME" (small, medium or large), or an octomap
+ * file (.bt or .ot).
+ */
+static boost::shared_ptr<octomap::OcTree> loadMap(const std::string& map)
+{
+    boost::shared_ptr<octomap::OcTree> tree;
+    if(map.compare(0, 10, "synthetic:") == 0)
+    {
+        tree = makeSyntheticScene(map.substr(10));
+    }
+    else if(map.size() > 3 && map.compare(map.size() - 3, 3, ".bt") == 0)
+    {
+        tree.reset(new octomap::OcTree(0.1));
+        if(!tree->readBinary(map)) tree.reset();
+    }
+    else
+    {
+        tree.reset(dynamic_cast<octomap::OcTree*>(octomap::AbstractOcTree::read(map)));
+    }
+    return tree;
+}
+
+
+static std::string mapName(const std::string& map)
+{
+    std::string name = map.substr(map.find_last_of("/:") + 1);
+    return name.substr(0, name.find('.'));
+}
+
+
+static std::string metricName(const std::string& s)
+{
+    std::string name(s);
+    std::replace(name.begin(), name.end(), ' ', '_');
+    return name;
+}
+
+
+/**
+ * Get the pid of a node through its XML-RPC API.
+ */
+static int getNodePid(const std::string& node)
+{
+    XmlRpc::XmlRpcValue args, result, payload;
+    args[0] = ros::this_node::getName();
+    args[1] = node;
+    if(!ros::master::execute("lookupNode", args, result, payload, false))
+        return -1;
+
+    std::string host;
+    uint32_t port;
+    if(!ros::network::splitURI(static_cast<std::string>(payload), host, port))
+        return -1;
+
+    XmlRpc::XmlRpcClient client(host.c_str(), port, "/");
+    XmlRpc::XmlRpcValue pid_args, pid_result;
+    pid_args[0] = ros::this_node::getName();
+    if(!client.execute("getPid", pid_args, pid_result) || pid_result.getType() != XmlRpc::XmlRpcValue::TypeArray || static_cast<int>(pid_result[0]) != 1)
+        return -1;
+    return static_cast<int>(pid_result[2]);
+}
+
+
+/**
+ * Peak resident memory (kB) of a local process, or -1 if not available.
+ */
+static long getPeakMemory(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    std::ifstream f(path);
+    std::string line;
+    while(std::getline(f, line))
+    {
+        if(line.compare(0, 6, "VmHWM:") == 0)
+            return atol(line.c_str() + 6);
+    }
+    return -1;
+}
+
+
+static double median(std::vector<double> v)
+{
+    if(v.empty()) return 0.0;
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+
+
+static bool readMetrics(const std::string& file, Metrics& metrics)
+{
+    std::ifstream f(file.c_str());
+    if(!f) return false;
+    std::string line;
+    while(std::getline(f, line))
+    {
+        if(line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        std::string name;
+        double value;
+        if(ss >> name >> value)
+            metrics[name] = value;
+    }
+    return true;
+}
+
+
+static bool writeMetrics(const std::string& file, const Metrics& metrics)
+{
+    std::ofstream f(file.c_str());
+    if(!f) return false;
+    f << "# planner_benchmark baseline: metric value" << std::endl;
+    for(Metrics::const_iterator it = metrics.begin(); it != metrics.end(); ++it)
+        f << it->first << " " << it->second << std::endl;
+    return true;
+}
+
+
+class PlannerBenchmark
+{
+public:
+    PlannerBenchmark(const BenchmarkOptions& opts);
+    bool waitForNodes();
+    bool runMap(const std::string& map, const octomap::OcTree& tree, Metrics& metrics);
+    void measureMemory(Metrics& metrics);
+
+protected:
+    void onTiming(const diagnostic_msgs::DiagnosticArray::ConstPtr& msg);
+    bool publishAndWait(const octomap::OcTree& tree, std::vector<diagnostic_msgs::DiagnosticStatus>& statuses);
+
+    const BenchmarkOptions& opts_;
+    ros::NodeHandle nh_;
+    ros::Publisher map_pub_;
+    ros::Subscriber timing_sub_;
+    std::string expected_stamp_;
+    std::vector<diagnostic_msgs::DiagnosticStatus> received_;
+};
+
+
+PlannerBenchmark::PlannerBenchmark(const BenchmarkOptions& opts)
+    : opts_(opts)
+{
+    map_pub_ = nh_.advertise<octomap_msgs::Octomap>("octomap_out", 1, false);
+    timing_sub_ = nh_.subscribe<diagnostic_msgs::DiagnosticArray>("timing_in", 10, &PlannerBenchmark::onTiming, this);
+}
+
+
+bool PlannerBenchmark::waitForNodes()
+{
+    ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration(opts_.timeout);
+    while(ros::ok() && ros::WallTime::now() < deadline)
+    {
+        if(map_pub_.getNumSubscribers() >= opts_.nodes.size() && timing_sub_.getNumPublishers() >= opts_.nodes.size())
+            return true;
+        ros::spinOnce();
+        ros::WallDuration(0.01).sleep();
+    }
+    return false;
+}
+
+
+void PlannerBenchmark::onTiming(const diagnostic_msgs::DiagnosticArray::ConstPtr& msg)
+{
+    for(size_t i = 0; i < msg->status.size(); i++)
+    {
+        const diagnostic_msgs::DiagnosticStatus& status = msg->status[i];
+        for(size_t j = 0; j < status.values.size(); j++)
+        {
+            if(status.values[j].key == "map stamp" && status.values[j].value == expected_stamp_)
+                received_.push_back(status);
+        }
+    }
+}
+
+
+/**
+ * Publish a map and wait for the timing of every node for it.
+ */
+bool PlannerBenchmark::publishAndWait(const octomap::OcTree& tree, std::vector<diagnostic_msgs::DiagnosticStatus>& statuses)
+{
+    octomap_msgs::Octomap msg;
+    if(!octomap_msgs::binaryMapToMsg(tree, msg))
+        return false;
+    msg.header.frame_id = opts_.frame_id;
+    msg.header.stamp = ros::Time::now();
+
+    char stamp[32];
+    snprintf(stamp, sizeof(stamp), "%u.%09u", (unsigned)msg.header.stamp.sec, (unsigned)msg.header.stamp.nsec);
+    expected_stamp_ = stamp;
+    received_.clear();
+
+    map_pub_.publish(msg);
+
+    ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration(opts_.timeout);
+    while(ros::ok() && received_.size() < opts_.nodes.size())
+    {
+        if(ros::WallTime::now() > deadline)
+            return false;
+        ros::spinOnce();
+        ros::WallDuration(0.001).sleep();
+    }
+    statuses = received_;
+    return true;
+}
+
+
+/**
+ * Run a map opts.runs times; metrics are named map/node/value.
+ */
+bool PlannerBenchmark::runMap(const std::string& map, const octomap::OcTree& tree, Metrics& metrics)
+{
+    const octomap::OcTree empty(tree.getResolution());
+    std::map<std::string, std::vector<double> > stage_times;
+
+    for(int r = 0; r < opts_.runs; r++)
+    {
+        std::vector<diagnostic_msgs::DiagnosticStatus> statuses;
+        if(!publishAndWait(empty, statuses) || !publishAndWait(tree, statuses))
+        {
+            std::cerr << "timed out waiting for the nodes to process " << map << std::endl;
+            return false;
+        }
+
+        for(size_t i = 0; i < statuses.size(); i++)
+        {
+            const std::string prefix = map + "/" + statuses[i].name + "/";
+            for(size_t j = 0; j < statuses[i].values.size(); j++)
+            {
+                const std::string& key = statuses[i].values[j].key;
+                const double value = atof(statuses[i].values[j].value.c_str());
+                if(key == "map stamp") continue;
+                if(key.size() > 5 && key.compare(key.size() - 5, 5, " [ms]") == 0)
+                    stage_times[prefix + metricName(key.substr(0, key.size() - 5)) + "_ms"].push_back(value);
+                else
+                    metrics[prefix + metricName(key)] = value;
+            }
+        }
+    }
+
+    for(std::map<std::string, std::vector<double> >::const_iterator it = stage_times.begin(); it != stage_times.end(); ++it)
+        metrics[it->first] = median(it->second);
+
+    return true;
+}
+
+
+/**
+ * Peak memory of the nodes so far, as all/node/peak_kb.
+ */
+void PlannerBenchmark::measureMemory(Metrics& metrics)
+{
+    for(size_t i = 0; i < opts_.nodes.size(); i++)
+    {
+        int pid = getNodePid(opts_.nodes[i]);
+        long peak = pid > 0 ? getPeakMemory(pid) : -1;
+        if(peak < 0)
+        {
+            std::cerr << "can't read the peak memory of " << opts_.nodes[i] << " (not a local process?)" << std::endl;
+            continue;
+        }
+        metrics["all/" + opts_.nodes[i].substr(opts_.nodes[i].find_last_of('/') + 1) + "/peak_kb"] = peak;
+    }
+}
+
+
+/**
+ * Compare against the baseline; stage times and memory may only grow up
+ * to their tolerance, result sizes may change by their tolerance either
+ * way. Metrics not in the baseline are only reported. The baseline
+ * metrics that failed are added to failures, with a message.
+ */
+static bool compareMetrics(const BenchmarkOptions& opts, const Metrics& baseline, const Metrics& metrics, std::map<std::string, std::string>& failures)
+{
+    bool pass = true;
+    printf("%-60s %12s %12s %8s\n", "metric", "baseline", "measured", "ratio");
+    for(Metrics::const_iterator it = metrics.begin(); it != metrics.end(); ++it)
+    {
+        const std::string& name = it->first;
+        const double value = it->second;
+        Metrics::const_iterator base = baseline.find(name);
+        if(base == baseline.end())
+        {
+            printf("%-60s %12s %12.3f %8s\n", name.c_str(), "-", value, "-");
+            continue;
+        }
+
+        bool ok;
+        if(name.size() > 3 && name.compare(name.size() - 3, 3, "_ms") == 0)
+            ok = value <= base->second * (1.0 + opts.time_tolerance) + opts.time_slack;
+        else if(name.size() > 3 && name.compare(name.size() - 3, 3, "_kb") == 0)
+            ok = value <= base->second * (1.0 + opts.memory_tolerance);
+        else
+            ok = fabs(value - base->second) <= opts.count_tolerance * std::max(1.0, fabs(base->second));
+
+        printf("%-60s %12.3f %12.3f %8.2f%s\n", name.c_str(), base->second, value,
+                base->second != 0.0 ? value / base->second : 0.0, ok ? "" : "  FAIL");
+        if(!ok)
+        {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "measured %.3f, baseline %.3f", value, base->second);
+            failures[name] = msg;
+        }
+        pass = pass && ok;
+    }
+    for(Metrics::const_iterator it = baseline.begin(); it != baseline.end(); ++it)
+    {
+        if(metrics.find(it->first) == metrics.end())
+        {
+            printf("%-60s %12.3f %12s %8s  FAIL (missing)\n", it->first.c_str(), it->second, "-", "-");
+            failures[it->first] = "not measured";
+            pass = false;
+        }
+    }
+    return pass;
+}
+
+
+/**
+ * Write the comparison as a JUnit (gtest style) result file, as rostest
+ * expects from test nodes.
+ */
+static bool writeResults(const std::string& file, const Metrics& baseline, const std::map<std::string, std::string>& failures)
+{
+    std::ofstream f(file.c_str());
+    if(!f) return false;
+    f << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << std::endl
+        << "<testsuites tests=\"" << baseline.size() << "\" failures=\"" << failures.size() << "\" errors=\"0\" name=\"AllTests\">" << std::endl
+        << "  <testsuite name=\"planner_benchmark\" tests=\"" << baseline.size() << "\" failures=\"" << failures.size() << "\" errors=\"0\">" << std::endl;
+    for(Metrics::const_iterator it = baseline.begin(); it != baseline.end(); ++it)
+    {
+        f << "    <testcase name=\"" << it->first << "\" status=\"run\" classname=\"planner_benchmark\"";
+        std::map<std::string, std::string>::const_iterator failure = failures.find(it->first);
+        if(failure == failures.end())
+            f << " />" << std::endl;
+        else
+            f << ">" << std::endl
+                << "      <failure message=\"" << failure->second << "\" type=\"\" />" << std::endl
+                << "    </testcase>" << std::endl;
+    }
+    f << "  </testsuite>" << std::endl
+        << "</testsuites>" << std::endl;
+    return true;
+}
+
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0 << " [options]" << std::endl
+        << "  --map FILE|synthetic:NAME     map to run (.bt or .ot file, or synthetic:small, medium, large); repeatable" << std::endl
+        << "  --node NAME                   node to expect timing from and to measure (default: /navigation_function" << std::endl
+        << "                                and /next_best_view); repeatable" << std::endl
+        << "  --frame-id ID                 frame of the maps (default: /map)" << std::endl
+        << "  --runs N                      runs per map (default: 3)" << std::endl
+        << "  --timeout S                   time limit for the nodes to process a map (default: 300)" << std::endl
+        << "  --baseline FILE               compare against this baseline" << std::endl
+        << "  --write-baseline FILE         write the measured metrics as a new baseline" << std::endl
+        << "  --time-tolerance R            allowed relative stage time increase (default: 0.25)" << std::endl
+        << "  --time-slack MS               allowed absolute stage time increase (default: 1)" << std::endl
+        << "  --memory-tolerance R          allowed relative peak memory increase (default: 0.1)" << std::endl
+        << "  --count-tolerance R           allowed relative change of result sizes (default: 0.01)" << std::endl
+        << "  --gtest_output=xml:FILE       write the comparison as a JUnit result file (passed by rostest)" << std::endl;
+}
+
+
+static bool parseOptions(int argc, char **argv, BenchmarkOptions& opts)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        if(arg.compare(0, 19, "--gtest_output=xml:") == 0)
+        {
+            opts.result_file = arg.substr(19);
+            continue;
+        }
+        if(i + 1 >= argc)
+            return false;
+        const char *value = argv[++i];
+        if(arg == "--map") opts.maps.push_back(value);
+        else if(arg == "--node") opts.nodes.push_back(value);
+        else if(arg == "--frame-id") opts.frame_id = value;
+        else if(arg == "--runs") opts.runs = atoi(value);
+        else if(arg == "--timeout") opts.timeout = atof(value);
+        else if(arg == "--baseline") opts.baseline_file = value;
+        else if(arg == "--write-baseline") opts.write_baseline_file = value;
+        else if(arg == "--time-tolerance") opts.time_tolerance = atof(value);
+        else if(arg == "--time-slack") opts.time_slack = atof(value);
+        else if(arg == "--memory-tolerance") opts.memory_tolerance = atof(value);
+        else if(arg == "--count-tolerance") opts.count_tolerance = atof(value);
+        else return false;
+    }
+    if(opts.nodes.empty())
+    {
+        opts.nodes.push_back("/navigation_function");
+        opts.nodes.push_back("/next_best_view");
+    }
+    return !opts.maps.empty() && opts.runs > 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "planner_benchmark");
+
+    BenchmarkOptions opts;
+    if(!parseOptions(argc, argv, opts))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    Metrics baseline;
+    if(!opts.baseline_file.empty() && !readMetrics(opts.baseline_file, baseline))
+    {
+        std::cerr << "failed to read baseline " << opts.baseline_file << std::endl;
+        return 2;
+    }
+
+    PlannerBenchmark benchmark(opts);
+    if(!benchmark.waitForNodes())
+    {
+        std::cerr << "timed out waiting for the nodes to connect" << std::endl;
+        return 2;
+    }
+
+    Metrics metrics;
+    for(size_t i = 0; i < opts.maps.size(); i++)
+    {
+        ros::WallTime load_start = ros::WallTime::now();
+        boost::shared_ptr<octomap::OcTree> tree = loadMap(opts.maps[i]);
+        if(!tree)
+        {
+            std::cerr << "failed to load map " << opts.maps[i] << std::endl;
+            return 2;
+        }
+        printf("map %s: %lu leafs, loaded in %.2f s\n", opts.maps[i].c_str(),
+                (unsigned long)tree->getNumLeafNodes(), (ros::WallTime::now() - load_start).toSec());
+
+        if(!benchmark.runMap(mapName(opts.maps[i]), *tree, metrics))
+            return 1;
+    }
+    benchmark.measureMemory(metrics);
+
+    if(!opts.write_baseline_file.empty() && !writeMetrics(opts.write_baseline_file, metrics))
+    {
+        std::cerr << "failed to write baseline " << opts.write_baseline_file << std::endl;
+        return 2;
+    }
+
+    std::map<std::string, std::string> failures;
+    bool pass = compareMetrics(opts, baseline, metrics, failures);
+    printf("%s\n", pass ? "PASS" : "FAIL: regressions beyond tolerance");
+    if(!opts.result_file.empty() && !writeResults(opts.result_file, baseline, failures))
+    {
+        std::cerr << "failed to write results " << opts.result_file << std::endl;
+        return 2;
+    }
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+#include <cmath>
+#include <algorithm>
+
+#include <octomap_path_planner/surface_map.h>
+
+
+namespace
+{
+    // occupied voxels of one column of a leaf
+    struct Run
+    {
+        SurfaceMap::Code start;
+        octomap::key_type max;
+
+        bool operator<(const Run& o) const {return start < o.start;}
+    };
+}
+
+
+/**
+ * Build the map from the occupied leafs of tree.
+ */
+void SurfaceMap::build(const octomap::OcTree& tree, double robot_height, double max_superable_height, bool treat_unknown_as_free)
+{
+    surfaces_.clear();
+    traversable_.clear();
+    obstacle_runs_.clear();
+    obstacle_run_max_.clear();
+
+    const unsigned tree_depth = tree.getTreeDepth();
+    const double res = tree.getResolution();
+    const int steps = ceil(robot_height / res);
+
+    std::vector<Run> runs;
+    for(octomap::OcTree::leaf_iterator it = tree.begin_leafs(); it != tree.end_leafs(); ++it)
+    {
+        if(!tree.isNodeOccupied(*it)) continue;
+        const octomap::OcTreeKey k = it.getIndexKey();
+        const unsigned s = 1 << (tree_depth - it.getDepth());
+        Run r;
+        r.max = k[2] + s - 1;
+        for(unsigned x = k[0]; x < k[0] + s; x++)
+        {
+            for(unsigned y = k[1]; y < k[1] + s; y++)
+            {
+                r.start = encode(x, y, k[2]);
+                runs.push_back(r);
+            }
+        }
+    }
+    std::sort(runs.begin(), runs.end());
+
+    for(size_t i = 0; i < runs.size(); )
+    {
+        // merge the adjacent runs of the column:
+        const Code column = runs[i].start >> 16;
+        const unsigned zmin = runs[i].start & 0xFFFF;
+        unsigned zmax = runs[i].max;
+        for(i++; i < runs.size() && (runs[i].start >> 16) == column && (runs[i].start & 0xFFFF) == zmax + 1; i++)
+            zmax = runs[i].max;
+        const unsigned next = i < runs.size() && (runs[i].start >> 16) == column ? unsigned(runs[i].start & 0xFFFF) : 0x10000;
+
+        // ground: free (or unknown, if treated as free) for steps voxels above
+        bool ground = next - zmax - 1 >= unsigned(steps);
+        if(ground && !treat_unknown_as_free)
+        {
+            octomap::OcTreeKey k = decode((column << 16) | zmax);
+            for(int s = 0; s < steps && ground; s++)
+            {
+                k[2]++;
+                ground = tree.search(k) != 0;
+            }
+        }
+        if(ground)
+            surfaces_.push_back((column << 16) | zmax);
+
+        // obstacle: runs too tall to step over (but their surface)
+        const unsigned top = ground ? zmax - 1 : zmax;
+        if(res * (zmax - zmin + 1) > max_superable_height && top + 1 > zmin)
+        {
+            obstacle_runs_.push_back((column << 16) | zmin);
+            obstacle_run_max_.push_back(top);
+        }
+    }
+
+    traversable_.assign(surfaces_.size(), 1);
+}
+
+
+/**
+ * Mark as not traversable the surfaces closer than radius (in voxels) to
+ * an obstacle voxel.
+ */
+void SurfaceMap::inflate(double radius)
+{
+    for(size_t i = 0; i < surfaces_.size(); i++)
+        traversable_[i] = !isNearObstacle(key(i), radius);
+}
+
+
+bool SurfaceMap::isNearObstacle(const octomap::OcTreeKey& key, double radius) const
+{
+    const double r2 = radius * radius;
+    const int r = ceil(radius);
+    for(int dx = -r; dx <= r; dx++)
+    {
+        const int x = key[0] + dx;
+        if(x < 0 || x > 0xFFFF) continue;
+        for(int dy = -r; dy <= r; dy++)
+        {
+            const int y = key[1] + dy;
+            const double dxy2 = dx * dx + dy * dy;
+            if(y < 0 || y > 0xFFFF || dxy2 >= r2) continue;
+
+            std::vector<Code>::const_iterator it = std::lower_bound(obstacle_runs_.begin(), obstacle_runs_.end(), encode(x, y, 0));
+            for(; it != obstacle_runs_.end() && (*it >> 16) == ((Code(x) << 16) | y); ++it)
+            {
+                const int zmin = *it & 0xFFFF, zmax = obstacle_run_max_[it - obstacle_runs_.begin()];
+                const int dz = key[2] < zmin ? zmin - key[2] : key[2] > zmax ? key[2] - zmax : 0;
+                if(dxy2 + dz * dz < r2) return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Index of the surface at key, or -1.
+ */
+int SurfaceMap::find(const octomap::OcTreeKey& key) const
+{
+    const Code c = encode(key[0], key[1], key[2]);
+    std::vector<Code>::const_iterator it = std::lower_bound(surfaces_.begin(), surfaces_.end(), c);
+    return it != surfaces_.end() && *it == c ? int(it - surfaces_.begin()) : -1;
+}
+
+
+/**
+ * Traversable surfaces in the columns within radius (in voxels, in the xy
+ * plane) of surface i, at most max_step voxels above or below it, with
+ * their squared distances in voxels.
+ */
+void SurfaceMap::neighbors(size_t i, double radius, int max_step, std::vector<int>& indices, std::vector<float>& sqr_distances) const
+{
+    indices.clear();
+    sqr_distances.clear();
+
+    const octomap::OcTreeKey k = key(i);
+    const double r2 = radius * radius;
+    const int r = floor(radius);
+    for(int dx = -r; dx <= r; dx++)
+    {
+        const int x = k[0] + dx;
+        if(x < 0 || x > 0xFFFF) continue;
+        for(int dy = -r; dy <= r; dy++)
+        {
+            const int y = k[1] + dy;
+            if(y < 0 || y > 0xFFFF || dx * dx + dy * dy > r2) continue;
+
+            const int zmin = std::max(0, k[2] - max_step);
+            const Code end = encode(x, y, std::min(0xFFFF, k[2] + max_step));
+            std::vector<Code>::const_iterator it = std::lower_bound(surfaces_.begin(), surfaces_.end(), encode(x, y, zmin));
+            for(; it != surfaces_.end() && *it <= end; ++it)
+            {
+                const size_t j = it - surfaces_.begin();
+                if(j == i || !traversable_[j]) continue;
+                const int dz = int(*it & 0xFFFF) - k[2];
+                indices.push_back(j);
+                sqr_distances.push_back(dx * dx + dy * dy + dz * dz);
+            }
+        }
+    }
+}
+
+
+/**
+ * Add the obstacle voxels to obstacles (and sort it).
+ */
+void SurfaceMap::getObstacles(MortonKeySet& obstacles) const
+{
+    for(size_t i = 0; i < obstacle_runs_.size(); i++)
+    {
+        octomap::OcTreeKey k = decode(obstacle_runs_[i]);
+        for(unsigned z = k[2]; z <= obstacle_run_max_[i]; z++)
+        {
+            k[2] = z;
+            obstacles.push_back(k);
+        }
+    }
+    obstacles.sort();
+}
+
+
+size_t SurfaceMap::memoryUsage() const
+{
+    return surfaces_.capacity() * sizeof(Code) + traversable_.capacity()
+        + obstacle_runs_.capacity() * sizeof(Code) + obstacle_run_max_.capacity() * sizeof(octomap::key_type);
+}
@@ -0,0 +1,289 @@
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <limits>
+
+#include <gtest/gtest.h>
+
+#include <octomap_path_planner/morton_voxel_set.h>
+#include <octomap_path_planner/incremental_relaxation.h>
+
+
+// grid of W x W cells at z = 0, with the voxel keys of octomap's center
+static const int W = 48;
+static const int O = 32768;
+static const double RADIUS = 1.5;
+static const float RESOLUTION = 0.1f;
+
+
+/**
+ * The ground neighbors of a voxel, as in navigation_function_node: all
+ * voxels within RADIUS.
+ */
+struct GridNeighbors
+{
+    const MortonKeySet& ground;
+
+    GridNeighbors(const MortonKeySet& g) : ground(g) {}
+
+    void operator()(size_t i, std::vector<int>& indices, std::vector<float>& lengths) const
+    {
+        std::vector<float> sqr_distances;
+        ground.radiusSearch(ground.key(i), RADIUS, indices, sqr_distances);
+        lengths.clear();
+        size_t k = 0;
+        for(size_t n = 0; n < indices.size(); n++)
+        {
+            if(indices[n] == int(i)) continue;
+            indices[k++] = indices[n];
+            lengths.push_back(RESOLUTION * std::sqrt(sqr_distances[n]));
+        }
+        indices.resize(k);
+    }
+};
+
+
+/**
+ * The distance to the robot voxel, as RobotDistance in
+ * navigation_function_node.
+ */
+struct RobotDistance
+{
+    const MortonKeySet *ground;
+    octomap::OcTreeKey robot;
+    float resolution;
+
+    RobotDistance() : ground(0), resolution(0.0f) {}
+
+    RobotDistance(const MortonKeySet& g, int robot_idx) : ground(&g), resolution(robot_idx == -1 ? 0.0f : RESOLUTION)
+    {
+        if(robot_idx != -1) robot = g.key(robot_idx);
+    }
+
+    float operator()(size_t i) const
+    {
+        if(resolution == 0.0f) return 0.0f;
+        return 0.999f * std::sqrt(MortonKeySet::squaredDistance(ground->key(i), robot)) * resolution;
+    }
+};
+
+
+struct AllKeys
+{
+    bool operator()(const octomap::OcTreeKey& k) const {return true;}
+};
+
+
+struct BelowX
+{
+    int x;
+
+    BelowX(int x_) : x(x_) {}
+
+    bool operator()(const octomap::OcTreeKey& k) const {return k[0] < x;}
+};
+
+
+static octomap::OcTreeKey cell(int x, int y)
+{
+    return octomap::OcTreeKey(O + x, O + y, O);
+}
+
+
+static void fillGround(const std::vector<std::vector<char> >& free, MortonVoxelMap<float>& ground)
+{
+    ground.clear();
+    for(int x = 0; x < W; x++)
+        for(int y = 0; y < W; y++)
+            if(free[x][y]) ground.push_back(cell(x, y), std::numeric_limits<float>::infinity());
+    ground.sort();
+}
+
+
+static bool sameValue(float a, float b)
+{
+    return a == b || (std::isinf(a) && std::isinf(b));
+}
+
+
+TEST(CarryValues, keepsValuesOfRemainingVoxels)
+{
+    MortonVoxelMap<float> previous, ground;
+    previous.push_back(cell(0, 0), 1.0f);
+    previous.push_back(cell(1, 0), 2.0f);
+    previous.push_back(cell(2, 0), 3.0f);
+    previous.sort();
+    ground.push_back(cell(1, 0), 0.0f);
+    ground.push_back(cell(2, 0), 0.0f);
+    ground.push_back(cell(3, 0), 0.0f);
+    ground.sort();
+
+    std::vector<octomap::OcTreeKey> added, removed;
+    carryValues(previous, ground, AllKeys(), added, removed);
+
+    EXPECT_EQ(2.0f, ground.value(ground.find(cell(1, 0))));
+    EXPECT_EQ(3.0f, ground.value(ground.find(cell(2, 0))));
+    EXPECT_TRUE(std::isinf(ground.value(ground.find(cell(3, 0)))));
+    ASSERT_EQ(1u, added.size());
+    EXPECT_TRUE(added[0] == cell(3, 0));
+    ASSERT_EQ(1u, removed.size());
+    EXPECT_TRUE(removed[0] == cell(0, 0));
+}
+
+
+TEST(CarryValues, leavesVoxelsOutsideRegion)
+{
+    // previous holds only the old voxels in the region, as in
+    // NavigationFunction::filterInflatedRegionFromGround()
+    MortonVoxelMap<float> previous, ground;
+    previous.push_back(cell(0, 0), 1.0f);
+    previous.sort();
+    ground.push_back(cell(1, 0), 0.0f);
+    ground.push_back(cell(5, 0), 7.0f);
+    ground.sort();
+
+    std::vector<octomap::OcTreeKey> added, removed;
+    carryValues(previous, ground, BelowX(O + 4), added, removed);
+
+    EXPECT_TRUE(std::isinf(ground.value(ground.find(cell(1, 0)))));
+    EXPECT_EQ(7.0f, ground.value(ground.find(cell(5, 0))));
+    ASSERT_EQ(1u, added.size());
+    EXPECT_TRUE(added[0] == cell(1, 0));
+    ASSERT_EQ(1u, removed.size());
+    EXPECT_TRUE(removed[0] == cell(0, 0));
+}
+
+
+/**
+ * Blocks of cells are freed and blocked at random, and the field repaired
+ * the way NavigationFunction::repairDistanceTransform() does (with an
+ * anytime run to the robot every third time, leaving nodes pending across
+ * the next change) must equal the field computed from scratch.
+ */
+TEST(IncrementalRelaxation, repairMatchesFromScratch)
+{
+    typedef IncrementalRelaxation<GridNeighbors, RobotDistance> Relaxation;
+
+    srand(1);
+    const int gx = W / 3, gy = W / 3, rx = 2 * W / 3, ry = W / 2;
+    std::vector<std::vector<char> > free(W, std::vector<char>(W, 1));
+    for(int x = 0; x < W; x++)
+        for(int y = 0; y < W; y++)
+            if(rand() % 10 == 0) free[x][y] = 0;
+    free[gx][gy] = free[rx][ry] = 1;
+
+    MortonVoxelMap<float> ground, reference;
+    const GridNeighbors neighbors(ground), reference_neighbors(reference);
+    Relaxation relaxation(neighbors, ground.values());
+    Relaxation scratch(reference_neighbors, reference.values());
+
+    for(int iteration = 0; iteration < 60; iteration++)
+    {
+        MortonVoxelMap<float> previous = ground;
+        std::vector<octomap::OcTreeKey> dirty_keys, removed_keys;
+
+        if(iteration > 0)
+        {
+            // (savePendingVoxels())
+            std::vector<int> pending;
+            relaxation.takePending(pending);
+            for(size_t k = 0; k < pending.size(); k++)
+                dirty_keys.push_back(previous.key(pending[k]));
+
+            const int cx = rand() % W, cy = rand() % W, value = rand() % 2;
+            for(int x = std::max(0, cx - 3); x <= std::min(W - 1, cx + 3); x++)
+                for(int y = std::max(0, cy - 3); y <= std::min(W - 1, cy + 3); y++)
+                    free[x][y] = value;
+            free[gx][gy] = free[rx][ry] = 1;
+        }
+
+        fillGround(free, ground);
+        carryValues(previous, ground, AllKeys(), dirty_keys, removed_keys);
+
+        const int goal_idx = ground.find(cell(gx, gy)), robot_idx = ground.find(cell(rx, ry));
+        ASSERT_NE(-1, goal_idx);
+        ASSERT_NE(-1, robot_idx);
+        const RobotDistance heuristic(ground, robot_idx);
+
+        if(iteration == 0)
+        {
+            relaxation.reset(goal_idx, heuristic);
+        }
+        else
+        {
+            std::vector<int> dirty, indices;
+            std::vector<float> sqr_distances;
+            for(size_t k = 0; k < dirty_keys.size(); k++)
+            {
+                const int i = ground.find(dirty_keys[k]);
+                if(i != -1) dirty.push_back(i);
+            }
+            for(size_t k = 0; k < removed_keys.size(); k++)
+            {
+                ground.radiusSearch(removed_keys[k], RADIUS, indices, sqr_distances);
+                dirty.insert(dirty.end(), indices.begin(), indices.end());
+            }
+            relaxation.update(goal_idx, dirty, heuristic);
+        }
+
+        const bool anytime = iteration % 3 == 1;
+        relaxation.run(anytime ? robot_idx : -1, 0.3f);
+
+        reference = ground;
+        scratch.reset(goal_idx, RobotDistance());
+        scratch.run();
+
+        // the robot's value is final even after an anytime run
+        EXPECT_TRUE(sameValue(reference.value(robot_idx), ground.value(robot_idx))) << "iteration " << iteration;
+        if(anytime) continue;
+
+        EXPECT_TRUE(relaxation.done());
+        size_t mismatches = 0;
+        for(size_t i = 0; i < ground.size(); i++)
+            if(!sameValue(reference.value(i), ground.value(i))) mismatches++;
+        EXPECT_EQ(0u, mismatches) << "iteration " << iteration;
+    }
+}
+
+
+/**
+ * Nodes left pending by an anytime run, taken with takePending() and
+ * handed back to update() unchanged, are repaired as if never taken.
+ */
+TEST(IncrementalRelaxation, takePendingResumesRun)
+{
+    typedef IncrementalRelaxation<GridNeighbors, RobotDistance> Relaxation;
+
+    std::vector<std::vector<char> > free(W, std::vector<char>(W, 1));
+    MortonVoxelMap<float> ground, reference;
+    fillGround(free, ground);
+    reference = ground;
+    const GridNeighbors neighbors(ground), reference_neighbors(reference);
+
+    const int goal_idx = ground.find(cell(0, 0)), robot_idx = ground.find(cell(4, 4));
+    Relaxation relaxation(neighbors, ground.values());
+    relaxation.reset(goal_idx, RobotDistance(ground, robot_idx));
+    relaxation.run(robot_idx);
+    EXPECT_FALSE(relaxation.done());
+
+    std::vector<int> pending;
+    relaxation.takePending(pending);
+    EXPECT_FALSE(pending.empty());
+    EXPECT_TRUE(relaxation.done());
+    relaxation.update(goal_idx, pending, RobotDistance());
+    relaxation.run();
+    EXPECT_TRUE(relaxation.done());
+
+    Relaxation scratch(reference_neighbors, reference.values());
+    scratch.reset(goal_idx, RobotDistance());
+    scratch.run();
+    for(size_t i = 0; i < ground.size(); i++)
+        EXPECT_TRUE(sameValue(reference.value(i), ground.value(i))) << "voxel " << i;
+}
+
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,125 @@
+#include <cmath>
+#include <queue>
+#include <vector>
+#include <limits>
+#include <functional>
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include <octomap_path_planner/worker_pool.h>
+#include <octomap_path_planner/parallel_relaxation.h>
+
+
+/**
+ * n x n grid, 8-connected, with a regular pattern of blocked cells (which
+ * have no neighbors, and aren't anyone's neighbor).
+ */
+struct Grid
+{
+    int n;
+
+    Grid(int n_) : n(n_) {}
+
+    bool blocked(int x, int y) const {return (x * 7 + y * 3) % 11 == 0;}
+
+    void operator()(size_t i, std::vector<int>& indices, std::vector<float>& lengths) const
+    {
+        indices.clear();
+        lengths.clear();
+        const int x = i % n, y = i / n;
+        if(blocked(x, y)) return;
+        for(int dy = -1; dy <= 1; dy++)
+        {
+            for(int dx = -1; dx <= 1; dx++)
+            {
+                const int a = x + dx, b = y + dy;
+                if((dx == 0 && dy == 0) || a < 0 || b < 0 || a >= n || b >= n || blocked(a, b)) continue;
+                indices.push_back(b * n + a);
+                lengths.push_back(std::sqrt(float(dx * dx + dy * dy)));
+            }
+        }
+    }
+};
+
+
+static std::vector<float> dijkstra(const Grid& grid, size_t source)
+{
+    typedef std::pair<float, int> Entry;
+    std::vector<float> values(grid.n * grid.n, std::numeric_limits<float>::infinity());
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > queue;
+    std::vector<int> indices;
+    std::vector<float> lengths;
+    values[source] = 0.0f;
+    queue.push(Entry(0.0f, source));
+    while(!queue.empty())
+    {
+        const Entry e = queue.top();
+        queue.pop();
+        if(e.first > values[e.second]) continue;
+        grid(e.second, indices, lengths);
+        for(size_t k = 0; k < indices.size(); k++)
+        {
+            const float v = e.first + lengths[k];
+            if(v >= values[indices[k]]) continue;
+            values[indices[k]] = v;
+            queue.push(Entry(v, indices[k]));
+        }
+    }
+    return values;
+}
+
+
+static void expectSameField(const std::vector<float>& expected, const std::vector<float>& values)
+{
+    ASSERT_EQ(expected.size(), values.size());
+    size_t mismatches = 0;
+    for(size_t i = 0; i < values.size(); i++)
+    {
+        if(std::isinf(expected[i]) != std::isinf(values[i]))
+            mismatches++;
+        else if(!std::isinf(expected[i]) && std::fabs(expected[i] - values[i]) > 1e-5 * std::max(1.0f, expected[i]))
+            mismatches++;
+    }
+    EXPECT_EQ(0u, mismatches);
+}
+
+
+class ParallelRelaxationTest : public testing::TestWithParam<int>
+{
+};
+
+
+/**
+ * With any number of threads and any tiling, the result is that of a
+ * sequential Dijkstra, also when the pool is reused for several runs.
+ */
+TEST_P(ParallelRelaxationTest, matchesDijkstra)
+{
+    const Grid grid(200);
+    const size_t size = grid.n * grid.n, source = 5;
+    const std::vector<float> expected = dijkstra(grid, source);
+
+    WorkerPool pool(GetParam());
+    const size_t tile_sizes[] = {64, 1024, size};
+    for(size_t t = 0; t < sizeof(tile_sizes) / sizeof(tile_sizes[0]); t++)
+    {
+        for(int repeat = 0; repeat < 2; repeat++)
+        {
+            std::vector<float> values(size, std::numeric_limits<float>::infinity());
+            ParallelRelaxation<Grid> relaxation(grid, size, values, 16.0f, tile_sizes[t]);
+            EXPECT_GT(relaxation.run(source, pool), 0u);
+            SCOPED_TRACE(testing::Message() << "tile size " << tile_sizes[t]);
+            expectSameField(expected, values);
+        }
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(Threads, ParallelRelaxationTest, testing::Values(0, 1, 4));
+
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}